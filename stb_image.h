@@ -238,12 +238,214 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// On x64 with MSVC, GCC or Clang, the JPEG IDCT and color conversion also
+// have AVX2 versions, which are compiled in without needing -mavx2 and used
+// only if a run-time check finds AVX2. Define STBI_NO_AVX2 to leave them out.
+//
+// The conversions between channel counts done for req_comp (grey or RGB to
+// RGBA, RGBA to RGB, RGB(A) to grey) use SSE2, AVX2 or NEON in the same way,
+// as do PNG unfiltering and BMP/TGA/PSD unpacking. Their NEON versions
+// haven't been built on ARM yet, so they're left out unless
+// STBI_NEON_EXPERIMENTAL is defined as well as STBI_NEON.
+// Radiance .hdr scanlines are converted from RGBE to float with SSE2.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
 // ===========================================================================
 //
+// Multithreaded JPEG decoding
+//
+// stb_image doesn't create threads, but baseline JPEGs that use restart
+// intervals (most camera JPEGs do) can be entropy-decoded in parallel on
+// threads you supply. Call
+//
+//     stbi_load_jpeg_parallel_from_memory(buffer, len, &x, &y, &n, 0, my_parallel_for, my_pool);
+//
+// where my_parallel_for matches stbi_parallel_for: it must run task(task_data,i)
+// for every i in [0,count) and only return once all of them have finished,
+// e.g. by handing them to a thread pool and waiting. The result is identical
+// to stbi_load_from_memory. Progressive JPEGs, JPEGs without restart markers
+// and non-JPEG files are decoded serially on the calling thread.
+//
+// stbi_load_png_parallel() and friends take the same dispatcher and overlap
+// the two halves of a PNG decode: each step runs two tasks, one inflating the
+// next stretch of scanlines while the other unfilters, palette-expands and
+// converts the stretch before it. Interlaced PNGs and non-PNG files are
+// decoded serially.
+//
+// ===========================================================================
+//
+// Reduced-size JPEG decoding
+//
+// For thumbnails and previews, stbi_load_jpeg_scaled() and friends take a
+// scale_denom of 1, 2, 4 or 8 and decode the JPEG directly at that fraction
+// of its size, by running a smaller IDCT on the low-frequency coefficients.
+// This is much faster and uses less memory than decoding at full size and
+// resizing. The returned size is rounded up, e.g. 1/8 of 100x100 is 13x13.
+// Files that are not JPEGs are loaded at full size.
+//
+// ===========================================================================
+//
+// Low-memory progressive JPEG decoding
+//
+// A progressive JPEG can't be turned into pixels until its last scan, so all
+// of its coefficients are held until then: normally 2 bytes each, on top of
+// the decoded image. stbi_load_jpeg_progressive() and friends instead keep
+// each block's DC as 2 bytes and its AC coefficients as one byte each, moving
+// only the rare blocks with a larger AC value to full size, and allocate the
+// component planes only at the end, releasing each component's coefficients
+// as soon as it has been transformed. That's a bit over 1 byte per
+// coefficient, at some cost in speed.
+//
+// They can also call you back with a 1/8-scale preview as soon as the DC
+// scans are in, typically after a small fraction of the file has been
+// decoded, e.g. to show a placeholder or make a thumbnail early:
+//
+//      void show(void *user, stbi_uc const *pixels, int w, int h, int n) { ... }
+//      img = stbi_load_jpeg_progressive(filename, &x, &y, &n, 3, show, window);
+//
+// The preview has the same channels as the result, and is flipped if
+// stbi_set_flip_vertically_on_load is set. Baseline JPEGs are decoded
+// normally and get no preview; other files are loaded as with stbi_load.
+//
+// ===========================================================================
+//
+// Planar YCbCr JPEG output
+//
+// A JPEG stores its luma and (usually subsampled) chroma as separate planes.
+// stbi_load_jpeg_yuv() and friends return those planes as decoded, skipping
+// chroma upsampling and color conversion, for code that wants YUV anyway,
+// e.g. to feed a video encoder:
+//
+//      stbi_jpeg_yuv yuv;
+//      stbi_uc *mem = stbi_load_jpeg_yuv(filename, &x, &y, &yuv);
+//      // yuv.plane[0] is x*y luma, yuv.plane[1] and [2] are yuv.w[1] by
+//      // yuv.h[1] Cb and Cr, e.g. (x+1)/2 by (y+1)/2 for 4:2:0
+//      stbi_image_free(mem);
+//
+// All planes are in the one returned block, each packed with w[k] bytes per
+// row. Samples are full range (JFIF). Files that store RGB or CMYK planes
+// rather than YCbCr(K) are returned as stored, with yuv.ycbcr set to 0.
+// Files that aren't JPEGs fail.
+//
+// ===========================================================================
+//
+// Custom allocators
+//
+// STBI_MALLOC etc. apply to every decode. To route one decode's allocations
+// somewhere else, e.g. a per-thread arena that is reset after each image,
+// pass a stbi_allocator to stbi_load_from_memory_with_allocator() and
+// friends. All of that decode's allocations, including the returned image,
+// go through it, from the calling thread; so free the result with your own
+// release function (or by resetting the arena), not stbi_image_free(). If
+// 'resize' is NULL, growing a buffer allocates a new one and copies; if
+// 'release' is NULL, nothing is freed until you reclaim the memory yourself.
+//
+// ===========================================================================
+//
+// Reusable decoders
+//
+// Decoding many images one after another, most of the time can go to setting
+// up and tearing down the decoder's working memory. A stbi_decoder keeps the
+// blocks it hands out once they're freed, and reuses them for the next image:
+//
+//      stbi_decoder *d = stbi_decoder_create();
+//      for (each image) {
+//         unsigned char *img = stbi_decoder_load_from_memory(d, buf, len, &x, &y, &n, 4);
+//         ... use img ...
+//         stbi_decoder_image_free(d, img);  // back to the decoder, not the heap
+//      }
+//      stbi_decoder_free(d);
+//
+// After the first few images of a similar size, decodes make no heap
+// allocations: the JPEG decoder state and component buffers, the zlib output
+// and PNG scratch buffers, and the result all come from blocks the decoder
+// already holds (a block handed out is never shrunk, and growing one that
+// has the room is free). Use stbi_decoder_allocator() to get the same
+// behaviour from any *_with_allocator function. A decoder is not thread-safe;
+// give each thread its own. It keeps at most STBI_DECODER_CACHE (default 32)
+// free blocks, and returns everything to the heap in stbi_decoder_free().
+//
+// ===========================================================================
+//
+// Batch loading
+//
+// To load many images at startup, describe each one with a stbi_batch_item
+// (a filename, or a buffer and length, plus desired_channels) and call
+//
+//     int ok = stbi_load_batch(items, count, results, 8, my_parallel_for, my_pool,
+//                              my_done, my_data, STBI_BATCH_AS_READY);
+//
+// This runs num_workers tasks through my_parallel_for (see "Multithreaded
+// JPEG decoding" above). Each task takes the next undecoded item off a
+// shared queue until none are left, decoding through its own stbi_decoder,
+// so a worker's scratch memory is reused from one image to the next. Item i
+// ends up in results[i], and stbi_load_batch returns how many succeeded.
+// Free each result's data with stbi_batch_image_free(), whatever thread
+// you're on.
+//
+// done, if not NULL, is called once per item. With STBI_BATCH_AS_READY it is
+// called on the worker, as soon as that item is decoded, so it must be
+// thread-safe. With STBI_BATCH_IN_ORDER it is called in item order, as soon
+// as that item and every one before it are decoded, on whichever worker
+// finished the last of them; calls never overlap. (On compilers without
+// atomics it waits for the whole batch and runs on the calling thread.) With
+// a NULL parallel_for (or num_workers <= 1) everything runs on the calling
+// thread, and done is called in item order, after each item.
+//
+// Items are decoded with the calling thread's vertical flip setting, even
+// on worker threads; the workers' own settings aren't touched. Each
+// item's failure reason is read on the thread that decoded it. After the
+// batch, stbi_failure_reason() on the calling thread reports the first
+// failed item's reason. Output is 8 bits per channel.
+//
+// ===========================================================================
+//
+// Row-at-a-time decoding
+//
+// To decode very large images without holding all of them in memory, open
+// a stbi_stream and read rows into a buffer of your own, top to bottom:
+//
+//     stbi_stream *st = stbi_stream_open("big.png", &x, &y, &n, 3);
+//     while ((rows = stbi_stream_read_rows(st, buf, 0, 16)) > 0)
+//        ... use rows*x*3 bytes of buf ...
+//     stbi_stream_close(st);
+//
+// Baseline interleaved JPEGs and non-interlaced PNGs are decoded as you
+// read, using memory proportional to the width of the image. Anything else
+// (progressive JPEGs, interlaced PNGs, other formats) is decoded whole when
+// the stream is opened. Output is always 8 bits per channel, and
+// stbi_set_flip_vertically_on_load() is ignored. A stream opened from a file
+// keeps the file open until stbi_stream_close().
+//
+// stbi_load_into() and friends use the same machinery to decode directly
+// into a buffer you provide (e.g. mapped GPU upload memory), with any row
+// stride, applying the channel conversion and vertical flip on the way.
+//
+// stbi_load_region() and friends return just a rectangle of the image, e.g.
+// a map tile or a face crop, decoding only as far down as its bottom edge.
+// For the streamed JPEGs above, MCUs away from the rectangle are only
+// entropy-decoded (no IDCT or color conversion), and rows above it aren't
+// converted either; PNG rows above it are only unfiltered. Pixels are the
+// same as cropping the full decode. Other files are decoded whole and cropped.
+//
+// stbi_gif_open() and stbi_gif_next_frame() step through an animated GIF a
+// frame at a time, so memory stays at a few frames however long the
+// animation is, where stbi_load_gif_from_memory() returns all of them in one
+// block:
+//
+//     stbi_gif_frames *gf = stbi_gif_open("anim.gif", &x, &y, &n, 4);
+//     while (stbi_gif_next_frame(gf, &frame, &delay_ms) > 0)
+//        ... use x*y*4 bytes of frame ...
+//     stbi_gif_close(gf);
+//
+// Frames are flipped as in stbi_load_gif_from_memory() if vertical flipping
+// was on when the GIF was opened.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image supports loading HDR images in general, and currently the Radiance
@@ -335,6 +537,36 @@ RECENT REVISION HISTORY:
 //    huge block of memory and spend disproportionate time decoding it. By
 //    default this is set to (1 << 24), which is 16777216, but that's still
 //    very big.
+//
+//  - The JPEG decoder resolves Huffman codes of up to STBI_JPEG_FAST_BITS
+//    bits (default 10) with a single table lookup; for AC coefficients the
+//    lookup also covers the run length and the coefficient value when they
+//    fit. Each step up doubles the tables (8KB per AC table at 10 bits) and
+//    sends fewer codes down the slow path. It must be from 1 to 15 (the AC
+//    table packs code and value lengths into 4 bits); 9 to 12 are sensible.
+//
+//  - If you define STBI_MMAP on a Unix-like system (__unix__ or __APPLE__),
+//    the functions that take a filename and decode the whole file
+//    (stbi_load, stbi_load_16, stbi_loadf, the _parallel loaders and
+//    stbi_load_batch) map it with mmap() and decode it in place, as if it
+//    had been passed to the _from_memory variant. The header queries
+//    (stbi_info and friends) still read through stdio, which is cheaper for
+//    them. Files that can't be mapped (pipes, empty files, files over 2GB)
+//    fall back to stdio. Only use it for files nothing else will truncate
+//    while they're being decoded: that raises SIGBUS rather than failing
+//    the load.
+//
+//  - To see where decoding time goes, #define STBI_PROFILE(stage,begin)
+//    before creating the implementation. It is invoked with begin=1 when a
+//    stage starts and begin=0 when it ends; stage is one of the
+//    STBI_PROFILE_* values below (JPEG entropy decoding, IDCT, upsampling and
+//    color conversion; PNG inflate and unfilter), which are only declared
+//    when STBI_PROFILE is. Stages nest: the IDCT runs inside entropy
+//    decoding for baseline JPEGs, so charge time to the innermost open stage.
+//    Profiled builds queue up the IDCTs and run them an MCU row at a time, so
+//    the hook isn't called per block. With the parallel loaders it is also
+//    invoked on your threads.
+//    tests/image_bench.c is an example.
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
@@ -352,6 +584,19 @@ enum
    STBI_rgb_alpha  = 4
 };
 
+#ifdef STBI_PROFILE
+enum
+{
+   STBI_PROFILE_ENTROPY,   // JPEG Huffman decoding
+   STBI_PROFILE_IDCT,      // JPEG dequantize and inverse DCT
+   STBI_PROFILE_UPSAMPLE,  // JPEG chroma upsampling
+   STBI_PROFILE_COLOR,     // JPEG YCbCr/CMYK to RGB
+   STBI_PROFILE_INFLATE,   // PNG zlib decompression
+   STBI_PROFILE_UNFILTER,  // PNG scanline filters and bit depth expansion
+   STBI_PROFILE_STAGES
+};
+#endif
+
 #include <stdlib.h>
 typedef unsigned char stbi_uc;
 typedef unsigned short stbi_us;
@@ -384,6 +629,16 @@ typedef struct
    int      (*eof)   (void *user);                       // returns nonzero if we are at end of file/data
 } stbi_io_callbacks;
 
+// per-decode allocator, for the *_with_allocator functions: every allocation
+// made while decoding (including the returned image) goes through it
+typedef struct
+{
+   void *(*alloc)  (void *user,size_t size);
+   void *(*resize) (void *user,void *p,size_t oldsize,size_t newsize); // may be NULL: alloc, copy, release
+   void  (*release)(void *user,void *p);                               // may be NULL, e.g. for an arena
+   void   *user;
+} stbi_allocator;
+
 ////////////////////////////////////
 //
 // 8-bits-per-channel interface
@@ -392,6 +647,21 @@ typedef struct
 STBIDEF stbi_uc *stbi_load_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
 
+// as above, with all allocations (including the result) made through alloc
+STBIDEF stbi_uc *stbi_load_from_memory_with_allocator   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+STBIDEF stbi_uc *stbi_load_from_callbacks_with_allocator(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+
+// reusable decoder that keeps its working memory between images; the result
+// belongs to the decoder, give it back with stbi_decoder_image_free()
+typedef struct stbi__decoder stbi_decoder;
+
+STBIDEF stbi_decoder         *stbi_decoder_create(void);
+STBIDEF void                  stbi_decoder_free(stbi_decoder *d);
+STBIDEF stbi_allocator const *stbi_decoder_allocator(stbi_decoder *d);
+STBIDEF stbi_uc *stbi_decoder_load_from_memory   (stbi_decoder *d, stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_decoder_load_from_callbacks(stbi_decoder *d, stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF void     stbi_decoder_image_free(stbi_decoder *d, void *retval_from_stbi_decoder_load);
+
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_uc *stbi_load            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -406,6 +676,132 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
 
+// job dispatcher for the multithreaded decoders: must call task(task_data,i)
+// exactly once for every i in [0,count), from any threads in any order, and
+// must not return until all of those calls have returned
+typedef void stbi_parallel_for(void *user, void (*task)(void *task_data, int index), void *task_data, int count);
+
+// decode many images at once; see "Batch loading" above
+typedef struct
+{
+   char const    *filename;  // loaded from this file if not NULL (needs stdio)...
+   stbi_uc const *buffer;    // ...otherwise from these len bytes
+   int            len;
+   int            desired_channels;
+} stbi_batch_item;
+
+typedef struct
+{
+   stbi_uc    *data;           // NULL on failure; free with stbi_batch_image_free()
+   int         x, y, comp;
+   char const *failure_reason; // NULL on success
+} stbi_batch_result;
+
+typedef void stbi_batch_done(void *user, int index, stbi_batch_result *result);
+
+#define STBI_BATCH_IN_ORDER  0
+#define STBI_BATCH_AS_READY  1
+
+STBIDEF int  stbi_load_batch(stbi_batch_item const *items, int count, stbi_batch_result *results, int num_workers, stbi_parallel_for *parallel_for, void *parallel_user, stbi_batch_done *done, void *done_user, int done_order);
+STBIDEF void stbi_batch_image_free(void *retval_from_stbi_load_batch);
+
+#ifndef STBI_NO_JPEG
+STBIDEF stbi_uc *stbi_load_jpeg_parallel_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_parallel_for *parallel_for, void *user);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_parallel(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_parallel_for *parallel_for, void *user);
+#endif
+
+// decode a JPEG at 1/scale_denom of its size (scale_denom = 1, 2, 4 or 8);
+// *x and *y return the reduced size, rounded up
+STBIDEF stbi_uc *stbi_load_jpeg_scaled_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, int scale_denom);
+STBIDEF stbi_uc *stbi_load_jpeg_scaled_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, int scale_denom);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_scaled(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int scale_denom);
+#endif
+
+// decode a progressive JPEG keeping its coefficients compactly; preview, if
+// not NULL, is called once with a 1/8-scale image as soon as the DC scans are
+// in (the pixels are only valid during the call)
+typedef void stbi_jpeg_preview(void *user, stbi_uc const *pixels, int w, int h, int channels);
+
+STBIDEF stbi_uc *stbi_load_jpeg_progressive_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_jpeg_preview *preview, void *preview_user);
+STBIDEF stbi_uc *stbi_load_jpeg_progressive_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_jpeg_preview *preview, void *preview_user);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_progressive(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_jpeg_preview *preview, void *preview_user);
+#endif
+
+// a JPEG's component planes at their stored resolutions, before chroma
+// upsampling and color conversion; all of them are in the block returned by
+// stbi_load_jpeg_yuv, which is freed with stbi_image_free
+typedef struct
+{
+   int n;              // 1 (Y), 3 (Y, Cb, Cr) or 4 (Y, Cb, Cr, K)
+   int ycbcr;          // 0 if the file stores RGB or CMYK planes instead
+   stbi_uc *plane[4];
+   int w[4], h[4];     // plane sizes; rows are w[k] bytes apart
+} stbi_jpeg_yuv;
+
+STBIDEF stbi_uc *stbi_load_jpeg_yuv_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, stbi_jpeg_yuv *yuv);
+STBIDEF stbi_uc *stbi_load_jpeg_yuv_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, stbi_jpeg_yuv *yuv);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_yuv(char const *filename, int *x, int *y, stbi_jpeg_yuv *yuv);
+#endif
+#endif
+
+#ifndef STBI_NO_PNG
+// inflate PNG data on one task while unfiltering and converting on another
+STBIDEF stbi_uc *stbi_load_png_parallel_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_parallel_for *parallel_for, void *user);
+STBIDEF stbi_uc *stbi_load_png_parallel_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_parallel_for *parallel_for, void *parallel_user);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_png_parallel(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_parallel_for *parallel_for, void *user);
+#endif
+#endif
+
+// row-at-a-time decoding: open returns NULL on failure, read_rows returns the
+// number of rows written (0 once all rows have been read, -1 on error);
+// out_stride is in bytes, 0 means x*components
+typedef struct stbi__stream stbi_stream;
+
+STBIDEF stbi_stream *stbi_stream_open_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_stream *stbi_stream_open_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_stream *stbi_stream_open(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+STBIDEF int          stbi_stream_read_rows(stbi_stream *st, stbi_uc *out, int out_stride, int max_rows);
+STBIDEF void         stbi_stream_close(stbi_stream *st);
+
+// decode into memory you own: row r goes to out + r*out_stride (out_stride in
+// bytes, 0 means x*components), flipped if stbi_set_flip_vertically_on_load is
+// set. Fails if out_size bytes aren't enough; use stbi_info to size it first.
+STBIDEF int stbi_load_into_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_stride, size_t out_size);
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_stride, size_t out_size);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_stride, size_t out_size);
+#endif
+
+// decode only the rectangle at (rx,ry) of size rw x rh, in top-down image
+// coordinates, clipped to the image; *x and *y return the clipped size
+STBIDEF stbi_uc *stbi_load_region_from_memory   (stbi_uc           const *buffer, int len   , int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+#ifndef STBI_NO_GIF
+// animated GIF frames one at a time: open returns NULL on failure, next_frame
+// returns 1 and points *frame at the next composited frame (valid until the
+// next call or close), 0 after the last frame, -1 on error; delay is in ms
+typedef struct stbi__gif_frames stbi_gif_frames;
+
+STBIDEF stbi_gif_frames *stbi_gif_open_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_gif_frames *stbi_gif_open_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_open(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+STBIDEF int              stbi_gif_next_frame(stbi_gif_frames *gf, stbi_uc const **frame, int *delay_ms);
+STBIDEF void             stbi_gif_close(stbi_gif_frames *gf);
+#endif
+
 ////////////////////////////////////
 //
 // 16-bits-per-channel interface
@@ -413,6 +809,8 @@ STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wch
 
 STBIDEF stbi_us *stbi_load_16_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_us *stbi_load_16_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_us *stbi_load_16_from_memory_with_allocator   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+STBIDEF stbi_us *stbi_load_16_from_callbacks_with_allocator(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
 
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_us *stbi_load_16          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -470,6 +868,16 @@ STBIDEF int      stbi_info               (char const *filename,     int *x, int
 STBIDEF int      stbi_info_from_file     (FILE *f,                  int *x, int *y, int *comp);
 STBIDEF int      stbi_is_16_bit          (char const *filename);
 STBIDEF int      stbi_is_16_bit_from_file(FILE *f);
+
+// stbi_info on many files at once, spread over parallel_for (or one after
+// another if it's NULL); returns how many succeeded
+typedef struct
+{
+   int x, y, comp;
+   char const *failure_reason; // NULL on success
+} stbi_info_result;
+
+STBIDEF int      stbi_info_many(char const * const *filenames, int count, stbi_info_result *results, stbi_parallel_for *parallel_for, void *user);
 #endif
 
 
@@ -483,7 +891,10 @@ STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultipl
 // or just pass them through "as-is"
 STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 
-// flip the image vertically, so the first pixel in the output array is the bottom left
+// flip the image vertically, so the first pixel in the output array is the bottom left.
+// JPEG, PNG, BMP, TGA and HDR decode straight into the flipped layout (as 16-bit
+// PNGs decode straight into native byte order), so this costs them no extra pass
+// over the image; the other formats are flipped after decoding
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
 // as above, but only applies to images loaded on the thread that calls the function
@@ -558,18 +969,37 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <limits.h>
 
 #if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR)
-#include <math.h>  // ldexp, pow
+#include <math.h>  // pow
 #endif
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif
 
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+#include <intrin.h> // __cpuid, _Interlocked*
+#endif
+
+#if defined(STBI_MMAP) && !defined(STBI_NO_STDIO) && (defined(__unix__) || defined(__APPLE__))
+#define STBI__MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
 #endif
 
+// run statement s as a profiling stage
+#ifdef STBI_PROFILE
+#define STBI__PROFILED(stage, s)  do { STBI_PROFILE(stage, 1); s; STBI_PROFILE(stage, 0); } while (0)
+#else
+#define STBI__PROFILED(stage, s)  s
+#endif
+
 #ifdef __cplusplus
 #define STBI_EXTERN extern "C"
 #else
@@ -610,12 +1040,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -627,16 +1059,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 #endif
 
-#ifdef _MSC_VER
-#define STBI_HAS_LROTL
-#endif
-
-#ifdef STBI_HAS_LROTL
-   #define stbi_lrot(x,y)  _lrotl(x,y)
-#else
-   #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (32 - (y))))
-#endif
-
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
 // ok
 #elif !defined(STBI_MALLOC) && !defined(STBI_FREE) && !defined(STBI_REALLOC) && !defined(STBI_REALLOC_SIZED)
@@ -695,7 +1117,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #ifdef _MSC_VER
 
 #if _MSC_VER >= 1400  // not VC6
-#include <intrin.h> // __cpuid
 static int stbi__cpuid3(void)
 {
    int info[4];
@@ -717,7 +1138,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_BMP) || !defined(STBI_NO_PSD) || !defined(STBI_NO_TGA) || !defined(STBI_NO_GIF) || !defined(STBI_NO_PIC) || !defined(STBI_NO_PNM) || !defined(STBI_NO_HDR)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -728,7 +1149,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_BMP) || !defined(STBI_NO_PSD) || !defined(STBI_NO_TGA) || !defined(STBI_NO_GIF) || !defined(STBI_NO_PIC) || !defined(STBI_NO_PNM) || !defined(STBI_NO_HDR)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -741,6 +1162,54 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 kernels are compiled on x64 regardless of the target's baseline ISA
+// and only used if a run-time check says the CPU (and OS) support them.
+// GCC/Clang need a per-function target attribute for that; MSVC doesn't.
+#if defined(STBI_SSE2) && defined(STBI__X64_TARGET) && !defined(STBI_NO_AVX2)
+#if defined(_MSC_VER) && !defined(__clang__) && _MSC_VER >= 1800
+#define STBI_AVX2
+#define STBI__AVX2_TARGET
+#elif (defined(__clang__) && !defined(_MSC_VER) && __clang_major__ >= 4) || \
+      (defined(__GNUC__) && !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define STBI_AVX2
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_BMP) || !defined(STBI_NO_PSD) || !defined(STBI_NO_TGA) || !defined(STBI_NO_GIF) || !defined(STBI_NO_PIC) || !defined(STBI_NO_PNM)
+static int stbi__avx2_available(void)
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info,1);
+   // need AVX enabled by the OS (OSXSAVE, and XMM+YMM state in XCR0)
+   if ((info[2] & (3 << 27)) != (3 << 27)) return 0;
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info,7,0);
+   return (info[1] >> 5) & 1;
+#else
+   // this checks OS support for the YMM registers as well
+   return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#if !defined(STBI_NO_PNG) || !defined(STBI_NO_BMP) || !defined(STBI_NO_PSD) || !defined(STBI_NO_TGA) || !defined(STBI_NO_GIF) || !defined(STBI_NO_PIC) || !defined(STBI_NO_PNM)
+// for loops that dispatch once per row: the check above is a serializing
+// cpuid/xgetbv on MSVC, so only make it once (racing threads all store the
+// same answer)
+static int stbi__avx2_rows(void)
+{
+   static int avail = -1;
+   if (avail < 0) avail = stbi__avx2_available();
+   return avail;
+}
+#endif
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -752,6 +1221,13 @@ static int stbi__sse2_available(void)
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 #endif
 
+// the newer NEON loops (channel conversions, PNG unfiltering, BMP/TGA/PSD
+// unpacking) haven't been through an ARM compiler yet, so they also need
+// STBI_NEON_EXPERIMENTAL
+#if defined(STBI_NEON) && defined(STBI_NEON_EXPERIMENTAL)
+#define STBI__NEON_EXTRA
+#endif
+
 #ifndef STBI_SIMD_ALIGN
 #define STBI_SIMD_ALIGN(type, name) type name
 #endif
@@ -781,6 +1257,9 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   stbi_allocator const *alloc; // NULL: STBI_MALLOC and friends
+   int flip; // the caller wants the image bottom-up; loaders that can, write it that way
 } stbi__context;
 
 
@@ -792,6 +1271,8 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->io.read = NULL;
    s->read_from_callbacks = 0;
    s->callback_already_read = 0;
+   s->alloc = NULL;
+   s->flip = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
@@ -804,6 +1285,8 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
+   s->alloc = NULL;
+   s->flip = 0;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
@@ -867,6 +1350,7 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int flipped; // rows were written bottom-up, as s->flip asked
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -945,11 +1429,32 @@ static int stbi__err(const char *str)
 }
 #endif
 
-static void *stbi__malloc(size_t size)
+static void *stbi__malloc(stbi_allocator const *a, size_t size)
 {
+    if (a) return a->alloc(a->user, size);
     return STBI_MALLOC(size);
 }
 
+static void stbi__free(stbi_allocator const *a, void *p)
+{
+    if (!a) STBI_FREE(p);
+    else if (p && a->release) a->release(a->user, p);
+}
+
+static void *stbi__realloc_sized(stbi_allocator const *a, void *p, size_t oldsz, size_t newsz)
+{
+    void *q;
+    if (!a) return STBI_REALLOC_SIZED(p, oldsz, newsz);
+    if (a->resize) return a->resize(a->user, p, oldsz, newsz);
+    q = a->alloc(a->user, newsz);
+    if (q == NULL) return NULL;
+    if (p) {
+       memcpy(q, p, oldsz < newsz ? oldsz : newsz);
+       stbi__free(a, p);
+    }
+    return q;
+}
+
 // stb_image uses ints pervasively, including for offset calculations.
 // therefore the largest decoded image size we can support with the
 // current code, even on 64-bit targets, is INT_MAX. this is not a
@@ -982,7 +1487,7 @@ static int stbi__mul2sizes_valid(int a, int b)
    return a <= INT_MAX/b;
 }
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR) || !defined(STBI_NO_BMP)
 // returns 1 if "a*b + add" has no negative terms/factors and doesn't overflow
 static int stbi__mad2sizes_valid(int a, int b, int add)
 {
@@ -1006,32 +1511,33 @@ static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
 }
 #endif
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR) || !defined(STBI_NO_BMP)
 // mallocs with size overflow checking
-static void *stbi__malloc_mad2(int a, int b, int add)
+static void *stbi__malloc_mad2(stbi_allocator const *al, int a, int b, int add)
 {
    if (!stbi__mad2sizes_valid(a, b, add)) return NULL;
-   return stbi__malloc(a*b + add);
+   return stbi__malloc(al, a*b + add);
 }
 #endif
 
-static void *stbi__malloc_mad3(int a, int b, int c, int add)
+static void *stbi__malloc_mad3(stbi_allocator const *al, int a, int b, int c, int add)
 {
    if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
-   return stbi__malloc(a*b*c + add);
+   return stbi__malloc(al, a*b*c + add);
 }
 
-#if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR)
-static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
+#ifndef STBI_NO_HDR
+static void *stbi__malloc_mad4(stbi_allocator const *al, int a, int b, int c, int d, int add)
 {
    if (!stbi__mad4sizes_valid(a, b, c, d, add)) return NULL;
-   return stbi__malloc(a*b*c*d + add);
+   return stbi__malloc(al, a*b*c*d + add);
 }
 #endif
 
 // stbi__err - error
 // stbi__errpf - error returning pointer to float
 // stbi__errpuc - error returning pointer to unsigned char
+// stbi__errp - error returning pointer to type t
 
 #ifdef STBI_NO_FAILURE_STRINGS
    #define stbi__err(x,y)  0
@@ -1043,6 +1549,7 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 
 #define stbi__errpf(x,y)   ((float *)(size_t) (stbi__err(x,y)?NULL:NULL))
 #define stbi__errpuc(x,y)  ((unsigned char *)(size_t) (stbi__err(x,y)?NULL:NULL))
+#define stbi__errp(t,x,y)  ((t *)(size_t) (stbi__err(x,y)?NULL:NULL))
 
 STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 {
@@ -1050,11 +1557,11 @@ STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 }
 
 #ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
+static float   *stbi__ldr_to_hdr(stbi_allocator const *a, stbi_uc *data, int x, int y, int comp);
 #endif
 
 #ifndef STBI_NO_HDR
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
+static stbi_uc *stbi__hdr_to_ldr(stbi_allocator const *a, float   *data, int x, int y, int comp);
 #endif
 
 static int stbi__vertically_flip_on_load_global = 0;
@@ -1080,41 +1587,92 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+// format candidates from the signature at the start of the file
+enum
+{
+   STBI__FMT_JPEG = 1 << 0,
+   STBI__FMT_PNG  = 1 << 1,
+   STBI__FMT_BMP  = 1 << 2,
+   STBI__FMT_GIF  = 1 << 3,
+   STBI__FMT_PSD  = 1 << 4,
+   STBI__FMT_PIC  = 1 << 5,
+   STBI__FMT_PNM  = 1 << 6,
+   STBI__FMT_HDR  = 1 << 7,
+   STBI__FMT_TGA  = 1 << 8,
+   STBI__FMT_ALL  = (1 << 9) - 1
+};
+
+// Every format but TGA starts with a magic number that its test checks first,
+// so one look at the first bytes rules out all the tests that would fail
+// anyway; each of those costs a rewind and the JPEG one a sizable allocation.
+// TGA has no signature and stays a candidate for everything. This returns the
+// same set of formats as running the tests in turn, with bytes past the end
+// read as 0 just like stbi__get8 does.
+static int stbi__sniff(stbi__context *s)
+{
+   stbi_uc h[16];
+   int i, n = (int) (s->img_buffer_original_end - s->img_buffer_original);
+   if (n < 16) {
+      // a short first read from callbacks doesn't mean end of file
+      if (s->read_from_callbacks) return STBI__FMT_ALL;
+      memset(h, 0, sizeof(h));
+   } else
+      n = 16;
+   memcpy(h, s->img_buffer_original, n);
+
+   if (h[0] == 0xff) {
+      // fill bytes may come before the SOI marker
+      for (i = 1; i < 16 && h[i] == 0xff; ++i)
+         ;
+      if (i == 16) return STBI__FMT_ALL;
+      return h[i] == 0xd8 ? STBI__FMT_JPEG | STBI__FMT_TGA : STBI__FMT_TGA;
+   }
+   if (memcmp(h, "\x89PNG\r\n\x1a\n", 8) == 0)           return STBI__FMT_PNG | STBI__FMT_TGA;
+   if (h[0] == 'B' && h[1] == 'M')                          return STBI__FMT_BMP | STBI__FMT_TGA;
+   if (memcmp(h, "GIF8", 4) == 0)                           return STBI__FMT_GIF | STBI__FMT_TGA;
+   if (memcmp(h, "8BPS", 4) == 0)                           return STBI__FMT_PSD | STBI__FMT_TGA;
+   if (memcmp(h, "\x53\x80\xF6\x34", 4) == 0)               return STBI__FMT_PIC | STBI__FMT_TGA;
+   if (h[0] == 'P' && (h[1] == '5' || h[1] == '6'))         return STBI__FMT_PNM | STBI__FMT_TGA;
+   if (h[0] == '#' && h[1] == '?')                          return STBI__FMT_HDR | STBI__FMT_TGA;
+   return STBI__FMT_TGA;
+}
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
+   int fmt = stbi__sniff(s);
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
    ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
    ri->num_channels = 0;
 
    #ifndef STBI_NO_JPEG
-   if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
+   if ((fmt & STBI__FMT_JPEG) && stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PNG
-   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
+   if ((fmt & STBI__FMT_PNG) && stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_BMP
-   if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
+   if ((fmt & STBI__FMT_BMP) && stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_GIF
-   if (stbi__gif_test(s))  return stbi__gif_load(s,x,y,comp,req_comp, ri);
+   if ((fmt & STBI__FMT_GIF) && stbi__gif_test(s))  return stbi__gif_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PSD
-   if (stbi__psd_test(s))  return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
+   if ((fmt & STBI__FMT_PSD) && stbi__psd_test(s))  return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
    #else
    STBI_NOTUSED(bpc);
    #endif
    #ifndef STBI_NO_PIC
-   if (stbi__pic_test(s))  return stbi__pic_load(s,x,y,comp,req_comp, ri);
+   if ((fmt & STBI__FMT_PIC) && stbi__pic_test(s))  return stbi__pic_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PNM
-   if (stbi__pnm_test(s))  return stbi__pnm_load(s,x,y,comp,req_comp, ri);
+   if ((fmt & STBI__FMT_PNM) && stbi__pnm_test(s))  return stbi__pnm_load(s,x,y,comp,req_comp, ri);
    #endif
 
    #ifndef STBI_NO_HDR
-   if (stbi__hdr_test(s)) {
+   if ((fmt & STBI__FMT_HDR) && stbi__hdr_test(s)) {
       float *hdr = stbi__hdr_load(s, x,y,comp,req_comp, ri);
-      return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+      return stbi__hdr_to_ldr(s->alloc, hdr, *x, *y, req_comp ? req_comp : *comp);
    }
    #endif
 
@@ -1123,39 +1681,44 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    if (stbi__tga_test(s))
       return stbi__tga_load(s,x,y,comp,req_comp, ri);
    #endif
+   STBI_NOTUSED(fmt);
 
    return stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
-static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int channels)
+// The bit depth conversions work in place, so a 16-bit load of an 8-bit
+// image never holds two copies: narrowing goes front to back and then gives
+// back the tail, widening grows the block (usually without moving it) and
+// goes back to front, so no sample is overwritten before it has been read.
+static stbi_uc *stbi__convert_16_to_8(stbi_allocator const *a, stbi__uint16 *orig, int w, int h, int channels)
 {
    int i;
    int img_len = w * h * channels;
-   stbi_uc *reduced;
-
-   reduced = (stbi_uc *) stbi__malloc(img_len);
-   if (reduced == NULL) return stbi__errpuc("outofmem", "Out of memory");
+   stbi_uc *reduced = (stbi_uc *) orig;
 
    for (i = 0; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
 
-   STBI_FREE(orig);
-   return reduced;
+   reduced = (stbi_uc *) stbi__realloc_sized(a, orig, (size_t) img_len*2, img_len);
+   return reduced ? reduced : (stbi_uc *) orig;
 }
 
-static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int channels)
+static stbi__uint16 *stbi__convert_8_to_16(stbi_allocator const *a, stbi_uc *orig, int w, int h, int channels)
 {
    int i;
    int img_len = w * h * channels;
    stbi__uint16 *enlarged;
 
-   enlarged = (stbi__uint16 *) stbi__malloc(img_len*2);
-   if (enlarged == NULL) return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+   enlarged = (stbi__uint16 *) stbi__realloc_sized(a, orig, img_len, (size_t) img_len*2);
+   if (enlarged == NULL) {
+      stbi__free(a, orig);
+      return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+   }
+   orig = (stbi_uc *) enlarged;
 
-   for (i = 0; i < img_len; ++i)
+   for (i = img_len-1; i >= 0; --i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-   STBI_FREE(orig);
    return enlarged;
 }
 
@@ -1197,7 +1760,8 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 }
 #endif
 
-static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+// as stbi__load_and_postprocess_8bit, with s->flip already set by the caller
+static unsigned char *stbi__load_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
    void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
@@ -1209,13 +1773,13 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
 
    if (ri.bits_per_channel != 8) {
-      result = stbi__convert_16_to_8((stbi__uint16 *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
+      result = stbi__convert_16_to_8(s->alloc, (stbi__uint16 *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
       ri.bits_per_channel = 8;
    }
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->flip && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1223,10 +1787,19 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    return (unsigned char *) result;
 }
 
+static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+   s->flip = stbi__vertically_flip_on_load;
+   return stbi__load_8bit(s, x, y, comp, req_comp);
+}
+
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   void *result;
+
+   s->flip = stbi__vertically_flip_on_load;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
 
    if (result == NULL)
       return NULL;
@@ -1235,14 +1808,14 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
 
    if (ri.bits_per_channel != 16) {
-      result = stbi__convert_8_to_16((stbi_uc *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
+      result = stbi__convert_8_to_16(s->alloc, (stbi_uc *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
       ri.bits_per_channel = 16;
    }
 
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->flip && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1250,16 +1823,6 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    return (stbi__uint16 *) result;
 }
 
-#if !defined(STBI_NO_HDR) && !defined(STBI_NO_LINEAR)
-static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
-{
-   if (stbi__vertically_flip_on_load && result != NULL) {
-      int channels = req_comp ? req_comp : *comp;
-      stbi__vertical_flip(result, *x, *y, channels * sizeof(float));
-   }
-}
-#endif
-
 #ifndef STBI_NO_STDIO
 
 #if defined(_MSC_VER) && defined(STBI_WINDOWS_UTF8)
@@ -1303,10 +1866,51 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
 }
 
 
+#ifdef STBI__MMAP
+// map the whole file read-only so loading by filename takes the same
+// zero-copy path as loading from memory; NULL if it can't be mapped (not a
+// regular file, empty, or too big for an int length), and the caller falls
+// back to stdio
+static stbi_uc *stbi__mmap_file(char const *filename, int *len)
+{
+   struct stat st;
+   void *p;
+   int fd;
+   // don't open anything else: opening a FIFO here would use up its writer
+   if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+   fd = open(filename, O_RDONLY);
+   if (fd < 0) return NULL;
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > INT_MAX) {
+      close(fd);
+      return NULL;
+   }
+   p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd); // the mapping stays valid
+   if (p == MAP_FAILED) return NULL;
+   *len = (int) st.st_size;
+   return (stbi_uc *) p;
+}
+
+static void stbi__munmap_file(stbi_uc *p, int len)
+{
+   munmap(p, (size_t) len);
+}
+#endif
+
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    unsigned char *result;
+#ifdef STBI__MMAP
+   int len;
+   stbi_uc *map = stbi__mmap_file(filename, &len);
+   if (map) {
+      result = stbi_load_from_memory(map, len, x, y, comp, req_comp);
+      stbi__munmap_file(map, len);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -1341,8 +1945,18 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
 
 STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    stbi__uint16 *result;
+#ifdef STBI__MMAP
+   int len;
+   stbi_uc *map = stbi__mmap_file(filename, &len);
+   if (map) {
+      result = stbi_load_16_from_memory(map, len, x, y, comp, req_comp);
+      stbi__munmap_file(map, len);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file_16(f,x,y,comp,req_comp);
    fclose(f);
@@ -1380,69 +1994,419 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-#ifndef STBI_NO_GIF
-STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
+STBIDEF stbi_us *stbi_load_16_from_memory_with_allocator(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
 {
-   unsigned char *result;
    stbi__context s;
    stbi__start_mem(&s,buffer,len);
-
-   result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
-   if (stbi__vertically_flip_on_load) {
-      stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
-   }
-
-   return result;
+   s.alloc = alloc;
+   return stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
 }
-#endif
 
-#ifndef STBI_NO_LINEAR
-static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_us *stbi_load_16_from_callbacks_with_allocator(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
 {
-   unsigned char *data;
-   #ifndef STBI_NO_HDR
-   if (stbi__hdr_test(s)) {
-      stbi__result_info ri;
-      float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
-      if (hdr_data)
-         stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
-      return hdr_data;
-   }
-   #endif
-   data = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
-   if (data)
-      return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
-   return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   s.alloc = alloc;
+   return stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
 }
 
-STBIDEF float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_from_memory_with_allocator(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
 {
    stbi__context s;
    stbi__start_mem(&s,buffer,len);
-   return stbi__loadf_main(&s,x,y,comp,req_comp);
+   s.alloc = alloc;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_from_callbacks_with_allocator(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
 {
    stbi__context s;
    stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
-   return stbi__loadf_main(&s,x,y,comp,req_comp);
+   s.alloc = alloc;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-#ifndef STBI_NO_STDIO
-STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
+// stbi_decoder: an allocator that caches released blocks. Each block has a
+// header recording its capacity, so a block can serve any request up to that
+// size, and growing within it doesn't move it
+#ifndef STBI_DECODER_CACHE
+#define STBI_DECODER_CACHE  32
+#endif
+
+#define STBI__DECODER_HEADER  16  // keeps malloc's alignment
+
+struct stbi__decoder
 {
-   float *result;
-   FILE *f = stbi__fopen(filename, "rb");
-   if (!f) return stbi__errpf("can't fopen", "Unable to open file");
-   result = stbi_loadf_from_file(f,x,y,comp,req_comp);
-   fclose(f);
-   return result;
+   stbi_allocator alloc;
+   int num_free;
+   stbi_uc *free_blocks[STBI_DECODER_CACHE];
+};
+
+static size_t stbi__decoder_capacity(void *p)
+{
+   return *(size_t *) ((stbi_uc *) p - STBI__DECODER_HEADER);
 }
 
-STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+static void stbi__decoder_block_free(void *p)
 {
-   stbi__context s;
+   STBI_FREE((stbi_uc *) p - STBI__DECODER_HEADER);
+}
+
+// the smallest cached block that holds 'size' bytes, or -1
+static int stbi__decoder_find(stbi_decoder *d, size_t size)
+{
+   int i, best = -1;
+   for (i=0; i < d->num_free; ++i) {
+      size_t cap = stbi__decoder_capacity(d->free_blocks[i]);
+      if (cap >= size && (best < 0 || cap < stbi__decoder_capacity(d->free_blocks[best])))
+         best = i;
+   }
+   return best;
+}
+
+static void *stbi__decoder_alloc(void *user, size_t size)
+{
+   stbi_decoder *d = (stbi_decoder *) user;
+   stbi_uc *p;
+   int i = stbi__decoder_find(d, size);
+   if (i >= 0) {
+      p = d->free_blocks[i];
+      d->free_blocks[i] = d->free_blocks[--d->num_free];
+      return p;
+   }
+   if (size > (size_t) -1 - STBI__DECODER_HEADER) return NULL;
+   p = (stbi_uc *) STBI_MALLOC(size + STBI__DECODER_HEADER);
+   if (p == NULL) return NULL;
+   *(size_t *) p = size;
+   return p + STBI__DECODER_HEADER;
+}
+
+static void stbi__decoder_release(void *user, void *p)
+{
+   stbi_decoder *d = (stbi_decoder *) user;
+   int i, smallest;
+   if (d->num_free < STBI_DECODER_CACHE) {
+      d->free_blocks[d->num_free++] = (stbi_uc *) p;
+      return;
+   }
+   // cache is full: drop whichever block is smallest
+   smallest = 0;
+   for (i=1; i < d->num_free; ++i)
+      if (stbi__decoder_capacity(d->free_blocks[i]) < stbi__decoder_capacity(d->free_blocks[smallest]))
+         smallest = i;
+   if (stbi__decoder_capacity(p) > stbi__decoder_capacity(d->free_blocks[smallest])) {
+      stbi__decoder_block_free(d->free_blocks[smallest]);
+      d->free_blocks[smallest] = (stbi_uc *) p;
+   } else
+      stbi__decoder_block_free(p);
+}
+
+static void *stbi__decoder_resize(void *user, void *p, size_t oldsize, size_t newsize)
+{
+   stbi_decoder *d = (stbi_decoder *) user;
+   stbi_uc *q;
+   int i;
+   if (p == NULL) return stbi__decoder_alloc(user, newsize);
+   if (newsize <= stbi__decoder_capacity(p)) return p;
+   i = stbi__decoder_find(d, newsize);
+   if (i >= 0) {
+      q = d->free_blocks[i];
+      d->free_blocks[i] = d->free_blocks[--d->num_free];
+      memcpy(q, p, oldsize);
+      stbi__decoder_release(user, p);
+      return q;
+   }
+   // nothing cached is big enough: grow this block in place if the heap can
+   if (newsize > (size_t) -1 - STBI__DECODER_HEADER) return NULL;
+   q = (stbi_uc *) STBI_REALLOC_SIZED((stbi_uc *) p - STBI__DECODER_HEADER, stbi__decoder_capacity(p) + STBI__DECODER_HEADER, newsize + STBI__DECODER_HEADER);
+   if (q == NULL) return NULL;
+   *(size_t *) q = newsize;
+   return q + STBI__DECODER_HEADER;
+}
+
+STBIDEF stbi_decoder *stbi_decoder_create(void)
+{
+   stbi_decoder *d = (stbi_decoder *) STBI_MALLOC(sizeof(*d));
+   if (d == NULL) return stbi__errp(stbi_decoder, "outofmem", "Out of memory");
+   d->alloc.alloc   = stbi__decoder_alloc;
+   d->alloc.resize  = stbi__decoder_resize;
+   d->alloc.release = stbi__decoder_release;
+   d->alloc.user    = d;
+   d->num_free = 0;
+   return d;
+}
+
+STBIDEF void stbi_decoder_free(stbi_decoder *d)
+{
+   int i;
+   if (d == NULL) return;
+   for (i=0; i < d->num_free; ++i)
+      stbi__decoder_block_free(d->free_blocks[i]);
+   STBI_FREE(d);
+}
+
+STBIDEF stbi_allocator const *stbi_decoder_allocator(stbi_decoder *d)
+{
+   return &d->alloc;
+}
+
+STBIDEF stbi_uc *stbi_decoder_load_from_memory(stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   return stbi_load_from_memory_with_allocator(buffer, len, x, y, comp, req_comp, &d->alloc);
+}
+
+STBIDEF stbi_uc *stbi_decoder_load_from_callbacks(stbi_decoder *d, stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   return stbi_load_from_callbacks_with_allocator(clbk, user, x, y, comp, req_comp, &d->alloc);
+}
+
+STBIDEF void stbi_decoder_image_free(stbi_decoder *d, void *retval_from_stbi_decoder_load)
+{
+   if (retval_from_stbi_decoder_load) stbi__decoder_release(d, retval_from_stbi_decoder_load);
+}
+
+// stbi_load_batch: workers pull items off a shared counter, and hand finished
+// items over for in-order delivery, with these; without them, worker w takes
+// items w, w+num_workers, ... and in-order callbacks wait for the whole batch
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+#define STBI__ATOMICS
+#define stbi__atomic_add(p,v)    _InterlockedExchangeAdd((long volatile *) (p), (v))
+#define stbi__atomic_cas(p,o,n)  (_InterlockedCompareExchange((long volatile *) (p), (n), (o)) == (o))
+#elif defined(__GNUC__)
+#define STBI__ATOMICS
+#define stbi__atomic_add(p,v)    __sync_fetch_and_add((p), (v))
+#define stbi__atomic_cas(p,o,n)  __sync_bool_compare_and_swap((p), (o), (n))
+#endif
+
+typedef struct
+{
+   stbi_batch_item const *items;
+   stbi_batch_result *results;
+   int count, num_workers, flip;
+   long next;
+   stbi_batch_done *done;
+   void *done_user;
+   int defer;       // done is called by stbi_load_batch once the batch is over
+   long *ready;     // in order from the workers: ready[i] is set once item i is
+   long cursor;     // finished; cursor is the next item to hand to done, and
+   long delivering; // delivering is held by whichever worker is doing that
+} stbi__batch;
+
+static stbi_uc *stbi__batch_load(stbi_batch_item const *it, stbi_allocator const *a, int flip, int *x, int *y, int *comp)
+{
+   stbi__context s;
+   stbi_uc *result;
+#ifndef STBI_NO_STDIO
+   if (it->filename) {
+      FILE *f;
+#ifdef STBI__MMAP
+      int len;
+      stbi_uc *map = stbi__mmap_file(it->filename, &len);
+      if (map) {
+         stbi__start_mem(&s, map, len);
+         s.alloc = a;
+         s.flip = flip;
+         result = stbi__load_8bit(&s, x, y, comp, it->desired_channels);
+         stbi__munmap_file(map, len);
+         return result;
+      }
+#endif
+      f = stbi__fopen(it->filename, "rb");
+      if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+      stbi__start_file(&s, f);
+      s.alloc = a;
+      s.flip = flip;
+      result = stbi__load_8bit(&s, x, y, comp, it->desired_channels);
+      fclose(f);
+      return result;
+   }
+#endif
+   if (it->buffer == NULL) return stbi__errpuc("bad item", "Batch item has no filename or buffer");
+   stbi__start_mem(&s, it->buffer, it->len);
+   s.alloc = a;
+   s.flip = flip;
+   result = stbi__load_8bit(&s, x, y, comp, it->desired_channels);
+   return result;
+}
+
+#ifdef STBI__ATOMICS
+// hand every finished item at the cursor to done, one worker at a time. A
+// worker that finishes the next item while another holds the token leaves it
+// to that one, which looks again after letting go, so nothing is stranded
+static void stbi__batch_deliver(stbi__batch *b)
+{
+   long i;
+   while (stbi__atomic_cas(&b->delivering, 0, 1)) {
+      for (i = b->cursor; i < b->count && stbi__atomic_add(&b->ready[i], 0); ++i)
+         b->done(b->done_user, (int) i, &b->results[i]);
+      b->cursor = i;
+      stbi__atomic_cas(&b->delivering, 1, 0);
+      if (i >= b->count || !stbi__atomic_add(&b->ready[i], 0))
+         break;
+   }
+}
+#endif
+
+static void stbi__batch_task(void *data, int w)
+{
+   stbi__batch *b = (stbi__batch *) data;
+   stbi_decoder *d = stbi_decoder_create();
+   int i;
+   for (;;) {
+      stbi_batch_result *r;
+#ifdef STBI__ATOMICS
+      STBI_NOTUSED(w);
+      i = (int) stbi__atomic_add(&b->next, 1);
+#else
+      i = w, w += b->num_workers;
+#endif
+      if (i >= b->count) break;
+      r = &b->results[i];
+      // results come from the decoder's blocks, which stbi_batch_image_free
+      // knows how to release; the decoder keeps only the scratch
+      r->data = d ? stbi__batch_load(&b->items[i], &d->alloc, b->flip, &r->x, &r->y, &r->comp) : stbi__errpuc("outofmem", "Out of memory");
+      if (r->data)
+         r->failure_reason = NULL;
+      else {
+         r->x = r->y = r->comp = 0;
+         r->failure_reason = stbi_failure_reason();
+         if (!r->failure_reason) r->failure_reason = "unknown";
+      }
+      if (!b->done || b->defer)
+         continue;
+#ifdef STBI__ATOMICS
+      if (b->ready) {
+         stbi__atomic_add(&b->ready[i], 1);
+         stbi__batch_deliver(b);
+         continue;
+      }
+#endif
+      b->done(b->done_user, i, r);
+   }
+   stbi_decoder_free(d);
+}
+
+STBIDEF int stbi_load_batch(stbi_batch_item const *items, int count, stbi_batch_result *results, int num_workers, stbi_parallel_for *parallel_for, void *parallel_user, stbi_batch_done *done, void *done_user, int done_order)
+{
+   stbi__batch b;
+   int i, ok = 0;
+   if (count <= 0) return 0;
+   if (num_workers > count) num_workers = count;
+   if (!parallel_for || num_workers < 1) num_workers = 1;
+   b.items = items;
+   b.results = results;
+   b.count = count;
+   b.num_workers = num_workers;
+   b.next = 0;
+   b.flip = stbi__vertically_flip_on_load;
+   b.done = done;
+   b.done_user = done_user;
+   b.defer = 0;
+   b.ready = NULL;
+   b.cursor = b.delivering = 0;
+   if (done && num_workers > 1 && done_order == STBI_BATCH_IN_ORDER) {
+#ifdef STBI__ATOMICS
+      if ((size_t) count <= ((size_t) -1) / sizeof(long))
+         b.ready = (long *) stbi__malloc(NULL, sizeof(long) * (size_t) count);
+      if (b.ready)
+         memset(b.ready, 0, sizeof(long) * (size_t) count);
+      else
+#endif
+         b.defer = 1;
+   }
+   if (num_workers > 1)
+      parallel_for(parallel_user, stbi__batch_task, &b, num_workers);
+   else
+      stbi__batch_task(&b, 0);
+   stbi__free(NULL, b.ready);
+   for (i=0; i < count; ++i) {
+      if (b.defer) done(done_user, i, &results[i]);
+      ok += results[i].data != NULL;
+   }
+   for (i=0; i < count; ++i)
+      if (results[i].failure_reason) {
+         stbi__g_failure_reason = results[i].failure_reason;
+         break;
+      }
+   return ok;
+}
+
+STBIDEF void stbi_batch_image_free(void *retval_from_stbi_load_batch)
+{
+   if (retval_from_stbi_load_batch) stbi__decoder_block_free(retval_from_stbi_load_batch);
+}
+
+#ifndef STBI_NO_GIF
+STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
+{
+   unsigned char *result;
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+
+   result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
+   if (stbi__vertically_flip_on_load) {
+      stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
+   }
+
+   return result;
+}
+#endif
+
+#ifndef STBI_NO_LINEAR
+static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *data;
+   #ifndef STBI_NO_HDR
+   if (stbi__hdr_test(s)) {
+      stbi__result_info ri;
+      s->flip = stbi__vertically_flip_on_load; // stbi__hdr_load always honors it
+      return stbi__hdr_load(s,x,y,comp,req_comp, &ri);
+   }
+   #endif
+   data = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+   if (data)
+      return stbi__ldr_to_hdr(s->alloc, data, *x, *y, req_comp ? req_comp : *comp);
+   return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
+}
+
+STBIDEF float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__loadf_main(&s,x,y,comp,req_comp);
+}
+
+STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__loadf_main(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   float *result;
+   FILE *f;
+#ifdef STBI__MMAP
+   int len;
+   stbi_uc *map = stbi__mmap_file(filename, &len);
+   if (map) {
+      result = stbi_loadf_from_memory(map, len, x, y, comp, req_comp);
+      stbi__munmap_file(map, len);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpf("can't fopen", "Unable to open file");
+   result = stbi_loadf_from_file(f,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
    stbi__start_file(&s,f);
    return stbi__loadf_main(&s,x,y,comp,req_comp);
 }
@@ -1600,7 +2564,7 @@ static void stbi__skip(stbi__context *s, int n)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_HDR) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_PNM)
 // nothing
 #else
 static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
@@ -1628,6 +2592,23 @@ static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
 }
 #endif
 
+#if defined(STBI_NO_GIF) && defined(STBI_NO_HDR) && defined(STBI_NO_BMP) && defined(STBI_NO_TGA)
+// nothing
+#else
+// like stbi__getn, but past the end of the file it reads 0s like stbi__get8
+static void stbi__get_block(stbi__context *s, stbi_uc *buffer, int n)
+{
+   int i;
+   if (s->img_buffer_end - s->img_buffer >= n) {
+      memcpy(buffer, s->img_buffer, n);
+      s->img_buffer += n;
+   } else {
+      for (i = 0; i < n; ++i)
+         buffer[i] = stbi__get8(s);
+   }
+}
+#endif
+
 #if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC)
 // nothing
 #else
@@ -1691,47 +2672,295 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
-static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+#if defined(STBI_SSE2) || defined(STBI__NEON_EXTRA)
+#define STBI__CONVERT_SIMD
+#define STBI__COMBO(a,b)  ((a)*8+(b))
+
+// SIMD versions of the common stbi__convert_format_row cases (expanding grey
+// or RGB to RGBA for upload, dropping alpha, and the RGB(A)-to-Y luma sum);
+// each kernel converts a prefix of the row and returns how many pixels it
+// did, and the scalar loop finishes the rest. Results are bit-exact.
+#ifdef STBI_SSE2
+static int stbi__convert_1_to_4_sse2(stbi_uc *dest, stbi_uc const *src, int x)
 {
-   int i,j;
+   int i = 0;
+   __m128i ff = _mm_set1_epi8((char) 255);
+   for (; i+15 < x; i += 16) {
+      __m128i g = _mm_loadu_si128((__m128i const *) (src + i));
+      __m128i gg_lo = _mm_unpacklo_epi8(g, g), gg_hi = _mm_unpackhi_epi8(g, g);
+      __m128i ga_lo = _mm_unpacklo_epi8(g, ff), ga_hi = _mm_unpackhi_epi8(g, ff);
+      _mm_storeu_si128((__m128i *) (dest + i*4     ), _mm_unpacklo_epi16(gg_lo, ga_lo));
+      _mm_storeu_si128((__m128i *) (dest + i*4 + 16), _mm_unpackhi_epi16(gg_lo, ga_lo));
+      _mm_storeu_si128((__m128i *) (dest + i*4 + 32), _mm_unpacklo_epi16(gg_hi, ga_hi));
+      _mm_storeu_si128((__m128i *) (dest + i*4 + 48), _mm_unpackhi_epi16(gg_hi, ga_hi));
+   }
+   return i;
+}
+
+static int stbi__convert_4_to_1_sse2(stbi_uc *dest, stbi_uc const *src, int x)
+{
+   int i = 0, k;
+   __m128i w = _mm_setr_epi16(77,150,29,0, 77,150,29,0);
+   __m128i zero = _mm_setzero_si128();
+   for (; i+15 < x; i += 16) {
+      __m128i y[4];
+      for (k=0; k < 4; ++k) {
+         __m128i p  = _mm_loadu_si128((__m128i const *) (src + i*4 + k*16));
+         // r*77+g*150 and b*29 for each pixel, then add the two halves
+         __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(p, zero), w);
+         __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(p, zero), w);
+         lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+         hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+         y[k] = _mm_srli_epi32(_mm_unpacklo_epi64(_mm_shuffle_epi32(lo, 0x08), _mm_shuffle_epi32(hi, 0x08)), 8);
+      }
+      _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(_mm_packs_epi32(y[0], y[1]), _mm_packs_epi32(y[2], y[3])));
+   }
+   return i;
+}
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// RGB triples need a byte shuffle, so these use AVX2 (which includes the
+// SSSE3 pshufb) under the same run-time check as the JPEG kernels. Eight
+// RGB pixels are 24 bytes; a 32-bit permute puts bytes 0..11 in the low
+// lane and 12..23 in the high one, and the shuffles then work per lane.
+STBI__AVX2_TARGET
+static int stbi__convert_3_to_4_avx2(stbi_uc *dest, stbi_uc const *src, int x)
+{
+   int i = 0;
+   __m256i idx   = _mm256_setr_epi32(0,1,2,3, 3,4,5,6);
+   __m256i shuf  = _mm256_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+                                    0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+   __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+   // the load reads 32 bytes for 24, so stop 3 pixels early
+   for (; i+10 < x; i += 8) {
+      __m256i p = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i const *) (src + i*3)), idx);
+      _mm256_storeu_si256((__m256i *) (dest + i*4), _mm256_or_si256(_mm256_shuffle_epi8(p, shuf), alpha));
+   }
+   return i;
+}
+
+STBI__AVX2_TARGET
+static int stbi__convert_4_to_3_avx2(stbi_uc *dest, stbi_uc const *src, int x)
+{
+   int i = 0;
+   __m256i shuf = _mm256_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1,
+                                   0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+   __m256i idx  = _mm256_setr_epi32(0,1,2, 4,5,6, 3,7);
+   for (; i+7 < x; i += 8) {
+      __m256i p = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i const *) (src + i*4)), shuf);
+      p = _mm256_permutevar8x32_epi32(p, idx);
+      _mm_storeu_si128((__m128i *) (dest + i*3), _mm256_castsi256_si128(p));
+      _mm_storel_epi64((__m128i *) (dest + i*3 + 16), _mm256_extracti128_si256(p, 1));
+   }
+   return i;
+}
+
+// luma of the four pixels in each lane, as 32-bit values in pixel order;
+// rg and b pick (r,g) and b out of each pixel zero-extended to 16 bits
+STBI__AVX2_TARGET
+static __m256i stbi__compute_y_avx2(__m256i p, __m256i rg, __m256i b)
+{
+   __m256i rgw = _mm256_set1_epi32((150 << 16) | 77);
+   __m256i bw  = _mm256_set1_epi32(29);
+   __m256i y = _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(p, rg), rgw),
+                                _mm256_madd_epi16(_mm256_shuffle_epi8(p, b), bw));
+   return _mm256_srli_epi32(y, 8);
+}
+
+// two sets of 8 luma values (pixels 0..3 | 4..7 and 8..11 | 12..15) to 16
+// bytes in order
+STBI__AVX2_TARGET
+static void stbi__store_y_avx2(stbi_uc *dest, __m256i y0, __m256i y1)
+{
+   __m256i p = _mm256_packs_epi32(y0, y1);
+   p = _mm256_packus_epi16(p, p);
+   p = _mm256_permutevar8x32_epi32(p, _mm256_setr_epi32(0,4,1,5, 0,4,1,5));
+   _mm_storeu_si128((__m128i *) dest, _mm256_castsi256_si128(p));
+}
+
+STBI__AVX2_TARGET
+static int stbi__convert_3_to_1_avx2(stbi_uc *dest, stbi_uc const *src, int x)
+{
+   int i = 0;
+   __m256i idx = _mm256_setr_epi32(0,1,2,3, 3,4,5,6);
+   __m256i rg  = _mm256_setr_epi8(0,-1,1,-1, 3,-1,4,-1, 6,-1,7,-1, 9,-1,10,-1,
+                                  0,-1,1,-1, 3,-1,4,-1, 6,-1,7,-1, 9,-1,10,-1);
+   __m256i b   = _mm256_setr_epi8(2,-1,-1,-1, 5,-1,-1,-1, 8,-1,-1,-1, 11,-1,-1,-1,
+                                  2,-1,-1,-1, 5,-1,-1,-1, 8,-1,-1,-1, 11,-1,-1,-1);
+   // the second load reads 32 bytes for 24, so stop 3 pixels early
+   for (; i+18 < x; i += 16) {
+      __m256i p0 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i const *) (src + i*3     )), idx);
+      __m256i p1 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i const *) (src + i*3 + 24)), idx);
+      stbi__store_y_avx2(dest + i, stbi__compute_y_avx2(p0, rg, b), stbi__compute_y_avx2(p1, rg, b));
+   }
+   return i;
+}
+
+STBI__AVX2_TARGET
+static int stbi__convert_4_to_1_avx2(stbi_uc *dest, stbi_uc const *src, int x)
+{
+   int i = 0;
+   __m256i rg = _mm256_setr_epi8(0,-1,1,-1, 4,-1,5,-1, 8,-1,9,-1, 12,-1,13,-1,
+                                 0,-1,1,-1, 4,-1,5,-1, 8,-1,9,-1, 12,-1,13,-1);
+   __m256i b  = _mm256_setr_epi8(2,-1,-1,-1, 6,-1,-1,-1, 10,-1,-1,-1, 14,-1,-1,-1,
+                                 2,-1,-1,-1, 6,-1,-1,-1, 10,-1,-1,-1, 14,-1,-1,-1);
+   for (; i+15 < x; i += 16) {
+      __m256i p0 = _mm256_loadu_si256((__m256i const *) (src + i*4     ));
+      __m256i p1 = _mm256_loadu_si256((__m256i const *) (src + i*4 + 32));
+      stbi__store_y_avx2(dest + i, stbi__compute_y_avx2(p0, rg, b), stbi__compute_y_avx2(p1, rg, b));
+   }
+   return i;
+}
+#endif // STBI_AVX2
+
+#ifdef STBI__NEON_EXTRA
+static int stbi__convert_format_row_neon(stbi_uc *dest, stbi_uc const *src, int img_n, int req_comp, int x)
+{
+   int i = 0;
+   uint8x16_t ff = vdupq_n_u8(255);
+   uint8x8_t  wr = vdup_n_u8(77), wg = vdup_n_u8(150), wb = vdup_n_u8(29);
+   switch (STBI__COMBO(img_n, req_comp)) {
+      case STBI__COMBO(1,4):
+         for (; i+15 < x; i += 16) {
+            uint8x16x4_t o;
+            o.val[0] = o.val[1] = o.val[2] = vld1q_u8(src + i);
+            o.val[3] = ff;
+            vst4q_u8(dest + i*4, o);
+         }
+         break;
+      case STBI__COMBO(3,4):
+         for (; i+15 < x; i += 16) {
+            uint8x16x3_t p = vld3q_u8(src + i*3);
+            uint8x16x4_t o;
+            o.val[0] = p.val[0];
+            o.val[1] = p.val[1];
+            o.val[2] = p.val[2];
+            o.val[3] = ff;
+            vst4q_u8(dest + i*4, o);
+         }
+         break;
+      case STBI__COMBO(4,3):
+         for (; i+15 < x; i += 16) {
+            uint8x16x4_t p = vld4q_u8(src + i*4);
+            uint8x16x3_t o;
+            o.val[0] = p.val[0];
+            o.val[1] = p.val[1];
+            o.val[2] = p.val[2];
+            vst3q_u8(dest + i*3, o);
+         }
+         break;
+      case STBI__COMBO(3,1):
+      case STBI__COMBO(4,1):
+         // the weights add up to 256, so the sum fits in 16 bits
+         for (; i+15 < x; i += 16) {
+            uint8x16_t r, g, b;
+            uint16x8_t lo, hi;
+            if (img_n == 3) {
+               uint8x16x3_t p = vld3q_u8(src + i*3);
+               r = p.val[0]; g = p.val[1]; b = p.val[2];
+            } else {
+               uint8x16x4_t p = vld4q_u8(src + i*4);
+               r = p.val[0]; g = p.val[1]; b = p.val[2];
+            }
+            lo = vmull_u8(vget_low_u8(r), wr);
+            lo = vmlal_u8(lo, vget_low_u8(g), wg);
+            lo = vmlal_u8(lo, vget_low_u8(b), wb);
+            hi = vmull_u8(vget_high_u8(r), wr);
+            hi = vmlal_u8(hi, vget_high_u8(g), wg);
+            hi = vmlal_u8(hi, vget_high_u8(b), wb);
+            vst1q_u8(dest + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+         }
+         break;
+   }
+   return i;
+}
+#endif // STBI__NEON_EXTRA
+
+static int stbi__convert_format_row_simd(stbi_uc *dest, stbi_uc const *src, int img_n, int req_comp, int x)
+{
+#ifdef STBI_AVX2
+   if (stbi__avx2_rows()) {
+      switch (STBI__COMBO(img_n, req_comp)) {
+         case STBI__COMBO(3,4): return stbi__convert_3_to_4_avx2(dest, src, x);
+         case STBI__COMBO(4,3): return stbi__convert_4_to_3_avx2(dest, src, x);
+         case STBI__COMBO(3,1): return stbi__convert_3_to_1_avx2(dest, src, x);
+         case STBI__COMBO(4,1): return stbi__convert_4_to_1_avx2(dest, src, x);
+      }
+   }
+#endif
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      switch (STBI__COMBO(img_n, req_comp)) {
+         case STBI__COMBO(1,4): return stbi__convert_1_to_4_sse2(dest, src, x);
+         case STBI__COMBO(4,1): return stbi__convert_4_to_1_sse2(dest, src, x);
+      }
+   }
+#endif
+#ifdef STBI__NEON_EXTRA
+   return stbi__convert_format_row_neon(dest, src, img_n, req_comp, x);
+#else
+   return 0;
+#endif
+}
+#endif // STBI_SSE2 || STBI__NEON_EXTRA
+
+// convert one scanline of x pixels; returns 0 for an unsupported combination
+static int stbi__convert_format_row(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   #ifdef STBI__CONVERT_SIMD
+   i = stbi__convert_format_row_simd(dest, src, img_n, req_comp, (int) x);
+   src += i*img_n;
+   dest += i*req_comp;
+   x -= i;
+   #endif
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
+static unsigned char *stbi__convert_format(stbi_allocator const *a, unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+{
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
-   good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
+   good = (unsigned char *) stbi__malloc_mad3(a, req_comp, x, y, 0);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(a, data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
+      if (!stbi__convert_format_row(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x)) {
+         stbi__free(a, data);
+         stbi__free(a, good);
+         return stbi__errpuc("unsupported", "Unsupported format conversion");
+      }
+   }
 
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
-   }
-
-   STBI_FREE(data);
+   stbi__free(a, data);
    return good;
 }
 #endif
@@ -1748,85 +2977,210 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
 // nothing
 #else
-static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+#ifdef STBI__CONVERT_SIMD
+// the same for 16-bit channels, without the luma cases (which need 32-bit
+// sums)
+#ifdef STBI_SSE2
+static int stbi__convert16_1_to_4_sse2(stbi__uint16 *dest, stbi__uint16 const *src, int x)
 {
-   int i,j;
+   int i = 0;
+   __m128i ff = _mm_set1_epi16(-1);
+   for (; i+7 < x; i += 8) {
+      __m128i g = _mm_loadu_si128((__m128i const *) (src + i));
+      __m128i gg_lo = _mm_unpacklo_epi16(g, g), gg_hi = _mm_unpackhi_epi16(g, g);
+      __m128i ga_lo = _mm_unpacklo_epi16(g, ff), ga_hi = _mm_unpackhi_epi16(g, ff);
+      _mm_storeu_si128((__m128i *) (dest + i*4     ), _mm_unpacklo_epi32(gg_lo, ga_lo));
+      _mm_storeu_si128((__m128i *) (dest + i*4 +  8), _mm_unpackhi_epi32(gg_lo, ga_lo));
+      _mm_storeu_si128((__m128i *) (dest + i*4 + 16), _mm_unpacklo_epi32(gg_hi, ga_hi));
+      _mm_storeu_si128((__m128i *) (dest + i*4 + 24), _mm_unpackhi_epi32(gg_hi, ga_hi));
+   }
+   return i;
+}
+#endif
+
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static int stbi__convert16_3_to_4_avx2(stbi__uint16 *dest, stbi__uint16 const *src, int x)
+{
+   int i = 0;
+   __m256i idx   = _mm256_setr_epi32(0,1,2,3, 3,4,5,6);
+   __m256i shuf  = _mm256_setr_epi8(0,1,2,3,4,5,-1,-1, 6,7,8,9,10,11,-1,-1,
+                                    0,1,2,3,4,5,-1,-1, 6,7,8,9,10,11,-1,-1);
+   __m256i alpha = _mm256_set1_epi64x((long long) 0xffff000000000000ull);
+   // the load reads 32 bytes for 24, so stop 2 pixels early
+   for (; i+5 < x; i += 4) {
+      __m256i p = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i const *) (src + i*3)), idx);
+      _mm256_storeu_si256((__m256i *) (dest + i*4), _mm256_or_si256(_mm256_shuffle_epi8(p, shuf), alpha));
+   }
+   return i;
+}
+
+STBI__AVX2_TARGET
+static int stbi__convert16_4_to_3_avx2(stbi__uint16 *dest, stbi__uint16 const *src, int x)
+{
+   int i = 0;
+   __m256i shuf = _mm256_setr_epi8(0,1,2,3,4,5, 8,9,10,11,12,13, -1,-1,-1,-1,
+                                   0,1,2,3,4,5, 8,9,10,11,12,13, -1,-1,-1,-1);
+   __m256i idx  = _mm256_setr_epi32(0,1,2, 4,5,6, 3,7);
+   for (; i+3 < x; i += 4) {
+      __m256i p = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i const *) (src + i*4)), shuf);
+      p = _mm256_permutevar8x32_epi32(p, idx);
+      _mm_storeu_si128((__m128i *) (dest + i*3), _mm256_castsi256_si128(p));
+      _mm_storel_epi64((__m128i *) (dest + i*3 + 8), _mm256_extracti128_si256(p, 1));
+   }
+   return i;
+}
+#endif
+
+static int stbi__convert_format16_row_simd(stbi__uint16 *dest, stbi__uint16 const *src, int img_n, int req_comp, int x)
+{
+   int i = 0;
+#ifdef STBI_AVX2
+   if (stbi__avx2_rows()) {
+      switch (STBI__COMBO(img_n, req_comp)) {
+         case STBI__COMBO(3,4): return stbi__convert16_3_to_4_avx2(dest, src, x);
+         case STBI__COMBO(4,3): return stbi__convert16_4_to_3_avx2(dest, src, x);
+      }
+   }
+#endif
+#ifdef STBI_SSE2
+   if (stbi__sse2_available() && STBI__COMBO(img_n, req_comp) == STBI__COMBO(1,4))
+      return stbi__convert16_1_to_4_sse2(dest, src, x);
+#endif
+#ifdef STBI__NEON_EXTRA
+   {
+      uint16x8_t ff = vdupq_n_u16(0xffff);
+      switch (STBI__COMBO(img_n, req_comp)) {
+         case STBI__COMBO(1,4):
+            for (; i+7 < x; i += 8) {
+               uint16x8x4_t o;
+               o.val[0] = o.val[1] = o.val[2] = vld1q_u16(src + i);
+               o.val[3] = ff;
+               vst4q_u16(dest + i*4, o);
+            }
+            break;
+         case STBI__COMBO(3,4):
+            for (; i+7 < x; i += 8) {
+               uint16x8x3_t p = vld3q_u16(src + i*3);
+               uint16x8x4_t o;
+               o.val[0] = p.val[0];
+               o.val[1] = p.val[1];
+               o.val[2] = p.val[2];
+               o.val[3] = ff;
+               vst4q_u16(dest + i*4, o);
+            }
+            break;
+         case STBI__COMBO(4,3):
+            for (; i+7 < x; i += 8) {
+               uint16x8x4_t p = vld4q_u16(src + i*4);
+               uint16x8x3_t o;
+               o.val[0] = p.val[0];
+               o.val[1] = p.val[1];
+               o.val[2] = p.val[2];
+               vst3q_u16(dest + i*3, o);
+            }
+            break;
+      }
+   }
+#endif
+   return i;
+}
+#endif // STBI__CONVERT_SIMD
+
+static int stbi__convert_format16_row(stbi__uint16 *dest, stbi__uint16 *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   #ifdef STBI__CONVERT_SIMD
+   i = stbi__convert_format16_row_simd(dest, src, img_n, req_comp, (int) x);
+   src += i*img_n;
+   dest += i*req_comp;
+   x -= i;
+   #endif
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
+static stbi__uint16 *stbi__convert_format16(stbi_allocator const *a, stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+{
+   int j;
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
-   good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
+   good = (stbi__uint16 *) stbi__malloc(a, req_comp * x * y * 2);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(a, data);
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
-      stbi__uint16 *src  = data + j * x * img_n   ;
-      stbi__uint16 *dest = good + j * x * req_comp;
+      if (!stbi__convert_format16_row(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x)) {
+         stbi__free(a, data);
+         stbi__free(a, good);
+         return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
+      }
+   }
 
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
-   }
-
-   STBI_FREE(data);
+   stbi__free(a, data);
    return good;
 }
 #endif
 
 #ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+static float   *stbi__ldr_to_hdr(stbi_allocator const *a, stbi_uc *data, int x, int y, int comp)
 {
    int i,k,n;
-   float *output;
+   float *output, lut[256];
    if (!data) return NULL;
-   output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   output = NULL;
+   // widened in place like stbi__convert_8_to_16
+   if (stbi__mad4sizes_valid(x, y, comp, sizeof(float), 0))
+      output = (float *) stbi__realloc_sized(a, data, (size_t) x*y*comp, (size_t) x*y*comp*sizeof(float));
+   if (output == NULL) { stbi__free(a, data); return stbi__errpf("outofmem", "Out of memory"); }
+   data = (stbi_uc *) output;
+   for (i=0; i < 256; ++i)
+      lut[i] = (float) (pow(i/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
-      }
-   }
-   if (n < comp) {
-      for (i=0; i < x*y; ++i) {
+   for (i=x*y-1; i >= 0; --i) {
+      if (n < comp)
          output[i*comp + n] = data[i*comp + n]/255.0f;
-      }
+      for (k=n-1; k >= 0; --k)
+         output[i*comp + k] = lut[data[i*comp + k]];
    }
-   STBI_FREE(data);
    return output;
 }
 #endif
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+static stbi_uc *stbi__hdr_to_ldr(stbi_allocator const *a, float   *data, int x, int y, int comp)
 {
    int i,k,n;
    stbi_uc *output;
    if (!data) return NULL;
-   output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   output = (stbi_uc *) stbi__malloc_mad3(a, x, y, comp, 0);
+   if (output == NULL) { stbi__free(a, data); return stbi__errpuc("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
@@ -1843,7 +3197,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+   stbi__free(a, data);
    return output;
 }
 #endif
@@ -1871,8 +3225,15 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 
 #ifndef STBI_NO_JPEG
 
-// huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+// huffman decoding acceleration: codes of up to FAST_BITS bits, and AC
+// codes plus their value bits if that fits, take one table lookup
+#ifndef STBI_JPEG_FAST_BITS
+#define STBI_JPEG_FAST_BITS  10
+#endif
+#if STBI_JPEG_FAST_BITS < 1 || STBI_JPEG_FAST_BITS > 15
+#error "STBI_JPEG_FAST_BITS must be from 1 to 15" // fast_ac packs the code and value lengths in 4 bits
+#endif
+#define FAST_BITS   STBI_JPEG_FAST_BITS  // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1885,6 +3246,14 @@ typedef struct
    int    delta[17];   // old 'firstsymbol' - old 'firstcode'
 } stbi__huffman;
 
+#ifdef STBI_PROFILE
+typedef struct
+{
+   stbi_uc *out0, *out1; // out1: the second block of a pair, or NULL
+   int stride;
+} stbi__jpeg_idct_job;
+#endif
+
 typedef struct
 {
    stbi__context *s;
@@ -1913,9 +3282,16 @@ typedef struct
       stbi_uc *linebuf;
       short   *coeff;   // progressive only
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+
+      // progressive, compact: see stbi__jpeg_coeff_load
+      short       *coeff_dc;
+      signed char *coeff_ac;
+      int         *coeff_wide;
+      short       *wide;
+      int          wide_n, wide_cap;
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, next bit in the MSB
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1933,8 +3309,44 @@ typedef struct
    int scan_n, order[4];
    int restart_interval, todo;
 
+// DCT-domain downscaling: blocks are reconstructed at (8>>scale_shift)^2 pixels
+   int scale_shift;
+
+// row-at-a-time decoding: component buffers hold two MCU rows used as a ring,
+// and MCU rows are decoded on demand
+   int stream;
+   int stream_next, stream_end;
+
+// optional job dispatcher for decoding restart intervals concurrently
+   stbi_parallel_for *parallel_for;
+   void *parallel_user;
+
+// region decoding: the requested rectangle in pixels (region_w == 0: none),
+// and the MCUs that get transformed, columns [win_x0,win_x1) from row win_y0
+// on (win_x1 == 0: all of them)
+   int region_x, region_y, region_w, region_h;
+   int win_x0, win_x1, win_y0;
+
+// low-memory progressive decoding: compact coefficient storage, and an
+// optional 1/8-scale preview once every component's DC is known
+   int compact;
+   int dc_seen;
+   int preview_comp;
+   stbi_jpeg_preview *preview;
+   void *preview_user;
+
+// profiling: baseline IDCTs are queued and run a row at a time, so the hook
+// isn't called for every block (see stbi__jpeg_idct_flush)
+#ifdef STBI_PROFILE
+   void *idct_raw;
+   short *idct_data; // 64 coefficients per queued block
+   stbi__jpeg_idct_job *idct_q;
+   int idct_n, idct_max;
+#endif
+
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_block2_kernel)(stbi_uc *out0, stbi_uc *out1, int out_stride, short data[128]); // optional
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -2008,22 +3420,44 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
    }
 }
 
+// top up the bit buffer to 57+ bits. If the next 8 bytes hold no 0xff (so no
+// marker or stuffed byte), as many as fit go in at once; otherwise a byte at
+// a time, until a marker is seen, after which it fills with zeros
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
+   if (!j->nomore && j->code_bits >= 0 && s->img_buffer_end - s->img_buffer >= 8) {
+      stbi_uc *p = s->img_buffer;
+      stbi__uint64 v = ((stbi__uint64) p[0] << 56) | ((stbi__uint64) p[1] << 48) |
+                       ((stbi__uint64) p[2] << 40) | ((stbi__uint64) p[3] << 32) |
+                       ((stbi__uint64) p[4] << 24) | ((stbi__uint64) p[5] << 16) |
+                       ((stbi__uint64) p[6] <<  8) |  (stbi__uint64) p[7];
+      stbi__uint64 ones = ~(stbi__uint64) 0 / 255; // 0x0101...01
+      // a byte of v is 0xff iff that byte of ~v is zero
+      if ((((~v) - ones) & v & (ones << 7)) == 0) {
+         int n = (64 - j->code_bits) >> 3;
+         if (n) {
+            j->code_buffer |= (v >> (64 - n*8)) << (64 - j->code_bits - n*8);
+            s->img_buffer += n;
+            j->code_bits += n*8;
+         }
+         return;
+      }
+   }
    do {
-      unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
+      unsigned int b = j->nomore ? 0 : stbi__get8(s);
       if (b == 0xff) {
-         int c = stbi__get8(j->s);
-         while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
+         int c = stbi__get8(s);
+         while (c == 0xff) c = stbi__get8(s); // consume fill bytes
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
 // (1 << n) - 1
@@ -2039,7 +3473,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -2056,7 +3490,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -2070,8 +3504,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
+   STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -2089,14 +3523,13 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
    unsigned int k;
    int sgn;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
+   if (n <= 0 || n >= (int) (sizeof(stbi__bmask)/sizeof(*stbi__bmask))) return 0;
 
-   sgn = (stbi__int32)j->code_buffer >> 31; // sign bit is always in MSB
-   k = stbi_lrot(j->code_buffer, n);
-   if (n < 0 || n >= (int) (sizeof(stbi__bmask)/sizeof(*stbi__bmask))) return 0;
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = (int) (j->code_buffer >> 63) - 1; // 0 if the MSB is set, else -1
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
-   return k + (stbi__jbias[n] & ~sgn);
+   return k + (stbi__jbias[n] & sgn);
 }
 
 // get some unsigned bits
@@ -2104,21 +3537,20 @@ stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
    unsigned int k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-   k = j->code_buffer;
+   k = (int) (j->code_buffer >> 63);
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2162,7 +3594,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
          k += (r >> 4) & 15; // run
@@ -2237,7 +3669,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2449,6 +3881,63 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced-size IDCTs for decoding at 1/2, 1/4 and 1/8 scale. the NxN output
+// is the N-point IDCT of the lowest NxN coefficients, normalized so that a
+// flat block gives the same value it would at full size; the other
+// coefficients are simply ignored.
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[16],*v=val;
+   stbi_uc *o;
+   short *d = data;
+
+   #define STBI__IDCT_4(s0,s1,s2,s3) \
+      int e0 = ((s0) + (s2)) * stbi__f2f(0.707106781f); \
+      int e1 = ((s0) - (s2)) * stbi__f2f(0.707106781f); \
+      int o0 = (s1) * stbi__f2f(0.923879533f) + (s3) * stbi__f2f(0.382683432f); \
+      int o1 = (s1) * stbi__f2f(0.382683432f) - (s3) * stbi__f2f(0.923879533f);
+
+   // columns, keeping 2 extra bits of precision like stbi__idct_block
+   for (i=0; i < 4; ++i,++d,++v) {
+      STBI__IDCT_4(d[0],d[8],d[16],d[24])
+      e0 += 512; e1 += 512;
+      v[ 0] = (e0+o0) >> 10;
+      v[12] = (e0-o0) >> 10;
+      v[ 4] = (e1+o1) >> 10;
+      v[ 8] = (e1-o1) >> 10;
+   }
+
+   // rows; 1<<12 from the constants, 1<<2 from above, and the 2D transform
+   // needs a further /4, so remove 1<<16 with rounding and the +128 bias
+   for (i=0, v=val, o=out; i < 4; ++i,v+=4,o+=out_stride) {
+      STBI__IDCT_4(v[0],v[1],v[2],v[3])
+      e0 += 32768 + (128<<16);
+      e1 += 32768 + (128<<16);
+      o[0] = stbi__clamp((e0+o0) >> 16);
+      o[3] = stbi__clamp((e0-o0) >> 16);
+      o[1] = stbi__clamp((e1+o1) >> 16);
+      o[2] = stbi__clamp((e1-o1) >> 16);
+   }
+   #undef STBI__IDCT_4
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   // the 2-point IDCT is just a sum and difference
+   int a = data[0] + data[8], b = data[0] - data[8];
+   int c = data[1] + data[9], d = data[1] - data[9];
+   out[0]            = stbi__clamp((a + c + 4 + (128<<3)) >> 3);
+   out[1]            = stbi__clamp((a - c + 4 + (128<<3)) >> 3);
+   out[out_stride  ] = stbi__clamp((b + d + 4 + (128<<3)) >> 3);
+   out[out_stride+1] = stbi__clamp((b - d + 4 + (128<<3)) >> 3);
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp((data[0] + 4 + (128<<3)) >> 3);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2462,60 +3951,232 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
    // dot product constant: even elems=x, odd elems=y
    #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
 
-   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
-   // out(1) = c1[even]*x + c1[odd]*y
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// avx2 version of the sse2 IDCT above, doing two blocks at once: the
+// 256-bit integer ops work on each 128-bit lane separately, so with one
+// block per lane this is the exact same computation, bit for bit.
+STBI__AVX2_TARGET
+static void stbi__idct_avx2(stbi_uc *out0, stbi_uc *out1, int out_stride, short data[128])
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
    #define dct_rot(out0,out1, x,y,c0,c1) \
-      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
-      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
-      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
-      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
-      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
-      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
 
-   // out = in << 12  (in 16-bit, out 32-bit)
    #define dct_widen(out, in) \
-      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
-      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
 
-   // wide add
    #define dct_wadd(out, a, b) \
-      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
-      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
 
-   // wide sub
    #define dct_wsub(out, a, b) \
-      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
-      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
 
-   // butterfly a/b, add bias, then shift by "s" and pack
    #define dct_bfly32o(out0, out1, a,b,bias,s) \
       { \
-         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
-         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
          dct_wadd(sum, abiased, b); \
          dct_wsub(dif, abiased, b); \
-         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
-         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
       }
 
-   // 8-bit interleave step (for transposes)
    #define dct_interleave8(a, b) \
       tmp = a; \
-      a = _mm_unpacklo_epi8(a, b); \
-      b = _mm_unpackhi_epi8(tmp, b)
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
 
-   // 16-bit interleave step (for transposes)
    #define dct_interleave16(a, b) \
       tmp = a; \
-      a = _mm_unpacklo_epi16(a, b); \
-      b = _mm_unpackhi_epi16(tmp, b)
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
 
    #define dct_pass(bias,shift) \
       { \
          /* even part */ \
          dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
-         __m128i sum04 = _mm_add_epi16(row0, row4); \
-         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
          dct_widen(t0e, sum04); \
          dct_widen(t1e, dif04); \
          dct_wadd(x0, t0e, t3e); \
@@ -2525,8 +4186,8 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
          /* odd part */ \
          dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
          dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
-         __m128i sum17 = _mm_add_epi16(row1, row7); \
-         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
          dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
          dct_wadd(x4, y0o, y4o); \
          dct_wadd(x5, y1o, y5o); \
@@ -2538,46 +4199,52 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
          dct_bfly32o(row3,row4, x3,x4,bias,shift); \
       }
 
-   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
-   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
-   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
-   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
-   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
-   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
-   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
-   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
-
-   // rounding biases in column/row passes, see stbi__idct_block for explanation.
-   __m128i bias_0 = _mm_set1_epi32(512);
-   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
-
-   // load
-   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
-   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
-   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
-   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
-   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
-   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
-   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
-   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+   // block 0 in the low lane, block 1 in the high lane
+   #define dct_load(r) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (data + (r)*8))), \
+                              _mm_loadu_si128((const __m128i *) (data + 64 + (r)*8)), 1)
+
+   #define dct_store(p) \
+      _mm_storel_epi64((__m128i *) out0, _mm256_castsi256_si128(p)); \
+      _mm_storel_epi64((__m128i *) out1, _mm256_extracti128_si256(p, 1)); \
+      out0 += out_stride; out1 += out_stride
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
 
    // column pass
    dct_pass(bias_0, 10);
 
    {
-      // 16bit 8x8 transpose pass 1
+      // 16bit 8x8 transpose, per lane
       dct_interleave16(row0, row4);
       dct_interleave16(row1, row5);
       dct_interleave16(row2, row6);
       dct_interleave16(row3, row7);
 
-      // transpose pass 2
       dct_interleave16(row0, row2);
       dct_interleave16(row1, row3);
       dct_interleave16(row4, row6);
       dct_interleave16(row5, row7);
 
-      // transpose pass 3
       dct_interleave16(row0, row1);
       dct_interleave16(row2, row3);
       dct_interleave16(row4, row5);
@@ -2589,32 +4256,30 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
    {
       // pack
-      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
-      __m128i p1 = _mm_packus_epi16(row2, row3);
-      __m128i p2 = _mm_packus_epi16(row4, row5);
-      __m128i p3 = _mm_packus_epi16(row6, row7);
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
 
-      // 8bit 8x8 transpose pass 1
-      dct_interleave8(p0, p2); // a0e0a1e1...
-      dct_interleave8(p1, p3); // c0g0c1g1...
+      // 8bit 8x8 transpose, per lane
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
 
-      // transpose pass 2
-      dct_interleave8(p0, p1); // a0c0e0g0...
-      dct_interleave8(p2, p3); // b0d0f0h0...
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
 
-      // transpose pass 3
-      dct_interleave8(p0, p2); // a0b0c0d0...
-      dct_interleave8(p1, p3); // a4b4c4d4...
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
 
       // store
-      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
-      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
-      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
-      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
-      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
-      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
-      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
-      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+      dct_store(p0);
+      dct_store(_mm256_shuffle_epi32(p0, 0x4e));
+      dct_store(p2);
+      dct_store(_mm256_shuffle_epi32(p2, 0x4e));
+      dct_store(p1);
+      dct_store(_mm256_shuffle_epi32(p1, 0x4e));
+      dct_store(p3);
+      dct_store(_mm256_shuffle_epi32(p3, 0x4e));
    }
 
 #undef dct_const
@@ -2626,9 +4291,10 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 #undef dct_interleave8
 #undef dct_interleave16
 #undef dct_pass
+#undef dct_load
+#undef dct_store
 }
-
-#endif // STBI_SSE2
+#endif // STBI_AVX2
 
 #ifdef STBI_NEON
 
@@ -2872,67 +4538,281 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+#ifdef STBI_PROFILE
+// room for one MCU row's blocks; without it, each IDCT is timed on its own
+static void stbi__jpeg_idct_alloc(stbi__jpeg *z)
 {
-   stbi__jpeg_reset(z);
-   if (!z->progressive) {
-      if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  // if it's NOT a restart, then just bail, so we get corrupt data
-                  // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+   int k, n = 0;
+   for (k=0; k < z->s->img_n; ++k)
+      n += z->img_comp[k].h * z->img_comp[k].v;
+   z->idct_n = 0;
+   z->idct_max = z->img_mcu_x * n + 1; // +1: stbi__jpeg_idct_data wants room for a pair
+   z->idct_raw = stbi__malloc_mad2(z->s->alloc, z->idct_max, 64*sizeof(short) + sizeof(stbi__jpeg_idct_job), 15);
+   if (!z->idct_raw) return;
+   z->idct_data = (short *) (((size_t) z->idct_raw + 15) & ~15);
+   z->idct_q = (stbi__jpeg_idct_job *) (z->idct_data + 64 * z->idct_max);
+}
+
+static void stbi__jpeg_idct_free(stbi__jpeg *z)
+{
+   stbi__free(z->s->alloc, z->idct_raw);
+   z->idct_raw = NULL;
+}
+
+static void stbi__jpeg_idct_flush(stbi__jpeg *z)
+{
+   int k;
+   if (!z->idct_n) return;
+   STBI_PROFILE(STBI_PROFILE_IDCT, 1);
+   for (k=0; k < z->idct_n; ++k) {
+      stbi__jpeg_idct_job *q = &z->idct_q[k];
+      if (q->out1)
+         z->idct_block2_kernel(q->out0, q->out1, q->stride, z->idct_data + 64*k++);
+      else
+         z->idct_block_kernel(q->out0, q->stride, z->idct_data + 64*k);
+   }
+   STBI_PROFILE(STBI_PROFILE_IDCT, 0);
+   z->idct_n = 0;
+}
+
+// where to entropy-decode the next block (and its pair) to
+static short *stbi__jpeg_idct_data(stbi__jpeg *z, short *local)
+{
+   if (!z->idct_raw) return local;
+   if (z->idct_n + 2 > z->idct_max) stbi__jpeg_idct_flush(z);
+   return z->idct_data + 64 * z->idct_n;
+}
+
+// out1: the second block of a pair in data[64..127], or NULL
+static void stbi__jpeg_idct2(stbi__jpeg *z, stbi_uc *out0, stbi_uc *out1, int stride, short *data)
+{
+   if (z->idct_raw) {
+      stbi__jpeg_idct_job *q = &z->idct_q[z->idct_n];
+      q->out0 = out0;
+      q->out1 = out1;
+      q->stride = stride;
+      z->idct_n += out1 ? 2 : 1;
+   } else if (out1)
+      STBI__PROFILED(STBI_PROFILE_IDCT, z->idct_block2_kernel(out0, out1, stride, data));
+   else
+      STBI__PROFILED(STBI_PROFILE_IDCT, z->idct_block_kernel(out0, stride, data));
+}
+#define stbi__jpeg_idct(z, out, stride, data)    stbi__jpeg_idct2(z, out, NULL, stride, data)
+#else
+#define stbi__jpeg_idct_alloc(z)                 ((void) 0)
+#define stbi__jpeg_idct_free(z)                  ((void) 0)
+#define stbi__jpeg_idct_flush(z)                 ((void) 0)
+#define stbi__jpeg_idct_data(z, local)           (local)
+#define stbi__jpeg_idct(z, out, stride, data)    (z)->idct_block_kernel(out, stride, data)
+#define stbi__jpeg_idct2(z, out0, out1, stride, data)  (z)->idct_block2_kernel(out0, out1, stride, data)
+#endif
+
+// scan an interleaved baseline mcu... process scan_n components in order
+static int stbi__jpeg_decode_mcu(stbi__jpeg *z, int i, int j)
+{
+   STBI_SIMD_ALIGN(short, buf[128]);
+   int k,x,y, bs = 8 >> z->scale_shift;
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      int ha = z->img_comp[n].ha;
+      // scan out an mcu's worth of this component; that's just determined
+      // by the basic H and V specified for the component
+      for (y=0; y < z->img_comp[n].v; ++y) {
+         for (x=0; x < z->img_comp[n].h; ++x) {
+            int x2 = (i*z->img_comp[n].h + x)*bs;
+            int y2 = (j*z->img_comp[n].v + y)*bs;
+            stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*y2+x2;
+            short *data = stbi__jpeg_idct_data(z, buf);
+            if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            if (z->idct_block2_kernel && x+1 < z->img_comp[n].h) {
+               // horizontally adjacent blocks go through the two-block kernel
+               if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               stbi__jpeg_idct2(z, out, out+bs, z->img_comp[n].w2, data);
+               ++x;
+            } else
+               stbi__jpeg_idct(z, out, z->img_comp[n].w2, data);
          }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+      }
+   }
+   return 1;
+}
+
+// entropy-decode an interleaved MCU outside the region without transforming it
+static int stbi__jpeg_skip_mcu(stbi__jpeg *z)
+{
+   STBI_SIMD_ALIGN(short, data[64]);
+   int k,b;
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      int ha = z->img_comp[n].ha;
+      for (b=0; b < z->img_comp[n].h * z->img_comp[n].v; ++b)
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+   }
+   return 1;
+}
+
+// decode one row of blocks (non-interleaved) or MCUs (interleaved) of a
+// baseline scan into row j of the component buffers; returns 0 on error, or
+// 2 if the scan ended early
+static int stbi__jpeg_decode_row(stbi__jpeg *z, int j)
+{
+   int i;
+   if (z->scan_n == 1) {
+      int bs = 8 >> z->scale_shift;
+      STBI_SIMD_ALIGN(short, buf[128]);
+      int n = z->order[0];
+      int ha = z->img_comp[n].ha;
+      // non-interleaved data, we just need to process one block at a time,
+      // in trivial scanline order
+      // number of blocks to do just depends on how many actual "pixels" this
+      // component has, independent of interleaved MCU blocking and such
+      int w = (z->img_comp[n].x+7) >> 3;
+      // blocks outside the region are only entropy-decoded
+      int x0 = z->win_x0 * z->img_comp[n].h, x1 = z->win_x1 ? z->win_x1 * z->img_comp[n].h : w;
+      int skip = (z->stream ? z->stream_next : j) < z->win_y0 * z->img_comp[n].v;
+      for (i=0; i < w; ++i) {
+         stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs;
+         short *data = stbi__jpeg_idct_data(z, buf);
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         if (skip || i < x0 || i >= x1) {
+            // nothing to transform
+         } else if (z->idct_block2_kernel && i+1 < w && z->todo > 1) {
+            // pair up with the next block if there's no restart in between
+            if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            stbi__jpeg_idct2(z, out, out+bs, z->img_comp[n].w2, data);
+            --z->todo;
+            ++i;
+         } else
+            stbi__jpeg_idct(z, out, z->img_comp[n].w2, data);
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!STBI__RESTART(z->marker)) return 2;
+            stbi__jpeg_reset(z);
+         }
+      }
+   } else { // interleaved
+      int x1 = z->win_x1 ? z->win_x1 : z->img_mcu_x;
+      int skip = (z->stream ? z->stream_next : j) < z->win_y0;
+      for (i=0; i < z->img_mcu_x; ++i) {
+         if (skip || i < z->win_x0 || i >= x1) {
+            if (!stbi__jpeg_skip_mcu(z)) return 0;
+         } else if (!stbi__jpeg_decode_mcu(z, i, j)) return 0;
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            if (!STBI__RESTART(z->marker)) return 2;
+            stbi__jpeg_reset(z);
          }
+      }
+   }
+   return 1;
+}
+
+// number of block (or MCU) rows in a baseline scan
+static int stbi__jpeg_scan_rows(stbi__jpeg *z)
+{
+   return z->scan_n == 1 ? (z->img_comp[z->order[0]].y+7) >> 3 : z->img_mcu_y;
+}
+
+// compact coefficient storage for progressive JPEGs: the DC of each block is
+// a short, its AC coefficients are signed bytes in zigzag order; a block with
+// an AC value that doesn't fit moves to a short[64] in 'wide' for good (values
+// only ever gain bits). The decoders work on a block expanded into tmp, and
+// only the coefficients the current scan can touch are moved in and out.
+static short *stbi__jpeg_coeff_load(stbi__jpeg *z, int n, int b, short *tmp)
+{
+   int k;
+   if (!z->compact) return z->img_comp[n].coeff + 64 * b;
+   if (z->spec_start != 0) {
+      if (z->img_comp[n].coeff_wide[b])
+         memcpy(tmp, z->img_comp[n].wide + 64 * (z->img_comp[n].coeff_wide[b]-1), 64 * sizeof(short));
+      else {
+         signed char *ac = z->img_comp[n].coeff_ac + 63 * b;
+         for (k=z->spec_start; k <= z->spec_end; ++k)
+            tmp[stbi__jpeg_dezigzag[k]] = ac[k-1];
+      }
+   }
+   tmp[0] = z->img_comp[n].coeff_dc[b];
+   return tmp;
+}
+
+static int stbi__jpeg_coeff_store(stbi__jpeg *z, int n, int b, short *tmp)
+{
+   short *w;
+   int k;
+   if (!z->compact) return 1;
+   z->img_comp[n].coeff_dc[b] = tmp[0];
+   if (z->spec_start == 0) return 1;
+   if (!z->img_comp[n].coeff_wide[b]) {
+      signed char *ac = z->img_comp[n].coeff_ac + 63 * b;
+      for (k=z->spec_start; k <= z->spec_end; ++k) {
+         int v = tmp[stbi__jpeg_dezigzag[k]];
+         if (v < -128 || v > 127) break;
+      }
+      if (k > z->spec_end) {
+         for (k=z->spec_start; k <= z->spec_end; ++k)
+            ac[k-1] = (signed char) tmp[stbi__jpeg_dezigzag[k]];
          return 1;
       }
+      // promote the block
+      if (z->img_comp[n].wide_n == z->img_comp[n].wide_cap) {
+         int cap = z->img_comp[n].wide_cap ? z->img_comp[n].wide_cap * 2 : 64;
+         size_t old = (size_t) z->img_comp[n].wide_cap * 64 * sizeof(short);
+         if (cap > z->img_comp[n].coeff_w * z->img_comp[n].coeff_h) cap = z->img_comp[n].coeff_w * z->img_comp[n].coeff_h;
+         w = (short *) stbi__realloc_sized(z->s->alloc, z->img_comp[n].wide, old, (size_t) cap * 64 * sizeof(short));
+         if (w == NULL) return stbi__err("outofmem", "Out of memory");
+         z->img_comp[n].wide = w;
+         z->img_comp[n].wide_cap = cap;
+      }
+      w = z->img_comp[n].wide + 64 * z->img_comp[n].wide_n;
+      for (k=1; k < 64; ++k)
+         w[stbi__jpeg_dezigzag[k]] = ac[k-1];
+      z->img_comp[n].coeff_wide[b] = ++z->img_comp[n].wide_n;
+   }
+   w = z->img_comp[n].wide + 64 * (z->img_comp[n].coeff_wide[b]-1);
+   for (k=z->spec_start; k <= z->spec_end; ++k)
+      w[stbi__jpeg_dezigzag[k]] = tmp[stbi__jpeg_dezigzag[k]];
+   return 1;
+}
+
+// all 64 coefficients of a compact block, in natural order
+static void stbi__jpeg_coeff_expand(stbi__jpeg *z, int n, int b, short *out)
+{
+   int k;
+   if (z->img_comp[n].coeff_wide[b])
+      memcpy(out, z->img_comp[n].wide + 64 * (z->img_comp[n].coeff_wide[b]-1), 64 * sizeof(short));
+   else {
+      signed char *ac = z->img_comp[n].coeff_ac + 63 * b;
+      for (k=1; k < 64; ++k)
+         out[stbi__jpeg_dezigzag[k]] = ac[k-1];
+   }
+   out[0] = z->img_comp[n].coeff_dc[b];
+}
+
+static void stbi__jpeg_free_compact(stbi__jpeg *z, int n)
+{
+   stbi__free(z->s->alloc, z->img_comp[n].coeff_dc);   z->img_comp[n].coeff_dc = NULL;
+   stbi__free(z->s->alloc, z->img_comp[n].coeff_ac);   z->img_comp[n].coeff_ac = NULL;
+   stbi__free(z->s->alloc, z->img_comp[n].coeff_wide); z->img_comp[n].coeff_wide = NULL;
+   stbi__free(z->s->alloc, z->img_comp[n].wide);       z->img_comp[n].wide = NULL;
+   z->img_comp[n].wide_n = z->img_comp[n].wide_cap = 0;
+}
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+{
+   stbi__jpeg_reset(z);
+   if (!z->progressive) {
+      int j, r, h = stbi__jpeg_scan_rows(z);
+      for (j=0; j < h; ++j) {
+         r = stbi__jpeg_decode_row(z, j);
+         stbi__jpeg_idct_flush(z);
+         if (r != 1) return r == 2;
+      }
+      return 1;
    } else {
       if (z->scan_n == 1) {
          int i,j;
@@ -2945,7 +4825,9 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               short tmp[64];
+               int b = i + j * z->img_comp[n].coeff_w;
+               short *data = stbi__jpeg_coeff_load(z, n, b, tmp);
                if (z->spec_start == 0) {
                   if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                      return 0;
@@ -2954,6 +4836,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   if (!stbi__jpeg_decode_block_prog_ac(z, data, &z->huff_ac[ha], z->fast_ac[ha]))
                      return 0;
                }
+               if (!stbi__jpeg_coeff_store(z, n, b, data))
+                  return 0;
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2976,9 +4860,13 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                      for (x=0; x < z->img_comp[n].h; ++x) {
                         int x2 = (i*z->img_comp[n].h + x);
                         int y2 = (j*z->img_comp[n].v + y);
-                        short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
+                        short tmp[64];
+                        int b = x2 + y2 * z->img_comp[n].coeff_w;
+                        short *data = stbi__jpeg_coeff_load(z, n, b, tmp);
                         if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                            return 0;
+                        if (!stbi__jpeg_coeff_store(z, n, b, data))
+                           return 0;
                      }
                   }
                }
@@ -2996,6 +4884,159 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
    }
 }
 
+// multithreaded baseline decoding. a restart marker resets all entropy
+// coder state, so each restart interval can be decoded independently once
+// we know where it starts. we find all the RSTn markers up front, then each
+// job decodes a contiguous run of intervals through its own copy of the
+// decoder state; the blocks it writes are disjoint from everybody else's.
+#define STBI__JPEG_MAX_JOBS  64
+
+typedef struct
+{
+   stbi__jpeg j;
+   stbi__context s;
+   const char *failure;
+} stbi__jpeg_job;
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__jpeg_job *job;
+   stbi_uc **seg;   // seg[i] is the start of interval i, seg[num_seg] the end of the scan
+   int num_seg, num_jobs, num_mcus;
+} stbi__jpeg_parallel;
+
+// decode MCUs [first,first+count) of a baseline scan, numbered in scan order
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int count)
+{
+   int m;
+   if (z->scan_n == 1) {
+      STBI_SIMD_ALIGN(short, buf[128]);
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      int ha = z->img_comp[n].ha;
+      int bs = 8 >> z->scale_shift;
+      for (m=first; m < first+count; ++m) {
+         int i = m % w, j = m / w;
+         stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs;
+         short *data = stbi__jpeg_idct_data(z, buf);
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         if (z->idct_block2_kernel && i+1 < w && m+1 < first+count) {
+            if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            stbi__jpeg_idct2(z, out, out+bs, z->img_comp[n].w2, data);
+            ++m;
+         } else
+            stbi__jpeg_idct(z, out, z->img_comp[n].w2, data);
+      }
+   } else {
+      for (m=first; m < first+count; ++m)
+         if (!stbi__jpeg_decode_mcu(z, m % z->img_mcu_x, m / z->img_mcu_x)) return 0;
+   }
+   return 1;
+}
+
+static void stbi__jpeg_parallel_task(void *task_data, int index)
+{
+   stbi__jpeg_parallel *p = (stbi__jpeg_parallel *) task_data;
+   stbi__jpeg_job *job = &p->job[index];
+   int ri = p->z->restart_interval;
+   int k, k0 = index * p->num_seg / p->num_jobs, k1 = (index+1) * p->num_seg / p->num_jobs;
+
+   job->j = *p->z;
+   stbi__jpeg_idct_alloc(&job->j); // a queue of its own, not p->z's
+   job->j.s = &job->s;
+   job->failure = NULL;
+   for (k=k0; k < k1; ++k) {
+      int first = k * ri;
+      int count = p->num_mcus - first < ri ? p->num_mcus - first : ri;
+      // each interval gets its own memory stream that ends right after its
+      // RSTn marker, so the bit reader stops exactly where the serial one would
+      stbi__start_mem(&job->s, p->seg[k], (int) (p->seg[k+1] - p->seg[k]));
+      stbi__jpeg_reset(&job->j);
+      if (!stbi__jpeg_decode_mcus(&job->j, first, count)) {
+         job->failure = stbi__g_failure_reason;
+         if (!job->failure) job->failure = "bad huffman code";
+         break;
+      }
+      stbi__jpeg_idct_flush(&job->j);
+      // the serial decoder abandons the image if an interval doesn't end
+      // exactly at its RSTn marker, so corrupt data must fail here too
+      if (k+1 < p->num_seg) {
+         if (job->j.code_bits < 24) stbi__grow_buffer_unsafe(&job->j);
+         if (!STBI__RESTART(job->j.marker)) {
+            job->failure = "expected marker";
+            break;
+         }
+      }
+   }
+   job->j.s = p->z->s; // the queue came from the image's allocator
+   stbi__jpeg_idct_free(&job->j);
+}
+
+// returns 1 if the scan was decoded, 0 on error, -1 if the restart markers
+// don't match the restart interval, in which case nothing was consumed
+static int stbi__parse_entropy_coded_data_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_parallel p;
+   stbi_uc *cur = z->s->img_buffer, *end = z->s->img_buffer_end, *q;
+   int n, r = 1;
+
+   if (z->scan_n == 1) {
+      int c = z->order[0];
+      p.num_mcus = ((z->img_comp[c].x+7) >> 3) * ((z->img_comp[c].y+7) >> 3);
+   } else
+      p.num_mcus = z->img_mcu_x * z->img_mcu_y;
+   p.num_seg = (p.num_mcus + z->restart_interval-1) / z->restart_interval;
+   if (p.num_seg < 2) return -1;
+
+   p.seg = (stbi_uc **) stbi__malloc_mad2(z->s->alloc, p.num_seg+1, sizeof(stbi_uc *), 0);
+   if (!p.seg) return stbi__err("outofmem", "Out of memory");
+
+   // find every RSTn; the first other marker ends the scan
+   n = 0;
+   p.seg[n++] = cur;
+   for(;;) {
+      q = (stbi_uc *) memchr(cur, 0xff, end - cur);
+      if (q == NULL || q+1 >= end) { q = end; break; }
+      if (q[1] == 0x00) { cur = q+2; continue; }   // stuffed zero
+      if (q[1] == 0xff) { cur = q+1; continue; }   // fill byte
+      if (!STBI__RESTART(q[1])) break;
+      if (n == p.num_seg) break;  // more intervals than MCUs
+      cur = q+2;
+      p.seg[n++] = cur;
+   }
+   if (n != p.num_seg || (q != end && STBI__RESTART(q[1]))) {
+      stbi__free(z->s->alloc, p.seg);
+      return -1;
+   }
+   // the last interval includes the marker after it, like the others
+   p.seg[n] = (q == end) ? end : q+2;
+
+   p.num_jobs = p.num_seg < STBI__JPEG_MAX_JOBS ? p.num_seg : STBI__JPEG_MAX_JOBS;
+   p.job = (stbi__jpeg_job *) stbi__malloc_mad2(z->s->alloc, p.num_jobs, sizeof(stbi__jpeg_job), 0);
+   if (!p.job) {
+      stbi__free(z->s->alloc, p.seg);
+      return stbi__err("outofmem", "Out of memory");
+   }
+   p.z = z;
+   z->parallel_for(z->parallel_user, stbi__jpeg_parallel_task, &p, p.num_jobs);
+
+   for (n=0; n < p.num_jobs; ++n) {
+      if (p.job[n].failure) {
+         r = stbi__err(p.job[n].failure, "Corrupt JPEG");
+         break;
+      }
+   }
+
+   // leave the stream where the serial decoder would have: wherever the
+   // last interval stopped reading, which is after the marker if it saw it
+   z->s->img_buffer = p.job[p.num_jobs-1].s.img_buffer;
+   z->marker = p.job[p.num_jobs-1].j.marker;
+   stbi__free(z->s->alloc, p.job);
+   stbi__free(z->s->alloc, p.seg);
+   return r;
+}
+
 static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
 {
    int i;
@@ -3003,23 +5044,59 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
       data[i] *= dequant[i];
 }
 
-static void stbi__jpeg_finish(stbi__jpeg *z)
+static int stbi__jpeg_finish(stbi__jpeg *z)
 {
-   if (z->progressive) {
+   if (z->compact) {
+      // component planes are only allocated now, and each component's
+      // coefficients are released as soon as it has been transformed
+      int i,j,n, bs = 8 >> z->scale_shift;
+      for (n=0; n < z->s->img_n; ++n) {
+         int w = (z->img_comp[n].x+7) >> 3;
+         int h = (z->img_comp[n].y+7) >> 3;
+         STBI_SIMD_ALIGN(short, data[128]);
+         z->img_comp[n].raw_data = stbi__malloc_mad2(z->s->alloc, z->img_comp[n].w2, z->img_comp[n].h2, 15);
+         if (z->img_comp[n].raw_data == NULL) return stbi__err("outofmem", "Out of memory");
+         z->img_comp[n].data = (stbi_uc*) (((size_t) z->img_comp[n].raw_data + 15) & ~15);
+         for (j=0; j < h; ++j) {
+            for (i=0; i < w; ++i) {
+               int b = i + j * z->img_comp[n].coeff_w;
+               stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs;
+               stbi__jpeg_coeff_expand(z, n, b, data);
+               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+               if (z->idct_block2_kernel && i+1 < w) {
+                  stbi__jpeg_coeff_expand(z, n, b+1, data+64);
+                  stbi__jpeg_dequantize(data+64, z->dequant[z->img_comp[n].tq]);
+                  z->idct_block2_kernel(out, out+bs, z->img_comp[n].w2, data);
+                  ++i;
+               } else
+                  z->idct_block_kernel(out, z->img_comp[n].w2, data);
+            }
+         }
+         stbi__jpeg_free_compact(z, n);
+      }
+   } else if (z->progressive) {
       // dequantize and idct the data
-      int i,j,n;
+      int i,j,n, bs = 8 >> z->scale_shift;
       for (n=0; n < z->s->img_n; ++n) {
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs;
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (z->idct_block2_kernel && i+1 < w) {
+                  // the next block's coefficients follow this one's
+                  stbi__jpeg_dequantize(data+64, z->dequant[z->img_comp[n].tq]);
+                  z->idct_block2_kernel(out, out+bs, z->img_comp[n].w2, data);
+                  ++i;
+               } else
+                  z->idct_block_kernel(out, z->img_comp[n].w2, data);
             }
          }
       }
    }
+   return 1;
 }
 
 static int stbi__process_marker(stbi__jpeg *z, int m)
@@ -3169,20 +5246,22 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__free(z->s->alloc, z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__free(z->s->alloc, z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__free(z->s->alloc, z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
+      stbi__jpeg_free_compact(z, i);
    }
+   stbi__jpeg_idct_free(z);
    return why;
 }
 
@@ -3247,26 +5326,47 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      //
+      // when downscaling, each 8x8 block only produces (8>>scale_shift)^2 pixels
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->scale_shift);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale_shift);
+      // when streaming, only two MCU rows are kept (see stbi__jpeg_stream_rows)
+      if (z->stream && !z->progressive)
+         z->img_comp[i].h2 = 2 * z->img_comp[i].v * (8 >> z->scale_shift);
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      if (z->compact) {
+         // the component planes wait for stbi__jpeg_finish
+         int nb = z->img_mcu_x * z->img_comp[i].h * z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].coeff_dc   = (short *) stbi__malloc_mad2(z->s->alloc, nb, sizeof(short), 0);
+         z->img_comp[i].coeff_ac   = (signed char *) stbi__malloc_mad2(z->s->alloc, nb, 63, 0);
+         z->img_comp[i].coeff_wide = (int *) stbi__malloc_mad2(z->s->alloc, nb, sizeof(int), 0);
+         if (!z->img_comp[i].coeff_dc || !z->img_comp[i].coeff_ac || !z->img_comp[i].coeff_wide)
+            return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+         memset(z->img_comp[i].coeff_dc, 0, nb * sizeof(short));
+         memset(z->img_comp[i].coeff_ac, 0, (size_t) nb * 63);
+         memset(z->img_comp[i].coeff_wide, 0, nb * sizeof(int));
+         continue;
+      }
+      z->img_comp[i].raw_data = stbi__malloc_mad2(z->s->alloc, z->img_comp[i].w2, z->img_comp[i].h2, 15);
       if (z->img_comp[i].raw_data == NULL)
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->s->alloc, z->img_comp[i].coeff_w * 64, z->img_comp[i].coeff_h, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
       }
    }
+   if (!z->progressive)
+      stbi__jpeg_idct_alloc(z);
 
    return 1;
 }
@@ -3300,10 +5400,44 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
       }
    }
    z->progressive = stbi__SOF_progressive(m);
+   if (!z->progressive) z->compact = 0;
    if (!stbi__process_frame_header(z, scan)) return 0;
    return 1;
 }
 
+// begin row-at-a-time decoding of a baseline scan that has all the components
+static int stbi__jpeg_stream_start(stbi__jpeg *z)
+{
+   int k;
+   for (k=0; k < z->s->img_n; ++k) {
+      // one block row per component if non-interleaved, else one MCU row; keep two
+      int rows = (z->scan_n == 1 ? 1 : z->img_comp[k].v) * (8 >> z->scale_shift);
+      z->img_comp[k].h2 = 2 * rows;
+   }
+   z->stream_next = 0;
+   z->stream_end = stbi__jpeg_scan_rows(z);
+   stbi__jpeg_reset(z);
+   return 1;
+}
+
+// components coded in separate scans can't be streamed, so go back to whole-image buffers
+static int stbi__jpeg_stream_fallback(stbi__jpeg *z)
+{
+   int i;
+   z->stream = 0;
+   for (i=0; i < z->s->img_n; ++i) {
+      stbi__free(z->s->alloc, z->img_comp[i].raw_data);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale_shift);
+      z->img_comp[i].raw_data = stbi__malloc_mad2(z->s->alloc, z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      if (z->img_comp[i].raw_data == NULL)
+         return stbi__err("outofmem", "Out of memory");
+      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+   }
+   return 1;
+}
+
+static int stbi__jpeg_preview_dc(stbi__jpeg *z);
+
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
@@ -3311,14 +5445,56 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
+      j->img_comp[m].coeff_dc = NULL;
+      j->img_comp[m].coeff_ac = NULL;
+      j->img_comp[m].coeff_wide = NULL;
+      j->img_comp[m].wide = NULL;
+      j->img_comp[m].wide_n = j->img_comp[m].wide_cap = 0;
    }
    j->restart_interval = 0;
+   j->dc_seen = 0;
+   j->compact = j->compact && !j->stream; // set before the header is parsed
+   j->win_x0 = j->win_x1 = j->win_y0 = 0;
    if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+   if (j->region_w && !j->progressive && !j->scale_shift) {
+      // region_x, region_y >= 0; clip to the image, and keep one more MCU all
+      // around for the upsampling filters
+      int w = (int) j->s->img_x, h = (int) j->s->img_y;
+      int rx1 = j->region_w < w - j->region_x ? j->region_x + j->region_w : w;
+      if (j->region_x < rx1 && j->region_y < h) {
+         int x0 = j->region_x / j->img_mcu_w - 1;
+         int x1 = (rx1 + j->img_mcu_w-1) / j->img_mcu_w + 1;
+         int y0 = j->region_y / j->img_mcu_h - 1;
+         j->win_x0 = x0 > 0 ? x0 : 0;
+         j->win_x1 = x1 < j->img_mcu_x ? x1 : j->img_mcu_x;
+         j->win_y0 = y0 > 0 ? y0 : 0;
+      }
+   }
+   if (j->progressive) j->stream = 0;
    m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
+         int r = -1;
          if (!stbi__process_scan_header(j)) return 0;
-         if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (j->stream) {
+            // the entropy-coded data is decoded later by stbi__jpeg_stream_rows
+            if (j->scan_n == j->s->img_n) return stbi__jpeg_stream_start(j);
+            if (!stbi__jpeg_stream_fallback(j)) return 0;
+         }
+         if (j->parallel_for && !j->progressive && j->restart_interval && !j->s->read_from_callbacks)
+            STBI__PROFILED(STBI_PROFILE_ENTROPY, r = stbi__parse_entropy_coded_data_parallel(j));
+         if (r < 0)
+            STBI__PROFILED(STBI_PROFILE_ENTROPY, r = stbi__parse_entropy_coded_data(j));
+         if (!r) return 0;
+         if (j->progressive && j->spec_start == 0 && j->succ_high == 0) {
+            int k, all = (1 << j->s->img_n) - 1;
+            for (k=0; k < j->scan_n; ++k)
+               j->dc_seen |= 1 << j->order[k];
+            if (j->preview && j->dc_seen == all) {
+               if (!stbi__jpeg_preview_dc(j)) return 0;
+               j->preview = NULL;
+            }
+         }
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
             while (!stbi__at_eof(j->s)) {
@@ -3340,8 +5516,11 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
       }
       m = stbi__get_marker(j);
    }
-   if (j->progressive)
-      stbi__jpeg_finish(j);
+   if (j->progressive) {
+      int r;
+      STBI__PROFILED(STBI_PROFILE_IDCT, r = stbi__jpeg_finish(j));
+      return r;
+   }
    return 1;
 }
 
@@ -3576,7 +5755,7 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255; // with step 3 this would spill into the next pixel row
       out += step;
    }
 }
@@ -3710,16 +5889,96 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
 #endif
 
+#ifdef STBI_AVX2
+// 16 pixels per iteration; same math as the sse2 version, with pixels 0..7
+// in the low lane and 8..15 in the high lane
+STBI__AVX2_TARGET
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+   if (step == 4) {
+      __m256i signflip  = _mm256_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi8((char) (unsigned char) 128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // load, and spread each half of the 16 bytes into its own lane
+         __m256i y_bytes  = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (y+i))), 0x50);
+         __m256i cr_bytes = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (pcr+i))), 0x50);
+         __m256i cb_bytes = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (pcb+i))), 0x50);
+         __m256i cr_biased = _mm256_xor_si256(cr_bytes, signflip); // -128
+         __m256i cb_biased = _mm256_xor_si256(cb_bytes, signflip); // -128
+
+         // unpack to short (and left-shift cr, cb by 8)
+         __m256i yw  = _mm256_unpacklo_epi8(y_bias, y_bytes);
+         __m256i crw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cr_biased);
+         __m256i cbw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cb_biased);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0..3, 8..11
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4..7, 12..15
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+   }
+   // leftovers, and step == 3
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->parallel_for = NULL;
+   j->parallel_user = NULL;
+   j->scale_shift = 0;
+   j->stream = 0;
+   j->region_w = 0;
+   j->compact = 0;
+   j->preview = NULL;
+   j->preview_user = NULL;
+   j->preview_comp = 0;
+#ifdef STBI_PROFILE
+   j->idct_raw = NULL;
+#endif
+
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_block2_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
@@ -3731,6 +5990,13 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_block2_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3761,209 +6027,628 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+typedef struct
+{
+   stbi__resample res_comp[4];
+   int n, decode_n, is_rgb;
+   stbi__uint32 x0, w; // columns produced: all of them unless decoding a region
+} stbi__jpeg_output;
+
+// pick the output layout and set up the resamplers, once the image is decoded
+// (or, when streaming, once decoding has started)
+static int stbi__jpeg_output_begin(stbi__jpeg *z, stbi__jpeg_output *o, int req_comp)
+{
+   int k;
+
+   // determine actual number of components to generate
+   o->n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+
+   o->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+
+   if (z->s->img_n == 3 && o->n < 3 && !o->is_rgb)
+      o->decode_n = 1;
+   else
+      o->decode_n = z->s->img_n;
+
+   o->x0 = 0;
+   o->w = z->s->img_x;
+   if (z->win_x1) {
+      stbi__uint32 x1 = z->win_x1 * z->img_mcu_w;
+      o->x0 = z->win_x0 * z->img_mcu_w;
+      o->w = (x1 < z->s->img_x ? x1 : z->s->img_x) - o->x0;
+   }
+
+   for (k=0; k < o->decode_n; ++k) {
+      stbi__resample *r = &o->res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->alloc, z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (o->w + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data + o->x0 / r->hs; // x0 is a multiple of the MCU width
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+   return 1;
+}
+
+// color-convert one row from the resampled component rows
+static void stbi__jpeg_color_row(stbi__jpeg *z, stbi__jpeg_output *o, stbi_uc *out, stbi_uc **coutput)
+{
+   int n = o->n, is_rgb = o->is_rgb;
+   unsigned int i;
+   if (n >= 3) {
+      stbi_uc *y = coutput[0];
+      if (z->s->img_n == 3) {
+         if (is_rgb) {
+            for (i=0; i < o->w; ++i) {
+               out[0] = y[i];
+               out[1] = coutput[1][i];
+               out[2] = coutput[2][i];
+               if (n == 4) out[3] = 255;
+               out += n;
+            }
+         } else {
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], o->w, n);
+         }
+      } else if (z->s->img_n == 4) {
+         if (z->app14_color_transform == 0) { // CMYK
+            for (i=0; i < o->w; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(coutput[0][i], m);
+               out[1] = stbi__blinn_8x8(coutput[1][i], m);
+               out[2] = stbi__blinn_8x8(coutput[2][i], m);
+               if (n == 4) out[3] = 255;
+               out += n;
+            }
+         } else if (z->app14_color_transform == 2) { // YCCK
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], o->w, n);
+            for (i=0; i < o->w; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(255 - out[0], m);
+               out[1] = stbi__blinn_8x8(255 - out[1], m);
+               out[2] = stbi__blinn_8x8(255 - out[2], m);
+               out += n;
+            }
+         } else { // YCbCr + alpha?  Ignore the fourth channel for now
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], o->w, n);
+         }
+      } else
+         for (i=0; i < o->w; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            if (n == 4) out[3] = 255;
+            out += n;
+         }
+   } else {
+      if (is_rgb) {
+         if (n == 1)
+            for (i=0; i < o->w; ++i)
+               *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+         else {
+            for (i=0; i < o->w; ++i, out += 2) {
+               out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+               out[1] = 255;
+            }
+         }
+      } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+         for (i=0; i < o->w; ++i) {
+            stbi_uc m = coutput[3][i];
+            stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+            stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+            stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+            out[0] = stbi__compute_y(r, g, b);
+            if (n == 2) out[1] = 255; // n == 1 would write past the row
+            out += n;
+         }
+      } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+         for (i=0; i < o->w; ++i) {
+            out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            if (n == 2) out[1] = 255;
+            out += n;
+         }
+      } else {
+         stbi_uc *y = coutput[0];
+         if (n == 1)
+            for (i=0; i < o->w; ++i) out[i] = y[i];
+         else
+            for (i=0; i < o->w; ++i) { *out++ = y[i]; *out++ = 255; }
+      }
+   }
+}
+
+// resample and color-convert the next row of the image into out (or skip
+// the row if out is NULL)
+static void stbi__jpeg_output_row(stbi__jpeg *z, stbi__jpeg_output *o, stbi_uc *out)
+{
+   int k;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+
+   for (k=0; k < o->decode_n; ++k) {
+      stbi__resample *r = &o->res_comp[k];
+      int y_bot = r->ystep >= (r->vs >> 1);
+      if (out)
+         STBI__PROFILED(STBI_PROFILE_UPSAMPLE,
+                        coutput[k] = r->resample(z->img_comp[k].linebuf,
+                                                 y_bot ? r->line1 : r->line0,
+                                                 y_bot ? r->line0 : r->line1,
+                                                 r->w_lores, r->hs));
+      if (++r->ystep >= r->vs) {
+         r->ystep = 0;
+         r->line0 = r->line1;
+         if (++r->ypos < z->img_comp[k].y) {
+            r->line1 += z->img_comp[k].w2;
+            if (r->line1 >= z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+               r->line1 -= z->img_comp[k].w2 * z->img_comp[k].h2; // streaming wraps around the row ring
+         }
+      }
+   }
+   if (!out) return; // row not wanted, just step past it
+   STBI__PROFILED(STBI_PROFILE_COLOR, stbi__jpeg_color_row(z, o, out, coutput));
+}
+
+// a 1/8-scale image from the DC coefficients alone: the same pixels a
+// scale_denom 8 decode produces once the DC scans are complete. The output
+// code runs on a copy of the decoder that sees one pixel per block
+static int stbi__jpeg_preview_dc(stbi__jpeg *z)
+{
+   stbi__context s = *z->s;
+   stbi__jpeg *p = (stbi__jpeg *) stbi__malloc(s.alloc, sizeof(stbi__jpeg));
+   stbi__jpeg_output o;
+   stbi_uc *plane[4] = { NULL, NULL, NULL, NULL }, *out = NULL;
+   int k, b, ok = 0;
+   if (!p) return stbi__err("outofmem", "Out of memory");
+   *p = *z;
+   p->s = &s;
+   s.img_x = (s.img_x + 7) >> 3;
+   s.img_y = (s.img_y + 7) >> 3;
+   for (k=0; k < s.img_n; ++k) {
+      int nb = z->img_comp[k].coeff_w * z->img_comp[k].coeff_h;
+      int q = z->dequant[z->img_comp[k].tq][0];
+      p->img_comp[k].x = (z->img_comp[k].x + 7) >> 3;
+      p->img_comp[k].y = (z->img_comp[k].y + 7) >> 3;
+      p->img_comp[k].w2 = z->img_comp[k].coeff_w;
+      p->img_comp[k].h2 = z->img_comp[k].coeff_h;
+      p->img_comp[k].linebuf = NULL;
+      plane[k] = (stbi_uc *) stbi__malloc(s.alloc, nb);
+      if (!plane[k]) break;
+      for (b=0; b < nb; ++b) {
+         int dc = z->compact ? z->img_comp[k].coeff_dc[b] : z->img_comp[k].coeff[64*b];
+         plane[k][b] = stbi__clamp((dc * q + 4 + (128<<3)) >> 3);
+      }
+      p->img_comp[k].data = plane[k];
+   }
+   if (k == s.img_n && stbi__jpeg_output_begin(p, &o, z->preview_comp)) {
+      out = (stbi_uc *) stbi__malloc_mad3(s.alloc, o.n, s.img_x, s.img_y, 1);
+      if (out) {
+         unsigned int j;
+         for (j=0; j < s.img_y; ++j)
+            stbi__jpeg_output_row(p, &o, out + o.n * s.img_x * (s.flip ? s.img_y-1-j : j));
+         z->preview(z->preview_user, out, s.img_x, s.img_y, o.n);
+         ok = 1;
+      }
+   }
+   for (k=0; k < s.img_n; ++k) {
+      stbi__free(s.alloc, plane[k]);
+      stbi__free(s.alloc, p->img_comp[k].linebuf);
+   }
+   stbi__free(s.alloc, out);
+   stbi__free(s.alloc, p);
+   return ok ? 1 : stbi__err("outofmem", "Out of memory");
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   stbi__jpeg_output o;
+   stbi_uc *output;
+   unsigned int j;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   if (z->scale_shift) {
+      // the idct produced reduced-size blocks, so from here on we're
+      // working with the downscaled image, rounding partial pixels up
+      int k, round = (1 << z->scale_shift) - 1;
+      z->s->img_x = (z->s->img_x + round) >> z->scale_shift;
+      z->s->img_y = (z->s->img_y + round) >> z->scale_shift;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->img_comp[k].x + round) >> z->scale_shift;
+         z->img_comp[k].y = (z->img_comp[k].y + round) >> z->scale_shift;
+      }
+   }
+
+   if (!stbi__jpeg_output_begin(z, &o, req_comp)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   // can't error after this so, this is safe
+   output = (stbi_uc *) stbi__malloc_mad3(z->s->alloc, o.n, z->s->img_x, z->s->img_y, 1);
+   if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+
+   // now go ahead and resample, bottom-up if asked to
+   for (j=0; j < z->s->img_y; ++j)
+      stbi__jpeg_output_row(z, &o, output + o.n * z->s->img_x * (z->s->flip ? z->s->img_y-1-j : j));
+
+   stbi__cleanup_jpeg(z);
+   *out_x = z->s->img_x;
+   *out_y = z->s->img_y;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return output;
+}
+
+static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   unsigned char* result;
+   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(s->alloc, sizeof(stbi__jpeg));
+   j->s = s;
+   stbi__setup_jpeg(j);
+   result = load_jpeg_image(j, x,y,comp,req_comp);
+   stbi__free(s->alloc, j);
+   ri->flipped = s->flip;
+   return result;
+}
+
+static int stbi__jpeg_test(stbi__context *s)
+{
+   int r;
+   stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(s->alloc, sizeof(stbi__jpeg));
+   j->s = s;
+   stbi__setup_jpeg(j);
+   r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
+   stbi__rewind(s);
+   stbi__free(s->alloc, j);
+   return r;
+}
+
+static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
+{
+   if (!stbi__decode_jpeg_header(j, STBI__SCAN_header)) {
+      stbi__rewind( j->s );
+      return 0;
+   }
+   if (x) *x = j->s->img_x;
+   if (y) *y = j->s->img_y;
+   if (comp) *comp = j->s->img_n >= 3 ? 3 : 1;
+   return 1;
+}
+
+static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
+{
+   int result;
+   stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(s->alloc, sizeof(stbi__jpeg)));
+   j->s = s;
+   result = stbi__jpeg_info_raw(j, x, y, comp);
+   stbi__free(s->alloc, j);
+   return result;
+}
+
+// the jpeg-specific entry points below set options on a stbi__jpeg and then
+// finish up the same way stbi_load does
+static stbi__jpeg *stbi__jpeg_alloc(stbi__context *s)
+{
+   stbi__jpeg *j = (stbi__jpeg *) stbi__malloc(s->alloc, sizeof(stbi__jpeg));
+   if (!j) return stbi__errp(stbi__jpeg, "outofmem", "Out of memory");
+   j->s = s;
+   stbi__setup_jpeg(j);
+   return j;
+}
+
+static stbi_uc *stbi__jpeg_load_and_postprocess(stbi__jpeg *j, int *x, int *y, int *comp, int req_comp)
+{
+   int n;
+   stbi_uc *result;
+   j->s->flip = stbi__vertically_flip_on_load;
+   result = load_jpeg_image(j, x,y,&n,req_comp);
+   stbi__free(j->s->alloc, j);
+   if (result == NULL)
+      return NULL;
+   if (comp) *comp = n;
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_parallel_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_parallel_for *parallel_for, void *user)
+{
+   stbi__context s;
+   stbi__jpeg *j;
+   stbi__start_mem(&s,buffer,len);
+   if (!parallel_for || !stbi__jpeg_test(&s))
+      return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+
+   j = stbi__jpeg_alloc(&s);
+   if (!j) return NULL;
+   j->parallel_for = parallel_for;
+   j->parallel_user = user;
+   return stbi__jpeg_load_and_postprocess(j, x,y,comp,req_comp);
+}
+
+static stbi_uc *stbi__load_jpeg_scaled(stbi__context *s, int *x, int *y, int *comp, int req_comp, int scale_denom)
+{
+   stbi__jpeg *j;
+   int shift;
+   switch (scale_denom) {
+      case 1: shift = 0; break;
+      case 2: shift = 1; break;
+      case 4: shift = 2; break;
+      case 8: shift = 3; break;
+      default: return stbi__errpuc("bad scale", "JPEG scale must be 1, 2, 4 or 8");
+   }
+   if (!stbi__jpeg_test(s))
+      return stbi__load_and_postprocess_8bit(s,x,y,comp,req_comp);
+
+   j = stbi__jpeg_alloc(s);
+   if (!j) return NULL;
+   if (shift) {
+      static void (* const idct[4])(stbi_uc *out, int out_stride, short data[64]) = {
+         NULL, stbi__idct_block_4x4, stbi__idct_block_2x2, stbi__idct_block_1x1
+      };
+      j->scale_shift = shift;
+      j->idct_block_kernel = idct[shift];
+      j->idct_block2_kernel = NULL;
+   }
+   return stbi__jpeg_load_and_postprocess(j, x,y,comp,req_comp);
+}
+
+static stbi_uc *stbi__load_jpeg_progressive(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_jpeg_preview *preview, void *preview_user)
+{
+   stbi__jpeg *j;
+   if (!stbi__jpeg_test(s))
+      return stbi__load_and_postprocess_8bit(s,x,y,comp,req_comp);
+
+   j = stbi__jpeg_alloc(s);
+   if (!j) return NULL;
+   j->compact = 1;
+   j->preview = preview;
+   j->preview_user = preview_user;
+   j->preview_comp = req_comp;
+   return stbi__jpeg_load_and_postprocess(j, x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_progressive_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_jpeg_preview *preview, void *preview_user)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_jpeg_progressive(&s,x,y,comp,req_comp,preview,preview_user);
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_progressive_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_jpeg_preview *preview, void *preview_user)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_jpeg_progressive(&s,x,y,comp,req_comp,preview,preview_user);
+}
+
+static stbi_uc *stbi__load_jpeg_yuv(stbi__context *s, int *x, int *y, stbi_jpeg_yuv *yuv)
+{
+   stbi__jpeg *j;
+   stbi_uc *result = NULL, *p;
+   size_t total = 0;
+   int k, row;
+   if (!stbi__jpeg_test(s)) return stbi__errpuc("not JPEG", "Corrupt JPEG");
+
+   j = stbi__jpeg_alloc(s);
+   if (!j) return NULL;
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+   if (stbi__decode_jpeg_image(j)) {
+      for (k=0; k < s->img_n; ++k)
+         total += (size_t) j->img_comp[k].x * j->img_comp[k].y;
+      result = (stbi_uc *) stbi__malloc(s->alloc, total);
+      if (!result) {
+         stbi__cleanup_jpeg(j);
+         stbi__free(s->alloc, j);
+         return stbi__errpuc("outofmem", "Out of memory");
+      }
+   }
+   if (result) {
+      memset(yuv, 0, sizeof(*yuv));
+      yuv->n = s->img_n;
+      yuv->ycbcr = !(s->img_n == 3 && (j->rgb == 3 || (j->app14_color_transform == 0 && !j->jfif)))
+                && !(s->img_n == 4 && j->app14_color_transform == 0);
+      // copy each component out of its MCU-padded buffer as is
+      for (k=0, p=result; k < s->img_n; ++k) {
+         int w = j->img_comp[k].x, h = j->img_comp[k].y;
+         yuv->plane[k] = p;
+         yuv->w[k] = w;
+         yuv->h[k] = h;
+         for (row=0; row < h; ++row, p += w)
+            memcpy(p, j->img_comp[k].data + (size_t) j->img_comp[k].w2 * row, w);
+         if (stbi__vertically_flip_on_load)
+            stbi__vertical_flip(yuv->plane[k], w, h, 1);
+      }
+      *x = s->img_x;
+      *y = s->img_y;
+   }
+   stbi__cleanup_jpeg(j);
+   stbi__free(s->alloc, j);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_yuv_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_jpeg_yuv *yuv)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_jpeg_yuv(&s,x,y,yuv);
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_yuv_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, stbi_jpeg_yuv *yuv)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_jpeg_yuv(&s,x,y,yuv);
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_scaled_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale_denom)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_jpeg_scaled(&s,x,y,comp,req_comp,scale_denom);
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_scaled_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int scale_denom)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_jpeg_scaled(&s,x,y,comp,req_comp,scale_denom);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_parallel(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_parallel_for *parallel_for, void *user)
+{
+   FILE *f;
+   stbi_uc *buffer, *result;
+   long len;
+#ifdef STBI__MMAP
+   int map_len;
+   stbi_uc *map = stbi__mmap_file(filename, &map_len);
+   if (map) {
+      result = stbi_load_jpeg_parallel_from_memory(map, map_len, x, y, comp, req_comp, parallel_for, user);
+      stbi__munmap_file(map, map_len);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   // restart markers are found by scanning the entropy-coded data up front,
+   // so the whole file has to be in memory
+   fseek(f, 0, SEEK_END);
+   len = ftell(f);
+   fseek(f, 0, SEEK_SET);
+   if (len <= 0 || len > INT_MAX) {
+      fclose(f);
+      return stbi__errpuc("bad file size", "Unable to read file");
+   }
+   buffer = (stbi_uc *) stbi__malloc(NULL, (size_t) len);
+   if (!buffer) {
+      fclose(f);
+      return stbi__errpuc("outofmem", "Out of memory");
+   }
+   if (fread(buffer, 1, (size_t) len, f) != (size_t) len) {
+      fclose(f);
+      stbi__free(NULL, buffer);
+      return stbi__errpuc("bad file size", "Unable to read file");
+   }
+   fclose(f);
+   result = stbi_load_jpeg_parallel_from_memory(buffer, (int) len, x, y, comp, req_comp, parallel_for, user);
+   stbi__free(NULL, buffer);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale_denom)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   stbi_uc *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_jpeg_scaled(&s,x,y,comp,req_comp,scale_denom);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_progressive(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_jpeg_preview *preview, void *preview_user)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   stbi_uc *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_jpeg_progressive(&s,x,y,comp,req_comp,preview,preview_user);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_jpeg_yuv(char const *filename, int *x, int *y, stbi_jpeg_yuv *yuv)
 {
-   int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
-
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
-
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   stbi_uc *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_jpeg_yuv(&s,x,y,yuv);
+   fclose(f);
+   return result;
+}
+#endif
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+// row-at-a-time decoding for stbi_stream
 
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__jpeg_output o;
+   stbi_uc *row; // 3-channel conversion writes one byte past the row, so it goes here first
+} stbi__jpeg_stream;
 
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
+// decode MCU rows until the next output row's source rows are in the ring
+static int stbi__jpeg_stream_rows(stbi__jpeg *z, stbi__jpeg_output *o)
+{
+   int k;
+   for (k=0; k < o->decode_n; ++k) {
+      int rows = (z->scan_n == 1 ? 1 : z->img_comp[k].v) * (8 >> z->scale_shift);
+      int need = o->res_comp[k].ypos < z->img_comp[k].y ? o->res_comp[k].ypos : z->img_comp[k].y-1;
+      while (z->stream_next <= need / rows && z->stream_next < z->stream_end) {
+         int r;
+         STBI__PROFILED(STBI_PROFILE_ENTROPY, r = stbi__jpeg_decode_row(z, z->stream_next & 1));
+         stbi__jpeg_idct_flush(z);
+         if (!r) return 0;
+         ++z->stream_next;
+         if (r == 2) z->stream_end = z->stream_next; // scan ended early, keep what we have
       }
-      stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
    }
+   return 1;
 }
 
-static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
-{
-   unsigned char* result;
-   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
-   j->s = s;
-   stbi__setup_jpeg(j);
-   result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
-   return result;
-}
-
-static int stbi__jpeg_test(stbi__context *s)
-{
-   int r;
-   stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
-   j->s = s;
-   stbi__setup_jpeg(j);
-   r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
-   stbi__rewind(s);
-   STBI_FREE(j);
-   return r;
+// region is x,y,w,h, or w == 0 for the whole image
+static int stbi__jpeg_stream_begin(stbi__jpeg_stream *js, stbi__context *s, int req_comp, int const *region)
+{
+   js->row = NULL;
+   js->z = stbi__jpeg_alloc(s);
+   if (!js->z) return 0;
+   js->z->stream = 1;
+   js->z->region_x = region[0];
+   js->z->region_y = region[1];
+   js->z->region_w = region[2];
+   js->z->region_h = region[3];
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+   if (!stbi__decode_jpeg_image(js->z)) return 0;
+   if (!stbi__jpeg_output_begin(js->z, &js->o, req_comp)) return 0;
+   if (js->o.n == 3) {
+      js->row = (stbi_uc *) stbi__malloc_mad2(s->alloc, s->img_x, 3, 1);
+      if (!js->row) return stbi__err("outofmem", "Out of memory");
+   }
+   return 1;
 }
 
-static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
+static int stbi__jpeg_stream_row(stbi__jpeg_stream *js, stbi_uc *out)
 {
-   if (!stbi__decode_jpeg_header(j, STBI__SCAN_header)) {
-      stbi__rewind( j->s );
-      return 0;
-   }
-   if (x) *x = j->s->img_x;
-   if (y) *y = j->s->img_y;
-   if (comp) *comp = j->s->img_n >= 3 ? 3 : 1;
+   if (js->z->stream && !stbi__jpeg_stream_rows(js->z, &js->o)) return 0;
+   if (js->row && out) {
+      stbi__jpeg_output_row(js->z, &js->o, js->row);
+      memcpy(out, js->row, js->o.w * 3);
+   } else
+      stbi__jpeg_output_row(js->z, &js->o, out);
    return 1;
 }
 
-static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
+static void stbi__jpeg_stream_end(stbi__jpeg_stream *js)
 {
-   int result;
-   stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
-   j->s = s;
-   result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
-   return result;
+   if (js->z) {
+      stbi_allocator const *a = js->z->s->alloc;
+      stbi__cleanup_jpeg(js->z);
+      stbi__free(a, js->row); // only allocated after js->z
+      stbi__free(a, js->z);
+   }
 }
 #endif
 
@@ -4056,6 +6741,63 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
    return 1;
 }
 
+// second-level fast tables for the literal/length and distance codes:
+// an entry resolves a whole symbol including its extra bits when they fit,
+// so most lengths and distances take one lookup. 0 means use the slow path
+#define STBI__ZFAST2_BITS  10
+#define STBI__ZFAST2_MASK  ((1 << STBI__ZFAST2_BITS) - 1)
+
+#define STBI__ZF_LITERAL   (1u << 24)  // value is the byte
+#define STBI__ZF_COPY      (2u << 24)  // value is a length or distance, plus extra bits still to read
+#define STBI__ZF_END       (3u << 24)  // end of block
+#define STBI__ZF_KIND(e)   ((e) & (3u << 24))
+#define STBI__ZF_BITS(e)   (((e) >> 16) & 15)
+#define STBI__ZF_EXTRA(e)  (((e) >> 20) & 15)
+
+static void stbi__zbuild_fast(stbi__uint32 *fast, const stbi_uc *sizelist, int num, const int *base, const int *extra, int literals)
+{
+   // same canonical codes as stbi__zbuild_huffman, which has already checked them
+   int i, code, next_code[16], sizes[16];
+   memset(sizes, 0, sizeof(sizes));
+   memset(fast, 0, sizeof(*fast) << STBI__ZFAST2_BITS);
+   for (i=0; i < num; ++i)
+      ++sizes[sizelist[i]];
+   sizes[0] = 0;
+   code = 0;
+   for (i=1; i < 16; ++i) {
+      next_code[i] = code;
+      code = (code + sizes[i]) << 1;
+   }
+   for (i=0; i < num; ++i) {
+      int s = sizelist[i], j, e, x, sym;
+      stbi__uint32 entry;
+      if (!s) continue;
+      j = stbi__bit_reverse(next_code[s]++, s);
+      if (s > STBI__ZFAST2_BITS) continue;
+      if (i < literals) {
+         entry = STBI__ZF_LITERAL | (s << 16) | i;
+      } else if (literals && i == 256) {
+         entry = STBI__ZF_END | (s << 16);
+      } else {
+         sym = literals ? i - 257 : i;
+         x = extra[sym];
+         if (s + x <= STBI__ZFAST2_BITS) {
+            // fold every value of the extra bits into the table
+            for (e=0; e < (1 << x); ++e) {
+               int k;
+               entry = STBI__ZF_COPY | ((s + x) << 16) | (base[sym] + e);
+               for (k = j | (e << s); k < (1 << STBI__ZFAST2_BITS); k += 1 << (s + x))
+                  fast[k] = entry;
+            }
+            continue;
+         }
+         entry = STBI__ZF_COPY | (x << 20) | (s << 16) | base[sym];
+      }
+      for (; j < (1 << STBI__ZFAST2_BITS); j += 1 << s)
+         fast[j] = entry;
+   }
+}
+
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
@@ -4066,19 +6808,37 @@ typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   stbi__uint64 code_buffer; // up to 32 bits from stbi__fill_bits, 63 from stbi__fill_bits_fast
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   stbi_allocator const *alloc; // for growing zout when z_expandable
 
    stbi__zhuffman z_length, z_distance;
+   stbi__uint32 zfast_length[1 << STBI__ZFAST2_BITS], zfast_distance[1 << STBI__ZFAST2_BITS];
+
+   // incremental decoding: zrefill supplies more input when zbuffer runs out,
+   // and with z_window set, decoding pauses once the output passes zout_end
+   // (the buffer must have 258 bytes of slack past it) rather than growing it
+   int (*zrefill)(void *user, stbi_uc **start, stbi_uc **end);
+   void *zrefill_user;
+   int   z_window;
+   int   zstate, zfinal, zstored; // where to resume: between blocks, in a huffman block, in a stored block
 } stbi__zbuf;
 
+enum
+{
+   STBI__ZSTATE_header,
+   STBI__ZSTATE_huffman,
+   STBI__ZSTATE_stored
+};
+
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
 {
-   return (z->zbuffer >= z->zbuffer_end);
+   if (z->zbuffer < z->zbuffer_end) return 0;
+   return !z->zrefill || !z->zrefill(z->zrefill_user, &z->zbuffer, &z->zbuffer_end);
 }
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -4091,6 +6851,7 @@ static void stbi__fill_bits(stbi__zbuf *z)
    do {
       if (z->code_buffer >= (1U << z->num_bits)) {
         z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
+        z->zrefill = NULL;
         return;
       }
       z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
@@ -4098,11 +6859,26 @@ static void stbi__fill_bits(stbi__zbuf *z)
    } while (z->num_bits <= 24);
 }
 
+// with at least 8 bytes of input left, top up the bit buffer to 56+ bits in
+// one go; only whole bytes go in, so the bits above num_bits stay zero
+stbi_inline static void stbi__fill_bits_fast(stbi__zbuf *z)
+{
+   stbi_uc *p = z->zbuffer;
+   int n = (63 - z->num_bits) >> 3;
+   stbi__uint64 v = (stbi__uint64) p[0]       | ((stbi__uint64) p[1] <<  8) |
+                   ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+                   ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) |
+                   ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+   z->code_buffer |= (v & (((stbi__uint64) 1 << (n*8)) - 1)) << z->num_bits;
+   z->zbuffer += n;
+   z->num_bits += n*8;
+}
+
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -4113,7 +6889,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4159,7 +6935,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->alloc, z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -4182,14 +6958,84 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// lengths and distances from the fast tables; room for the longest match
+// plus the 8-byte copies running over is checked before each symbol
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (!a->zrefill && a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - zout >= 258+8) {
+         stbi__uint32 e;
+         stbi__fill_bits_fast(a); // enough for a length and a distance with their extra bits
+         e = a->zfast_length[a->code_buffer & STBI__ZFAST2_MASK];
+         if (e) {
+            char *p;
+            int len, dist, x;
+            a->code_buffer >>= STBI__ZF_BITS(e);
+            a->num_bits -= STBI__ZF_BITS(e);
+            if (STBI__ZF_KIND(e) == STBI__ZF_LITERAL) {
+               *zout++ = (char) e;
+               continue;
+            }
+            if (STBI__ZF_KIND(e) == STBI__ZF_END) {
+               a->zout = zout;
+               a->zstate = STBI__ZSTATE_header;
+               return 1;
+            }
+            len = e & 0xffff;
+            if ((x = STBI__ZF_EXTRA(e)) != 0) {
+               len += (int) (a->code_buffer & ((1 << x) - 1));
+               a->code_buffer >>= x;
+               a->num_bits -= x;
+            }
+            e = a->zfast_distance[a->code_buffer & STBI__ZFAST2_MASK];
+            if (e) {
+               a->code_buffer >>= STBI__ZF_BITS(e);
+               a->num_bits -= STBI__ZF_BITS(e);
+               dist = e & 0xffff;
+               x = STBI__ZF_EXTRA(e);
+            } else {
+               z = stbi__zhuffman_decode(a, &a->z_distance);
+               if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+               dist = stbi__zdist_base[z];
+               x = stbi__zdist_extra[z];
+            }
+            if (x) {
+               dist += (int) (a->code_buffer & ((1 << x) - 1));
+               a->code_buffer >>= x;
+               a->num_bits -= x;
+            }
+            if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+            p = zout - dist;
+            if (dist >= 8) {
+               // 8 bytes at a time; a copy can't overlap itself, and may run past the end
+               char *end = zout + len;
+               do {
+                  memcpy(zout, p, 8);
+                  zout += 8;
+                  p += 8;
+               } while (zout < end);
+               zout = end;
+            } else if (dist == 1) {
+               memset(zout, *p, len);
+               zout += len;
+            } else if (len) {
+               do *zout++ = *p++; while (--len);
+            }
+            continue;
+         }
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
+            if (a->z_window) {
+               // window is full; the byte goes in the slack and the caller drains it
+               *zout++ = (char) z;
+               a->zout = zout;
+               return 2;
+            }
             if (!stbi__zexpand(a, zout, 1)) return 0;
             zout = a->zout;
          }
@@ -4199,6 +7045,7 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          int len,dist;
          if (z == 256) {
             a->zout = zout;
+            a->zstate = STBI__ZSTATE_header;
             return 1;
          }
          z -= 257;
@@ -4210,6 +7057,13 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
          if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
          if (zout + len > a->zout_end) {
+            if (a->z_window) {
+               // same for a match, which is at most 258 bytes
+               p = (stbi_uc *) (zout - dist);
+               do *zout++ = *p++; while (--len);
+               a->zout = zout;
+               return 2;
+            }
             if (!stbi__zexpand(a, zout, len)) return 0;
             zout = a->zout;
          }
@@ -4271,6 +7125,8 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
    if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
    if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   stbi__zbuild_fast(a->zfast_length  , lencodes     , hlit , stbi__zlength_base, stbi__zlength_extra, 256);
+   stbi__zbuild_fast(a->zfast_distance, lencodes+hlit, hdist, stbi__zdist_base  , stbi__zdist_extra  ,   0);
    return 1;
 }
 
@@ -4282,24 +7138,51 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
       stbi__zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
    if (a->num_bits < 0) return stbi__err("zlib corrupt","Corrupt PNG");
+   if (a->num_bits > 0) {
+      // stbi__fill_bits_fast read ahead, always from the current buffer; put it back
+      a->zbuffer -= a->num_bits >> 3;
+      a->num_bits = 0;
+      a->code_buffer = 0;
+   }
    // now fill header the normal way
    while (k < 4)
       header[k++] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
-      if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   a->zstored = len;
+   a->zstate = STBI__ZSTATE_stored;
+   return 1;
+}
+
+static int stbi__parse_uncompressed_data(stbi__zbuf *a)
+{
+   while (a->zstored) {
+      int len = a->zstored;
+      if (stbi__zeof(a)) return stbi__err("read past buffer","Corrupt PNG");
+      if (a->zbuffer + len > a->zbuffer_end) {
+         if (!a->zrefill) return stbi__err("read past buffer","Corrupt PNG");
+         len = (int) (a->zbuffer_end - a->zbuffer);
+      }
+      if (a->zout + len > a->zout_end) {
+         if (a->z_window) {
+            len = (int) (a->zout_end - a->zout);
+            if (len <= 0) return 2;
+         } else if (!stbi__zexpand(a, a->zout, len))
+            return 0;
+      }
+      memcpy(a->zout, a->zbuffer, len);
+      a->zbuffer += len;
+      a->zout += len;
+      a->zstored -= len;
+   }
+   a->zstate = STBI__ZSTATE_header;
    return 1;
 }
 
@@ -4346,15 +7229,19 @@ Init algorithm:
 }
 */
 
-static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+// decode blocks until the end of the stream; returns 2 if a windowed decode
+// filled its window, in which case call again once the output is drained
+static int stbi__zinflate(stbi__zbuf *a)
 {
-   int final, type;
-   if (parse_header)
-      if (!stbi__parse_zlib_header(a)) return 0;
-   a->num_bits = 0;
-   a->code_buffer = 0;
-   do {
-      final = stbi__zreceive(a,1);
+   int r, type;
+   for(;;) {
+      if (a->zstate == STBI__ZSTATE_huffman) {
+         if ((r = stbi__parse_huffman_block(a)) != 1) return r;
+      } else if (a->zstate == STBI__ZSTATE_stored) {
+         if ((r = stbi__parse_uncompressed_data(a)) != 1) return r;
+      }
+      if (a->zfinal) return 1;
+      a->zfinal = stbi__zreceive(a,1);
       type = stbi__zreceive(a,2);
       if (type == 0) {
          if (!stbi__parse_uncompressed_block(a)) return 0;
@@ -4365,13 +7252,27 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
             // use fixed code lengths
             if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , 288)) return 0;
             if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+            stbi__zbuild_fast(a->zfast_length  , stbi__zdefault_length  , 288, stbi__zlength_base, stbi__zlength_extra, 256);
+            stbi__zbuild_fast(a->zfast_distance, stbi__zdefault_distance,  32, stbi__zdist_base  , stbi__zdist_extra  ,   0);
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
-         if (!stbi__parse_huffman_block(a)) return 0;
+         a->zstate = STBI__ZSTATE_huffman;
       }
-   } while (!final);
-   return 1;
+   }
+}
+
+static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+{
+   int r;
+   if (parse_header)
+      if (!stbi__parse_zlib_header(a)) return 0;
+   a->num_bits = 0;
+   a->code_buffer = 0;
+   a->zstate = STBI__ZSTATE_header;
+   a->zfinal = 0;
+   STBI__PROFILED(STBI_PROFILE_INFLATE, r = stbi__zinflate(a));
+   return r;
 }
 
 static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
@@ -4380,26 +7281,34 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zrefill = NULL;
+   a->z_window = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
 
-STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
+static char *stbi__zlib_decode_malloc(stbi_allocator const *al, const char *buffer, int len, int initial_size, int *outlen, int parse_header)
 {
    stbi__zbuf a;
-   char *p = (char *) stbi__malloc(initial_size);
+   char *p = (char *) stbi__malloc(al, initial_size);
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
-   if (stbi__do_zlib(&a, p, initial_size, 1, 1)) {
+   a.alloc = al;
+   if (stbi__do_zlib(&a, p, initial_size, 1, parse_header)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(al, a.zout_start);
       return NULL;
    }
 }
 
+STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
+{
+   return stbi__zlib_decode_malloc(NULL, buffer, len, initial_size, outlen, 1);
+}
+
 STBIDEF char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
 {
    return stbi_zlib_decode_malloc_guesssize(buffer, len, 16384, outlen);
@@ -4407,18 +7316,7 @@ STBIDEF char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
 {
-   stbi__zbuf a;
-   char *p = (char *) stbi__malloc(initial_size);
-   if (p == NULL) return NULL;
-   a.zbuffer = (stbi_uc *) buffer;
-   a.zbuffer_end = (stbi_uc *) buffer + len;
-   if (stbi__do_zlib(&a, p, initial_size, 1, parse_header)) {
-      if (outlen) *outlen = (int) (a.zout - a.zout_start);
-      return a.zout_start;
-   } else {
-      STBI_FREE(a.zout_start);
-      return NULL;
-   }
+   return stbi__zlib_decode_malloc(NULL, buffer, len, initial_size, outlen, parse_header);
 }
 
 STBIDEF int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen)
@@ -4434,18 +7332,7 @@ STBIDEF int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer
 
 STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int *outlen)
 {
-   stbi__zbuf a;
-   char *p = (char *) stbi__malloc(16384);
-   if (p == NULL) return NULL;
-   a.zbuffer = (stbi_uc *) buffer;
-   a.zbuffer_end = (stbi_uc *) buffer+len;
-   if (stbi__do_zlib(&a, p, 16384, 1, 0)) {
-      if (outlen) *outlen = (int) (a.zout - a.zout_start);
-      return a.zout_start;
-   } else {
-      STBI_FREE(a.zout_start);
-      return NULL;
-   }
+   return stbi__zlib_decode_malloc(NULL, buffer, len, 16384, outlen, 0);
 }
 
 STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffer, int ilen)
@@ -4499,6 +7386,21 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+
+   // chunk state gathered by stbi__parse_png_file
+   stbi_uc palette[1024], pal_img_n;
+   stbi_uc has_trans, tc[3];
+   stbi__uint16 tc16[3];
+   stbi__uint32 pal_len;
+   int color, interlace, is_iphone;
+
+   // row-at-a-time decoding: stop at the first IDAT of a non-interlaced image
+   int stream;
+   stbi__uint32 idat_left;
+
+   // pipelined decoding: unfilter each stretch of rows while inflating the next
+   stbi_parallel_for *parallel_for;
+   void *parallel_user;
 } stbi__png;
 
 
@@ -4513,44 +7415,368 @@ enum {
    STBI__F_paeth_first
 };
 
-static stbi_uc first_row_filter[5] =
+static stbi_uc first_row_filter[5] =
+{
+   STBI__F_none,
+   STBI__F_sub,
+   STBI__F_none,
+   STBI__F_avg_first,
+   STBI__F_paeth_first
+};
+
+static int stbi__paeth(int a, int b, int c)
+{
+   int p = a + b - c;
+   int pa = abs(p-a);
+   int pb = abs(p-b);
+   int pc = abs(p-c);
+   if (pa <= pb && pa <= pc) return a;
+   if (pb <= pc) return b;
+   return c;
+}
+
+static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
+
+// undo the filter on one scanline of nk bytes; prior is the previous unfiltered
+// scanline, and isn't read for the first row's synthetic filters
+#if defined(STBI_SSE2) || defined(STBI__NEON_EXTRA)
+// SIMD unfiltering of 3/4-byte (8-bit RGB/RGBA) and 6/8-byte (16-bit RGB/RGBA)
+// pixels; Up works on any row. Sub is a prefix sum within each register, while
+// Avg and Paeth depend on the finished pixel to the left so they go a pixel at
+// a time, just without branches. Pixels are loaded and stored 4 or 8 bytes at
+// a time, so the last one or two are left to the scalar loops. Returns the
+// number of bytes done, which is 0 or a multiple of bpp.
+#ifdef STBI_SSE2
+static __m128i stbi__png_load4(stbi_uc const *p)
+{
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+static void stbi__png_store4(stbi_uc *p, __m128i x)
+{
+   int v = _mm_cvtsi128_si32(x);
+   memcpy(p, &v, 4);
+}
+
+static int stbi__png_unfilter_simd(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int filter, int nk, int bpp)
+{
+   __m128i zero = _mm_setzero_si128();
+   int k = 0;
+   if (filter == STBI__F_up) {
+      for (; k+16 <= nk; k += 16)
+         _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(_mm_loadu_si128((__m128i *) (raw+k)), _mm_loadu_si128((__m128i *) (prior+k))));
+      return k;
+   }
+   if (bpp != 3 && bpp != 4 && bpp != 6 && bpp != 8) return 0;
+   switch (filter) {
+      case STBI__F_sub: {
+         // 4 pixels (12 or 16 bytes) or 2 pixels (12 or 16 bytes) per step
+         __m128i carry = zero, v, t;
+         int step = (bpp == 3 || bpp == 6) ? 12 : 16;
+         for (; k+16 <= nk; k += step) {
+            v = _mm_loadu_si128((__m128i *) (raw+k));
+            switch (bpp) {
+               case 3:
+                  v = _mm_add_epi8(v, _mm_slli_si128(v, 3));
+                  v = _mm_add_epi8(v, _mm_slli_si128(v, 6));
+                  v = _mm_add_epi8(v, carry);
+                  t = _mm_srli_si128(_mm_slli_si128(v, 4), 13); // pixel 3, alone
+                  t = _mm_or_si128(t, _mm_slli_si128(t, 3));
+                  carry = _mm_or_si128(t, _mm_slli_si128(t, 6));
+                  break;
+               case 4:
+                  v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+                  v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+                  v = _mm_add_epi8(v, carry);
+                  carry = _mm_shuffle_epi32(v, 0xff);
+                  break;
+               case 6:
+                  v = _mm_add_epi8(v, _mm_slli_si128(v, 6));
+                  v = _mm_add_epi8(v, carry);
+                  t = _mm_srli_si128(_mm_slli_si128(v, 4), 10); // pixel 1, alone
+                  carry = _mm_or_si128(t, _mm_slli_si128(t, 6));
+                  break;
+               default:
+                  v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+                  v = _mm_add_epi8(v, carry);
+                  carry = _mm_unpackhi_epi64(v, v);
+                  break;
+            }
+            // for 3 and 6, the top 4 bytes are junk that the next step overwrites
+            _mm_storeu_si128((__m128i *) (cur+k), v);
+         }
+         break;
+      }
+      case STBI__F_avg: {
+         // _mm_avg_epu8 rounds up; PNG's average rounds down
+         __m128i a = zero, b, one = _mm_set1_epi8(1), avg;
+         if (bpp <= 4) {
+            for (; k+4 <= nk; k += bpp) {
+               b = stbi__png_load4(prior+k);
+               avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+               a = _mm_add_epi8(stbi__png_load4(raw+k), avg);
+               stbi__png_store4(cur+k, a);
+            }
+         } else {
+            for (; k+8 <= nk; k += bpp) {
+               b = _mm_loadl_epi64((__m128i *) (prior+k));
+               avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+               a = _mm_add_epi8(_mm_loadl_epi64((__m128i *) (raw+k)), avg);
+               _mm_storel_epi64((__m128i *) (cur+k), a);
+            }
+         }
+         break;
+      }
+      case STBI__F_paeth: {
+         // in 16-bit lanes: with p = a+b-c, |p-a| = |b-c|, |p-b| = |a-c|, |p-c| = |(b-c)+(a-c)|
+         __m128i a = zero, b, c = zero, x, pa, pb, pc, lo, pred;
+         for (; k + (bpp <= 4 ? 4 : 8) <= nk; k += bpp) {
+            if (bpp <= 4) {
+               b = _mm_unpacklo_epi8(stbi__png_load4(prior+k), zero);
+               x = stbi__png_load4(raw+k);
+            } else {
+               b = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *) (prior+k)), zero);
+               x = _mm_loadl_epi64((__m128i *) (raw+k));
+            }
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = _mm_add_epi16(pa, pb);
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            lo = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            // a if pa is smallest, else b if pb is, else c: the scalar tie-breaking
+            pb = _mm_cmpeq_epi16(lo, pb);
+            pred = _mm_or_si128(_mm_and_si128(pb, b), _mm_andnot_si128(pb, c));
+            pa = _mm_cmpeq_epi16(lo, pa);
+            pred = _mm_or_si128(_mm_and_si128(pa, a), _mm_andnot_si128(pa, pred));
+            x = _mm_add_epi8(x, _mm_packus_epi16(pred, pred));
+            if (bpp <= 4)
+               stbi__png_store4(cur+k, x);
+            else
+               _mm_storel_epi64((__m128i *) (cur+k), x);
+            a = _mm_unpacklo_epi8(x, zero);
+            c = b;
+         }
+         break;
+      }
+   }
+   return k;
+}
+#endif // STBI_SSE2
+
+#ifdef STBI__NEON_EXTRA
+static void stbi__png_store_px(stbi_uc *p, uint8x8_t x, int bpp)
+{
+   if (bpp <= 4) {
+      stbi__uint32 v = vget_lane_u32(vreinterpret_u32_u8(x), 0);
+      memcpy(p, &v, 4);
+   } else
+      vst1_u8(p, x);
+}
+
+static int stbi__png_unfilter_simd(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int filter, int nk, int bpp)
+{
+   uint8x8_t a = vdup_n_u8(0), b, c = a;
+   int k = 0;
+   if (filter == STBI__F_up) {
+      for (; k+16 <= nk; k += 16)
+         vst1q_u8(cur+k, vaddq_u8(vld1q_u8(raw+k), vld1q_u8(prior+k)));
+      return k;
+   }
+   if (bpp != 3 && bpp != 4 && bpp != 6 && bpp != 8) return 0;
+   // pixels are loaded 8 bytes at a time whatever their size
+   switch (filter) {
+      case STBI__F_sub:
+         for (; k+8 <= nk; k += bpp) {
+            a = vadd_u8(vld1_u8(raw+k), a);
+            stbi__png_store_px(cur+k, a, bpp);
+         }
+         break;
+      case STBI__F_avg:
+         for (; k+8 <= nk; k += bpp) {
+            a = vadd_u8(vld1_u8(raw+k), vhadd_u8(a, vld1_u8(prior+k)));
+            stbi__png_store_px(cur+k, a, bpp);
+         }
+         break;
+      case STBI__F_paeth:
+         for (; k+8 <= nk; k += bpp) {
+            // with p = a+b-c, |p-a| = |b-c|, |p-b| = |a-c|, |p-c| = |(a+b)-(c+c)|
+            uint16x8_t pa, pb, pc;
+            uint8x8_t use_a, use_b;
+            b = vld1_u8(prior+k);
+            pa = vabdl_u8(b, c);
+            pb = vabdl_u8(a, c);
+            pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+            use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+            use_b = vmovn_u16(vcleq_u16(pb, pc));
+            a = vadd_u8(vld1_u8(raw+k), vbsl_u8(use_a, a, vbsl_u8(use_b, b, c)));
+            stbi__png_store_px(cur+k, a, bpp);
+            c = b;
+         }
+         break;
+   }
+   return k;
+}
+#endif // STBI__NEON_EXTRA
+#endif
+
+static void stbi__png_unfilter_row(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int filter, int nk, int filter_bytes)
+{
+   int k = 0;
+#if defined(STBI_SSE2)
+   if (stbi__sse2_available())
+      k = stbi__png_unfilter_simd(cur, prior, raw, filter, nk, filter_bytes);
+#elif defined(STBI__NEON_EXTRA)
+   k = stbi__png_unfilter_simd(cur, prior, raw, filter, nk, filter_bytes);
+#endif
+   switch (filter) {
+      case STBI__F_none:
+         memcpy(cur, raw, nk);
+         break;
+      case STBI__F_sub:
+         if (k == 0) {
+            memcpy(cur, raw, filter_bytes);
+            k = filter_bytes;
+         }
+         for (; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
+         break;
+      case STBI__F_up:
+         for (; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+         break;
+      case STBI__F_avg:
+         for (; k < filter_bytes; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
+         for (; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1));
+         break;
+      case STBI__F_paeth:
+         for (; k < filter_bytes; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
+         for (; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes]));
+         break;
+      case STBI__F_avg_first:
+         memcpy(cur, raw, filter_bytes);
+         for (k=filter_bytes; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1));
+         break;
+      case STBI__F_paeth_first:
+         memcpy(cur, raw, filter_bytes);
+         for (k=filter_bytes; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0));
+         break;
+   }
+}
+
+// insert alpha=255 after every pixel; works backwards so dest may equal src
+static void stbi__png_alpha_expand8(stbi_uc *dest, stbi_uc *src, stbi__uint32 x, int img_n)
 {
-   STBI__F_none,
-   STBI__F_sub,
-   STBI__F_none,
-   STBI__F_avg_first,
-   STBI__F_paeth_first
-};
+   int i;
+   if (img_n == 1) {
+      for (i=x-1; i >= 0; --i) {
+         dest[i*2+1] = 255;
+         dest[i*2+0] = src[i];
+      }
+   } else {
+      STBI_ASSERT(img_n == 3);
+      for (i=x-1; i >= 0; --i) {
+         dest[i*4+3] = 255;
+         dest[i*4+2] = src[i*3+2];
+         dest[i*4+1] = src[i*3+1];
+         dest[i*4+0] = src[i*3+0];
+      }
+   }
+}
 
-static int stbi__paeth(int a, int b, int c)
+// expand an unfiltered scanline to out_n components of 8 or (native-endian) 16 bits
+static void stbi__png_expand_row(stbi_uc *dest, stbi_uc *cur, stbi__uint32 x, int img_n, int out_n, int depth, int color)
 {
-   int p = a + b - c;
-   int pa = abs(p-a);
-   int pb = abs(p-b);
-   int pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return a;
-   if (pb <= pc) return b;
-   return c;
+   int k;
+   stbi__uint32 i;
+   if (depth < 8) {
+      // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+      // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+      stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+      stbi_uc *in = cur, *out = dest;
+
+      // the final byte may hold padding bits, so clamp the final ones explicitly
+      if (depth == 4) {
+         for (k=x*img_n; k >= 2; k-=2, ++in) {
+            *out++ = scale * ((*in >> 4)       );
+            *out++ = scale * ((*in     ) & 0x0f);
+         }
+         if (k > 0) *out++ = scale * ((*in >> 4)       );
+      } else if (depth == 2) {
+         for (k=x*img_n; k >= 4; k-=4, ++in) {
+            *out++ = scale * ((*in >> 6)       );
+            *out++ = scale * ((*in >> 4) & 0x03);
+            *out++ = scale * ((*in >> 2) & 0x03);
+            *out++ = scale * ((*in     ) & 0x03);
+         }
+         if (k > 0) *out++ = scale * ((*in >> 6)       );
+         if (k > 1) *out++ = scale * ((*in >> 4) & 0x03);
+         if (k > 2) *out++ = scale * ((*in >> 2) & 0x03);
+      } else if (depth == 1) {
+         for (k=x*img_n; k >= 8; k-=8, ++in) {
+            *out++ = scale * ((*in >> 7)       );
+            *out++ = scale * ((*in >> 6) & 0x01);
+            *out++ = scale * ((*in >> 5) & 0x01);
+            *out++ = scale * ((*in >> 4) & 0x01);
+            *out++ = scale * ((*in >> 3) & 0x01);
+            *out++ = scale * ((*in >> 2) & 0x01);
+            *out++ = scale * ((*in >> 1) & 0x01);
+            *out++ = scale * ((*in     ) & 0x01);
+         }
+         if (k > 0) *out++ = scale * ((*in >> 7)       );
+         if (k > 1) *out++ = scale * ((*in >> 6) & 0x01);
+         if (k > 2) *out++ = scale * ((*in >> 5) & 0x01);
+         if (k > 3) *out++ = scale * ((*in >> 4) & 0x01);
+         if (k > 4) *out++ = scale * ((*in >> 3) & 0x01);
+         if (k > 5) *out++ = scale * ((*in >> 2) & 0x01);
+         if (k > 6) *out++ = scale * ((*in >> 1) & 0x01);
+      }
+      if (img_n != out_n)
+         stbi__png_alpha_expand8(dest, dest, x, img_n);
+   } else if (depth == 8) {
+      if (img_n == out_n)
+         memcpy(dest, cur, x*img_n);
+      else
+         stbi__png_alpha_expand8(dest, cur, x, img_n);
+   } else {
+      // force the image data from big-endian to platform-native
+      stbi__uint16 *dest16 = (stbi__uint16 *) dest;
+      if (img_n == out_n) {
+         for (i=0; i < x*img_n; ++i, ++dest16, cur += 2)
+            *dest16 = (cur[0] << 8) | cur[1];
+      } else {
+         STBI_ASSERT(img_n+1 == out_n);
+         for (i=0; i < x; ++i) {
+            for (k=0; k < img_n; ++k, cur += 2)
+               *dest16++ = (cur[0] << 8) | cur[1];
+            *dest16++ = 0xffff;
+         }
+      }
+   }
 }
 
-static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
-
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// create the png data from post-deflated data, bottom-up if flip is set
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color, int flip)
 {
    int bytes = (depth == 16? 2 : 1);
    stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
+   stbi__uint32 j,stride = x*out_n*bytes;
    stbi__uint32 img_len, img_width_bytes;
-   int k;
+   stbi_uc *filter_buf;
    int img_n = s->img_n; // copy it into a local for later
-
-   int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
-   int width = x;
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   a->out = (stbi_uc *) stbi__malloc_mad3(a->s->alloc, x, y, out_n*bytes, 0);
    if (!a->out) return stbi__err("outofmem", "Out of memory");
 
    if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
@@ -4562,189 +7788,32 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    // so just check for raw_len < img_len always.
    if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
+   // unfilter into two alternating scanlines of workspace, then expand into the output
+   filter_buf = (stbi_uc *) stbi__malloc_mad2(a->s->alloc, img_width_bytes, 2, 0);
+   if (!filter_buf) return stbi__err("outofmem", "Out of memory");
+
+   if (depth < 8) filter_bytes = 1;
+
    for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
+      stbi_uc *cur   = filter_buf + ( j & 1)*img_width_bytes;
+      stbi_uc *prior = filter_buf + (~j & 1)*img_width_bytes;
       int filter = *raw++;
 
-      if (filter > 4)
+      if (filter > 4) {
+         stbi__free(a->s->alloc, filter_buf);
          return stbi__err("invalid filter","Corrupt PNG");
-
-      if (depth < 8) {
-         if (img_width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
 
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
 
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
-         }
-      }
-
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
-         }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
-      } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
-      }
-
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define STBI__CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define STBI__CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
-         }
-      }
-   }
-
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
-            }
-         }
-      }
-   } else if (depth == 16) {
-      // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
-      stbi__uint16 *cur16 = (stbi__uint16*)cur;
+      stbi__png_unfilter_row(cur, prior, raw, filter, img_width_bytes, filter_bytes);
+      raw += img_width_bytes;
 
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
-         *cur16 = (cur[0] << 8) | cur[1];
-      }
+      stbi__png_expand_row(a->out + stride*(flip ? y-1-j : j), cur, x, img_n, out_n, depth, color);
    }
 
+   stbi__free(a->s->alloc, filter_buf);
    return 1;
 }
 
@@ -4755,10 +7824,10 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    stbi_uc *final;
    int p;
    if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color, a->s->flip);
 
    // de-interlacing
-   final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
+   final = (stbi_uc *) stbi__malloc_mad3(a->s->alloc, a->s->img_x, a->s->img_y, out_bytes, 0);
    for (p=0; p < 7; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
       int yorig[] = { 0,0,4,0,2,0,1 };
@@ -4770,19 +7839,20 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color, 0)) {
+            stbi__free(a->s->alloc, final);
             return 0;
          }
          for (j=0; j < y; ++j) {
             for (i=0; i < x; ++i) {
                int out_y = j*yspc[p]+yorig[p];
                int out_x = i*xspc[p]+xorig[p];
+               if (a->s->flip) out_y = (int) a->s->img_y-1 - out_y;
                memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
                       a->out + (j*x+i)*out_bytes, out_bytes);
             }
          }
-         STBI_FREE(a->out);
+         stbi__free(a->s->alloc, a->out);
          image_data += img_len;
          image_data_len -= img_len;
       }
@@ -4792,11 +7862,9 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -4817,11 +7885,9 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__uint16 *p, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -4842,17 +7908,9 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+static void stbi__expand_png_palette_pixels(stbi_uc *p, stbi_uc *orig, stbi__uint32 pixel_count, stbi_uc *palette, int pal_img_n)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   stbi__uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -4871,7 +7929,18 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *temp_out;
+
+   temp_out = (stbi_uc *) stbi__malloc_mad2(a->s->alloc, pixel_count, pal_img_n, 0);
+   if (temp_out == NULL) return stbi__err("outofmem", "Out of memory");
+
+   stbi__expand_png_palette_pixels(temp_out, a->out, pixel_count, palette, pal_img_n);
+   stbi__free(a->s->alloc, a->out);
    a->out = temp_out;
 
    STBI_NOTUSED(len);
@@ -4892,13 +7961,11 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
    stbi__de_iphone_flag = flag_true_if_should_convert;
 }
 
-static void stbi__de_iphone(stbi__png *z)
+static void stbi__de_iphone(stbi_uc *p, stbi__uint32 pixel_count, int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          stbi_uc t = p[0];
          p[0] = p[2];
@@ -4906,7 +7973,7 @@ static void stbi__de_iphone(stbi__png *z)
          p += 3;
       }
    } else {
-      STBI_ASSERT(s->img_out_n == 4);
+      STBI_ASSERT(out_n == 4);
       if (stbi__unpremultiply_on_load) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
@@ -4937,18 +8004,183 @@ static void stbi__de_iphone(stbi__png *z)
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
+// the per-pixel steps stbi__parse_png_file and stbi__do_png apply to whole
+// images, for one unfiltered row; a and b are x*8 bytes of scratch each, and
+// the finished row (in 'a' or 'b') has req_comp channels if that's nonzero
+static stbi_uc *stbi__png_finish_row(stbi__png *p, stbi_uc *cur, stbi_uc *a, stbi_uc *b, int pal_n, int req_comp)
+{
+   stbi__uint32 x = p->s->img_x;
+   int n = p->s->img_out_n;
+   stbi_uc *t;
+   stbi__png_expand_row(a, cur, x, p->s->img_n, n, p->depth, p->color);
+   if (p->has_trans) {
+      if (p->depth == 16)
+         stbi__compute_transparency16((stbi__uint16 *) a, x, p->tc16, n);
+      else
+         stbi__compute_transparency(a, x, p->tc, n);
+   }
+   if (p->is_iphone && stbi__de_iphone_flag && n > 2)
+      stbi__de_iphone(a, x, n);
+   if (p->pal_img_n) {
+      stbi__expand_png_palette_pixels(b, a, x, p->palette, pal_n);
+      t = a; a = b; b = t;
+      n = pal_n;
+   }
+   if (req_comp && req_comp != n) {
+      if (p->depth == 16)
+         stbi__convert_format16_row((stbi__uint16 *) b, (stbi__uint16 *) a, n, req_comp, x);
+      else
+         stbi__convert_format_row(b, a, n, req_comp, x);
+      a = b;
+   }
+   return a;
+}
+
+// pipelined decoding: inflate the next stretch of rows while unfiltering and
+// converting the previous one, on two tasks per step. the tasks only read
+// each other's data (the inflater reads back-references, the other one reads
+// rows that are already complete), so they need no locking, and it still
+// works if parallel_for runs them one after the other
+#define STBI__PNG_PIPELINE_BYTES  (1 << 18)  // inflated data per step
+
+typedef struct
+{
+   stbi__png *p;
+   stbi__zbuf z;
+   stbi_uc *raw, *filter_buf, *row_buf;
+   stbi__uint32 width_bytes, row0, row1;  // rows [row0,row1) are unfiltered this step
+   int pal_n, req_comp, out_bytes, zdone;
+   const char *failure[2];
+} stbi__png_pipeline;
+
+static void stbi__png_pipeline_task(void *task_data, int index)
+{
+   stbi__png_pipeline *pl = (stbi__png_pipeline *) task_data;
+   stbi__png *p = pl->p;
+   stbi__uint32 j, x = p->s->img_x, len = pl->width_bytes + 1;
+   pl->failure[index] = NULL;
+   if (index == 0) {
+      int r;
+      STBI__PROFILED(STBI_PROFILE_INFLATE, r = stbi__zinflate(&pl->z));
+      if (!r) {
+         pl->failure[0] = stbi__g_failure_reason;
+         if (!pl->failure[0]) pl->failure[0] = "bad zlib";
+      }
+      pl->zdone = (r == 1);
+      return;
+   }
+   for (j=pl->row0; j < pl->row1; ++j) {
+      stbi_uc *raw = pl->raw + (size_t) len * j, *row;
+      stbi_uc *cur   = pl->filter_buf + ( j & 1)*pl->width_bytes;
+      stbi_uc *prior = pl->filter_buf + (~j & 1)*pl->width_bytes;
+      int filter = *raw;
+      if (filter > 4) {
+         pl->failure[1] = "invalid filter";
+         return;
+      }
+      if (j == 0) filter = first_row_filter[filter];
+      STBI__PROFILED(STBI_PROFILE_UNFILTER, stbi__png_unfilter_row(cur, prior, raw+1, filter, pl->width_bytes, p->depth < 8 ? 1 : p->s->img_n * (p->depth/8)));
+      row = stbi__png_finish_row(p, cur, pl->row_buf, pl->row_buf + x*8, pl->pal_n, pl->req_comp);
+      memcpy(p->out + (size_t) pl->out_bytes * (p->s->flip ? p->s->img_y-1-j : j), row, pl->out_bytes);
+   }
+}
+
+// replaces the whole-image path of the IEND case for non-interlaced images
+static int stbi__png_decode_pipelined(stbi__png *p, stbi__uint32 idata_len, int req_comp)
+{
+   stbi__context *s = p->s;
+   stbi__png_pipeline pl;
+   stbi__uint32 x = s->img_x, y = s->img_y, len, chunk;
+   int n, r, ok = 1;
+
+   if ((req_comp == s->img_n+1 && req_comp != 3 && !p->pal_img_n) || p->has_trans)
+      s->img_out_n = s->img_n+1;
+   else
+      s->img_out_n = s->img_n;
+   pl.pal_n = req_comp >= 3 ? req_comp : p->pal_img_n;
+   n = req_comp ? req_comp : p->pal_img_n ? pl.pal_n : s->img_out_n;
+
+   if (!stbi__mad3sizes_valid(s->img_n, x, p->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   pl.width_bytes = (((s->img_n * x * p->depth) + 7) >> 3);
+   len = pl.width_bytes + 1;
+   if (!stbi__mad2sizes_valid(len, y, 258) || !stbi__mad3sizes_valid(x, y, n*(p->depth == 16 ? 2 : 1), 0))
+      return stbi__err("too large", "Corrupt PNG");
+
+   pl.p = p;
+   pl.req_comp = req_comp;
+   pl.out_bytes = x * n * (p->depth == 16 ? 2 : 1);
+   pl.raw = (stbi_uc *) stbi__malloc_mad2(s->alloc, len, y, 258); // slack for the match that overflows a step
+   pl.filter_buf = (stbi_uc *) stbi__malloc_mad2(s->alloc, pl.width_bytes, 2, 0);
+   pl.row_buf = (stbi_uc *) stbi__malloc_mad2(s->alloc, x, 16, 0);
+   p->out = (stbi_uc *) stbi__malloc_mad2(s->alloc, pl.out_bytes, y, 0);
+   if (!pl.raw || !pl.filter_buf || !pl.row_buf || !p->out) {
+      ok = stbi__err("outofmem", "Out of memory");
+      goto done;
+   }
+
+   chunk = STBI__PNG_PIPELINE_BYTES / len;
+   if (chunk == 0) chunk = 1;
+   pl.z.zbuffer = p->idata;
+   pl.z.zbuffer_end = p->idata + idata_len;
+   pl.z.zrefill = NULL;
+   pl.z.zout_start = pl.z.zout = (char *) pl.raw;
+   pl.z.zout_end = (char *) pl.raw + (size_t) len * (chunk < y ? chunk : y);
+   pl.z.z_expandable = 0;
+   pl.z.z_window = 1;
+   pl.z.alloc = s->alloc;
+   r = stbi__parse_zlib(&pl.z, !p->is_iphone);
+   if (!r) { ok = 0; goto done; }
+   pl.zdone = (r == 1);
+
+   for (pl.row0 = 0; pl.row0 < y; pl.row0 = pl.row1) {
+      pl.row1 = y - pl.row0 > chunk ? pl.row0 + chunk : y;
+      if ((size_t) ((stbi_uc *) pl.z.zout - pl.raw) < (size_t) len * pl.row1) {
+         ok = stbi__err("not enough pixels","Corrupt PNG");
+         break;
+      }
+      // extra data after the last row is ignored, as in the whole-image path
+      pl.failure[0] = NULL;
+      if (!pl.zdone && pl.row1 < y) {
+         stbi__uint32 next = y - pl.row1 > chunk ? pl.row1 + chunk : y;
+         pl.z.zout_end = (char *) pl.raw + (size_t) len * next;
+         p->parallel_for(p->parallel_user, stbi__png_pipeline_task, &pl, 2);
+      } else
+         stbi__png_pipeline_task(&pl, 1);
+      if (pl.failure[1] || pl.failure[0]) {
+         ok = stbi__err(pl.failure[1] ? pl.failure[1] : pl.failure[0], "Corrupt PNG");
+         break;
+      }
+   }
+
+   if (ok) {
+      s->img_out_n = n;
+      if (p->pal_img_n)
+         s->img_n = p->pal_img_n;
+      else if (p->has_trans)
+         ++s->img_n;
+   }
+done:
+   stbi__free(s->alloc, pl.raw);
+   stbi__free(s->alloc, pl.filter_buf);
+   stbi__free(s->alloc, pl.row_buf);
+   stbi__free(s->alloc, p->idata); p->idata = NULL;
+   return ok;
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
-   stbi_uc palette[1024], pal_img_n=0;
-   stbi_uc has_trans=0, tc[3]={0};
-   stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   stbi_uc *palette = z->palette;
+   stbi__uint32 ioff=0, idata_limit=0, i;
+   int first=1,k;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->pal_img_n = z->has_trans = 0;
+   z->tc[0] = z->tc[1] = z->tc[2] = 0;
+   z->pal_len = 0;
+   z->color = z->interlace = z->is_iphone = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -4958,7 +8190,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
       stbi__pngchunk c = stbi__get_chunk_header(s);
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
-            is_iphone = 1;
+            z->is_iphone = 1;
             stbi__skip(s, c.length);
             break;
          case STBI__PNG_TYPE('I','H','D','R'): {
@@ -4971,15 +8203,15 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
             if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
             z->depth = stbi__get8(s);  if (z->depth != 1 && z->depth != 2 && z->depth != 4 && z->depth != 8 && z->depth != 16)  return stbi__err("1/2/4/8/16-bit only","PNG not supported: 1/2/4/8/16-bit only");
-            color = stbi__get8(s);  if (color > 6)         return stbi__err("bad ctype","Corrupt PNG");
-            if (color == 3 && z->depth == 16)                  return stbi__err("bad ctype","Corrupt PNG");
-            if (color == 3) pal_img_n = 3; else if (color & 1) return stbi__err("bad ctype","Corrupt PNG");
+            z->color = stbi__get8(s);  if (z->color > 6)         return stbi__err("bad ctype","Corrupt PNG");
+            if (z->color == 3 && z->depth == 16)                  return stbi__err("bad ctype","Corrupt PNG");
+            if (z->color == 3) z->pal_img_n = 3; else if (z->color & 1) return stbi__err("bad ctype","Corrupt PNG");
             comp  = stbi__get8(s);  if (comp) return stbi__err("bad comp method","Corrupt PNG");
             filter= stbi__get8(s);  if (filter) return stbi__err("bad filter method","Corrupt PNG");
-            interlace = stbi__get8(s); if (interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
+            z->interlace = stbi__get8(s); if (z->interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
             if (!s->img_x || !s->img_y) return stbi__err("0-pixel image","Corrupt PNG");
-            if (!pal_img_n) {
-               s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+            if (!z->pal_img_n) {
+               s->img_n = (z->color & 2 ? 3 : 1) + (z->color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
                if (scan == STBI__SCAN_header) return 1;
             } else {
@@ -4995,9 +8227,9 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('P','L','T','E'):  {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (c.length > 256*3) return stbi__err("invalid PLTE","Corrupt PNG");
-            pal_len = c.length / 3;
-            if (pal_len * 3 != c.length) return stbi__err("invalid PLTE","Corrupt PNG");
-            for (i=0; i < pal_len; ++i) {
+            z->pal_len = c.length / 3;
+            if (z->pal_len * 3 != c.length) return stbi__err("invalid PLTE","Corrupt PNG");
+            for (i=0; i < z->pal_len; ++i) {
                palette[i*4+0] = stbi__get8(s);
                palette[i*4+1] = stbi__get8(s);
                palette[i*4+2] = stbi__get8(s);
@@ -5009,21 +8241,21 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('t','R','N','S'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (z->idata) return stbi__err("tRNS after IDAT","Corrupt PNG");
-            if (pal_img_n) {
+            if (z->pal_img_n) {
                if (scan == STBI__SCAN_header) { s->img_n = 4; return 1; }
-               if (pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
-               if (c.length > pal_len) return stbi__err("bad tRNS len","Corrupt PNG");
-               pal_img_n = 4;
+               if (z->pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
+               if (c.length > z->pal_len) return stbi__err("bad tRNS len","Corrupt PNG");
+               z->pal_img_n = 4;
                for (i=0; i < c.length; ++i)
                   palette[i*4+3] = stbi__get8(s);
             } else {
                if (!(s->img_n & 1)) return stbi__err("tRNS with alpha","Corrupt PNG");
                if (c.length != (stbi__uint32) s->img_n*2) return stbi__err("bad tRNS len","Corrupt PNG");
-               has_trans = 1;
+               z->has_trans = 1;
                if (z->depth == 16) {
-                  for (k = 0; k < s->img_n; ++k) tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
+                  for (k = 0; k < s->img_n; ++k) z->tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
                } else {
-                  for (k = 0; k < s->img_n; ++k) tc[k] = (stbi_uc)(stbi__get16be(s) & 255) * stbi__depth_scale_table[z->depth]; // non 8-bit images will be larger
+                  for (k = 0; k < s->img_n; ++k) z->tc[k] = (stbi_uc)(stbi__get16be(s) & 255) * stbi__depth_scale_table[z->depth]; // non 8-bit images will be larger
                }
             }
             break;
@@ -5031,8 +8263,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('I','D','A','T'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
-            if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (z->pal_img_n && !z->pal_len) return stbi__err("no PLTE","Corrupt PNG");
+            if (scan == STBI__SCAN_header) { s->img_n = z->pal_img_n; return 1; }
+            if (z->stream) {
+               // leave the rest to stbi__png_stream_row; interlaced images are decoded whole
+               if (!z->interlace) { z->idat_left = c.length; return 1; }
+               z->stream = 0;
+            }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
@@ -5041,7 +8278,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
                STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__realloc_sized(z->s->alloc, z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -5051,41 +8288,48 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('I','E','N','D'): {
             stbi__uint32 raw_len, bpl;
+            int ok;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (scan != STBI__SCAN_load) return 1;
+            if (scan == STBI__SCAN_header) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
+            if (z->parallel_for && !z->interlace) {
+               if (!stbi__png_decode_pipelined(z, ioff, req_comp)) return 0;
+               stbi__get32be(s);
+               return 1;
+            }
             // initial guess for decoded data size to avoid unnecessary reallocs
             bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+            z->expanded = (stbi_uc *) stbi__zlib_decode_malloc(z->s->alloc, (char *) z->idata, ioff, raw_len, (int *) &raw_len, !z->is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+            stbi__free(z->s->alloc, z->idata); z->idata = NULL;
+            if ((req_comp == s->img_n+1 && req_comp != 3 && !z->pal_img_n) || z->has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
-            if (has_trans) {
+            STBI__PROFILED(STBI_PROFILE_UNFILTER, ok = stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, z->color, z->interlace));
+            if (!ok) return 0;
+            if (z->has_trans) {
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16((stbi__uint16 *) z->out, s->img_x * s->img_y, z->tc16, s->img_out_n)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, z->tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
-            if (pal_img_n) {
+            if (z->is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+               stbi__de_iphone(z->out, s->img_x * s->img_y, s->img_out_n);
+            if (z->pal_img_n) {
                // pal_img_n == 3 or 4
-               s->img_n = pal_img_n; // record the actual colors we had
-               s->img_out_n = pal_img_n;
+               s->img_n = z->pal_img_n; // record the actual colors we had
+               s->img_out_n = z->pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+               if (!stbi__expand_png_palette(z, palette, z->pal_len, s->img_out_n))
                   return 0;
-            } else if (has_trans) {
+            } else if (z->has_trans) {
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__free(z->s->alloc, z->expanded); z->expanded = NULL;
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
@@ -5128,19 +8372,20 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       p->out = NULL;
       if (req_comp && req_comp != p->s->img_out_n) {
          if (ri->bits_per_channel == 8)
-            result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+            result = stbi__convert_format(p->s->alloc, (unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          else
-            result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+            result = stbi__convert_format16(p->s->alloc, (stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          p->s->img_out_n = req_comp;
          if (result == NULL) return result;
       }
       *x = p->s->img_x;
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
+      ri->flipped = p->s->flip;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__free(p->s->alloc, p->out);      p->out      = NULL;
+   stbi__free(p->s->alloc, p->expanded); p->expanded = NULL;
+   stbi__free(p->s->alloc, p->idata);    p->idata    = NULL;
 
    return result;
 }
@@ -5149,6 +8394,8 @@ static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req
 {
    stbi__png p;
    p.s = s;
+   p.stream = 0;
+   p.parallel_for = NULL;
    return stbi__do_png(&p, x,y,comp,req_comp, ri);
 }
 
@@ -5176,6 +8423,8 @@ static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
 {
    stbi__png p;
    p.s = s;
+   p.stream = 0;
+   p.parallel_for = NULL;
    return stbi__png_info_raw(&p, x, y, comp);
 }
 
@@ -5183,6 +8432,8 @@ static int stbi__png_is16(stbi__context *s)
 {
    stbi__png p;
    p.s = s;
+   p.stream = 0;
+   p.parallel_for = NULL;
    if (!stbi__png_info_raw(&p, NULL, NULL, NULL))
 	   return 0;
    if (p.depth != 16) {
@@ -5191,6 +8442,344 @@ static int stbi__png_is16(stbi__context *s)
    }
    return 1;
 }
+
+static stbi_uc *stbi__load_png_parallel(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_parallel_for *parallel_for, void *user)
+{
+   stbi__png p;
+   stbi__result_info ri;
+   stbi_uc *result;
+   if (!parallel_for || !stbi__png_test(s))
+      return stbi__load_and_postprocess_8bit(s,x,y,comp,req_comp);
+
+   p.s = s;
+   p.stream = 0;
+   p.parallel_for = parallel_for;
+   p.parallel_user = user;
+   memset(&ri, 0, sizeof(ri));
+   ri.bits_per_channel = 8;
+   s->flip = stbi__vertically_flip_on_load;
+   result = (stbi_uc *) stbi__do_png(&p, x,y,comp,req_comp, &ri);
+   if (result == NULL)
+      return NULL;
+   if (ri.bits_per_channel != 8) {
+      result = stbi__convert_16_to_8(s->alloc, (stbi__uint16 *) result, *x, *y, req_comp ? req_comp : *comp);
+      if (result == NULL) return NULL;
+   }
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_png_parallel_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_parallel_for *parallel_for, void *user)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_png_parallel(&s,x,y,comp,req_comp,parallel_for,user);
+}
+
+STBIDEF stbi_uc *stbi_load_png_parallel_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_parallel_for *parallel_for, void *parallel_user)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_png_parallel(&s,x,y,comp,req_comp,parallel_for,parallel_user);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_png_parallel(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_parallel_for *parallel_for, void *user)
+{
+   FILE *f;
+   stbi__context s;
+   stbi_uc *result;
+#ifdef STBI__MMAP
+   int len;
+   stbi_uc *map = stbi__mmap_file(filename, &len);
+   if (map) {
+      result = stbi_load_png_parallel_from_memory(map, len, x, y, comp, req_comp, parallel_for, user);
+      stbi__munmap_file(map, len);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_png_parallel(&s,x,y,comp,req_comp,parallel_for,user);
+   fclose(f);
+   return result;
+}
+#endif
+
+// row-at-a-time decoding for stbi_stream: IDAT data is inflated through a
+// fixed window straight from the input, and unfiltered one scanline at a time
+
+#define STBI__PNG_WINDOW 65536 // twice the deflate window, so sliding it down is cheap
+
+typedef struct
+{
+   stbi__png p;
+   stbi__zbuf z;
+   stbi_uc *window, *raw;        // inflated data, and the next scanline in it
+   stbi_uc *filter_buf, *row_buf;
+   stbi__uint32 row, width_bytes;
+   int req_comp, pal_n, zdone;
+} stbi__png_stream;
+
+// zlib input callback: hand over the rest of the current IDAT, or move on to the next one
+static int stbi__png_zrefill(void *user, stbi_uc **start, stbi_uc **end)
+{
+   stbi__png *z = (stbi__png *) user;
+   stbi__context *s = z->s;
+   stbi__uint32 n;
+   s->img_buffer = *end;
+   while (z->idat_left == 0) {
+      stbi__pngchunk c;
+      stbi__get32be(s); // skip CRC
+      c = stbi__get_chunk_header(s);
+      if (c.type != STBI__PNG_TYPE('I','D','A','T')) return 0;
+      z->idat_left = c.length;
+   }
+   if (s->img_buffer >= s->img_buffer_end) {
+      if (!s->read_from_callbacks) return 0;
+      stbi__refill_buffer(s);
+      if (!s->read_from_callbacks) return 0;
+   }
+   n = (stbi__uint32) (s->img_buffer_end - s->img_buffer);
+   if (n > z->idat_left) n = z->idat_left;
+   z->idat_left -= n;
+   *start = s->img_buffer;
+   *end = s->img_buffer + n;
+   return 1;
+}
+
+// interlaced images are decoded whole into *image instead
+static int stbi__png_stream_begin(stbi__png_stream *ps, stbi__context *s, int req_comp, int *comp, stbi_uc **image)
+{
+   stbi__png *p = &ps->p;
+   stbi__uint32 len;
+   int r;
+
+   ps->window = ps->filter_buf = ps->row_buf = NULL;
+   ps->row = 0;
+   ps->req_comp = req_comp;
+   p->s = s;
+   p->stream = 1;
+   p->parallel_for = NULL;
+   if (!stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) return 0;
+
+   if (!p->stream) {
+      // finish it off the way stbi__do_png and stbi_load would
+      stbi_uc *result = p->out;
+      p->out = NULL;
+      if (req_comp && req_comp != s->img_out_n) {
+         if (p->depth == 16)
+            result = (stbi_uc *) stbi__convert_format16(s->alloc, (stbi__uint16 *) result, s->img_out_n, req_comp, s->img_x, s->img_y);
+         else
+            result = stbi__convert_format(s->alloc, result, s->img_out_n, req_comp, s->img_x, s->img_y);
+         s->img_out_n = req_comp;
+         if (result == NULL) return 0;
+      }
+      if (p->depth == 16) {
+         result = stbi__convert_16_to_8(s->alloc, (stbi__uint16 *) result, s->img_x, s->img_y, s->img_out_n);
+         if (result == NULL) return 0;
+      }
+      *image = result;
+      *comp = s->img_n;
+      return 1;
+   }
+
+   // same output layout as the IEND case of stbi__parse_png_file
+   if ((req_comp == s->img_n+1 && req_comp != 3 && !p->pal_img_n) || p->has_trans)
+      s->img_out_n = s->img_n+1;
+   else
+      s->img_out_n = s->img_n;
+   ps->pal_n = req_comp >= 3 ? req_comp : p->pal_img_n;
+   *comp = p->pal_img_n ? p->pal_img_n : s->img_n + p->has_trans;
+
+   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, p->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   ps->width_bytes = (((s->img_n * s->img_x * p->depth) + 7) >> 3);
+   len = ps->width_bytes + 1;
+
+   // the window holds 32K of history plus a partial scanline after sliding,
+   // plus 258 bytes of slack for the match that overflows it
+   ps->window = (stbi_uc *) stbi__malloc(s->alloc, STBI__PNG_WINDOW + len + 258);
+   ps->filter_buf = (stbi_uc *) stbi__malloc_mad2(s->alloc, ps->width_bytes, 2, 0);
+   ps->row_buf = (stbi_uc *) stbi__malloc_mad2(s->alloc, s->img_x, 16, 0);
+   if (!ps->window || !ps->filter_buf || !ps->row_buf) return stbi__err("outofmem", "Out of memory");
+
+   ps->z.zbuffer = ps->z.zbuffer_end = s->img_buffer;
+   ps->z.zrefill = stbi__png_zrefill;
+   ps->z.zrefill_user = p;
+   ps->z.zout_start = ps->z.zout = (char *) ps->window;
+   ps->z.zout_end = (char *) ps->window + STBI__PNG_WINDOW + len;
+   ps->z.z_expandable = 0;
+   ps->z.z_window = 1;
+   ps->z.alloc = s->alloc;
+   ps->raw = ps->window;
+
+   r = stbi__parse_zlib(&ps->z, !p->is_iphone);
+   if (!r) return 0;
+   ps->zdone = (r == 1);
+   return 1;
+}
+
+static int stbi__png_stream_row(stbi__png_stream *ps, stbi_uc *dest)
+{
+   stbi__png *p = &ps->p;
+   stbi__context *s = p->s;
+   stbi__uint32 i, x = s->img_x, len = ps->width_bytes + 1;
+   stbi_uc *cur   = ps->filter_buf + ( ps->row & 1)*ps->width_bytes;
+   stbi_uc *prior = ps->filter_buf + (~ps->row & 1)*ps->width_bytes;
+   stbi_uc *a;
+   int n, filter;
+
+   while ((stbi__uint32) ((stbi_uc *) ps->z.zout - ps->raw) < len) {
+      // slide the window down, keeping the deflate history and any partial scanline
+      int r;
+      size_t used = (stbi_uc *) ps->z.zout - ps->window;
+      size_t keep = ps->raw - ps->window;
+      if (ps->zdone) return stbi__err("not enough pixels","Corrupt PNG");
+      if (used - keep < 32768) keep = used > 32768 ? used - 32768 : 0;
+      memmove(ps->window, ps->window + keep, used - keep);
+      ps->raw -= keep;
+      ps->z.zout -= keep;
+      STBI__PROFILED(STBI_PROFILE_INFLATE, r = stbi__zinflate(&ps->z));
+      if (!r) return 0;
+      ps->zdone = (r == 1);
+   }
+
+   filter = *ps->raw;
+   if (filter > 4) return stbi__err("invalid filter","Corrupt PNG");
+   if (ps->row == 0) filter = first_row_filter[filter];
+   STBI__PROFILED(STBI_PROFILE_UNFILTER, stbi__png_unfilter_row(cur, prior, ps->raw+1, filter, ps->width_bytes, p->depth < 8 ? 1 : s->img_n * (p->depth/8)));
+   ps->raw += len;
+   ++ps->row;
+   if (!dest) return 1; // row not wanted, it only had to be unfiltered
+
+   a = stbi__png_finish_row(p, cur, ps->row_buf, ps->row_buf + x*8, ps->pal_n, ps->req_comp);
+   n = ps->req_comp ? ps->req_comp : p->pal_img_n ? ps->pal_n : s->img_out_n;
+   if (p->depth == 16) {
+      for (i=0; i < x*n; ++i)
+         dest[i] = (stbi_uc) (((stbi__uint16 *) a)[i] >> 8);
+   } else
+      memcpy(dest, a, x*n);
+   return 1;
+}
+
+static void stbi__png_stream_end(stbi__png_stream *ps)
+{
+   stbi__free(ps->p.s->alloc, ps->p.out);
+   stbi__free(ps->p.s->alloc, ps->p.expanded);
+   stbi__free(ps->p.s->alloc, ps->p.idata);
+   stbi__free(ps->p.s->alloc, ps->window);
+   stbi__free(ps->p.s->alloc, ps->filter_buf);
+   stbi__free(ps->p.s->alloc, ps->row_buf);
+}
+#endif
+
+#if !defined(STBI_NO_BMP) || !defined(STBI_NO_TGA)
+// BMP and TGA store pixels as BGR or BGRA. These reorder a row of x of them
+// to RGB or RGBA (in_n and out_n are 3 or 4; a missing alpha becomes 255),
+// and may work in place if in_n == out_n. The SIMD kernels do a prefix of
+// the row and return how many pixels they did, like the convert_format ones.
+#ifdef STBI_SSE2
+static int stbi__bgra_to_rgba_sse2(stbi_uc *dest, stbi_uc const *src, int x)
+{
+   int i = 0;
+   __m128i ga = _mm_set1_epi32((int) 0xff00ff00);
+   for (; i+3 < x; i += 4) {
+      __m128i p  = _mm_loadu_si128((__m128i const *) (src + i*4));
+      __m128i br = _mm_andnot_si128(ga, p);
+      br = _mm_or_si128(_mm_slli_epi32(br, 16), _mm_srli_epi32(br, 16));
+      _mm_storeu_si128((__m128i *) (dest + i*4), _mm_or_si128(_mm_and_si128(p, ga), br));
+   }
+   return i;
+}
+#endif
+
+#ifdef STBI_AVX2
+// 8 pixels at a time; as in stbi__convert_3_to_4_avx2, a 24-byte group of
+// BGR triples is split 12/12 across the two lanes before the byte shuffle
+STBI__AVX2_TARGET
+static int stbi__bgr_to_rgb_avx2(stbi_uc *dest, stbi_uc const *src, int in_n, int out_n, int x)
+{
+   int i = 0;
+   __m256i split = _mm256_setr_epi32(0,1,2,3, 3,4,5,6);
+   __m256i join  = _mm256_setr_epi32(0,1,2, 4,5,6, 3,7);
+   __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+   // a BGR load reads 32 bytes for 24, so stop 3 pixels early
+   if (in_n == 3 && out_n == 4) {
+      __m256i shuf = _mm256_setr_epi8(2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1,
+                                      2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1);
+      for (; i+10 < x; i += 8) {
+         __m256i p = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i const *) (src + i*3)), split);
+         _mm256_storeu_si256((__m256i *) (dest + i*4), _mm256_or_si256(_mm256_shuffle_epi8(p, shuf), alpha));
+      }
+   } else if (out_n == 3) {
+      __m256i shuf = in_n == 3
+         ? _mm256_setr_epi8(2,1,0, 5,4,3, 8,7,6, 11,10,9, -1,-1,-1,-1,
+                            2,1,0, 5,4,3, 8,7,6, 11,10,9, -1,-1,-1,-1)
+         : _mm256_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1,
+                            2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+      for (; i+10 < x; i += 8) {
+         __m256i p = _mm256_loadu_si256((__m256i const *) (src + i*in_n));
+         if (in_n == 3) p = _mm256_permutevar8x32_epi32(p, split);
+         p = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p, shuf), join);
+         _mm_storeu_si128((__m128i *) (dest + i*3), _mm256_castsi256_si128(p));
+         _mm_storel_epi64((__m128i *) (dest + i*3 + 16), _mm256_extracti128_si256(p, 1));
+      }
+   }
+   return i;
+}
+#endif
+
+#ifdef STBI__NEON_EXTRA
+static int stbi__bgr_to_rgb_neon(stbi_uc *dest, stbi_uc const *src, int in_n, int out_n, int x)
+{
+   int i = 0;
+   for (; i+15 < x; i += 16) {
+      uint8x16_t r, g, b, a = vdupq_n_u8(255);
+      if (in_n == 3) {
+         uint8x16x3_t p = vld3q_u8(src + i*3);
+         b = p.val[0]; g = p.val[1]; r = p.val[2];
+      } else {
+         uint8x16x4_t p = vld4q_u8(src + i*4);
+         b = p.val[0]; g = p.val[1]; r = p.val[2]; a = p.val[3];
+      }
+      if (out_n == 3) {
+         uint8x16x3_t o;
+         o.val[0] = r; o.val[1] = g; o.val[2] = b;
+         vst3q_u8(dest + i*3, o);
+      } else {
+         uint8x16x4_t o;
+         o.val[0] = r; o.val[1] = g; o.val[2] = b; o.val[3] = a;
+         vst4q_u8(dest + i*4, o);
+      }
+   }
+   return i;
+}
+#endif
+
+static void stbi__bgr_to_rgb_row(stbi_uc *dest, stbi_uc const *src, int in_n, int out_n, int x)
+{
+   int i = 0;
+#ifdef STBI_AVX2
+   if ((in_n == 3 || out_n == 3) && stbi__avx2_rows())
+      i = stbi__bgr_to_rgb_avx2(dest, src, in_n, out_n, x);
+#endif
+#ifdef STBI_SSE2
+   if (in_n == 4 && out_n == 4 && stbi__sse2_available())
+      i = stbi__bgra_to_rgba_sse2(dest, src, x);
+#endif
+#ifdef STBI__NEON_EXTRA
+   i = stbi__bgr_to_rgb_neon(dest, src, in_n, out_n, x);
+#endif
+   src += i*in_n;
+   dest += i*out_n;
+   for (; i < x; ++i, src += in_n, dest += out_n) {
+      stbi_uc t = src[0];
+      dest[0] = src[2];
+      dest[1] = src[1];
+      dest[2] = t;
+      if (out_n == 4) dest[3] = in_n == 4 ? src[3] : 255;
+   }
+}
 #endif
 
 // Microsoft/Windows BMP image
@@ -5368,13 +8957,14 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    int psize=0,i,j,width;
    int flip_vertically, pad, target;
    stbi__bmp_data info;
-   STBI_NOTUSED(ri);
 
    info.all_a = 255;
    if (stbi__bmp_parse_header(s, &info) == NULL)
       return NULL; // error code already set
 
-   flip_vertically = ((int) s->img_y) > 0;
+   // rows are written bottom-up if the file is (the usual case) or, failing
+   // that, if the caller asked for it
+   flip_vertically = (((int) s->img_y) > 0) != s->flip;
    s->img_y = abs((int) s->img_y);
 
    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
@@ -5395,7 +8985,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    }
    if (psize == 0) {
       STBI_ASSERT(info.offset == s->callback_already_read + (int) (s->img_buffer - s->img_buffer_original));
-      if (info.offset != s->callback_already_read + (s->img_buffer - s->buffer_start)) {
+      if (info.offset != s->callback_already_read + (s->img_buffer - s->img_buffer_original)) {
         return stbi__errpuc("bad offset", "Corrupt BMP");
       }
    }
@@ -5413,11 +9003,11 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!stbi__mad3sizes_valid(target, s->img_x, s->img_y, 0))
       return stbi__errpuc("too large", "Corrupt BMP");
 
-   out = (stbi_uc *) stbi__malloc_mad3(target, s->img_x, s->img_y, 0);
+   out = (stbi_uc *) stbi__malloc_mad3(s->alloc, target, s->img_x, s->img_y, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(s->alloc, out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5429,11 +9019,12 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(s->alloc, out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
             int bit_offset = 7, v = stbi__get8(s);
+            z = (flip_vertically ? (int) s->img_y-1-j : j) * s->img_x * target;
             for (i=0; i < (int) s->img_x; ++i) {
                int color = (v>>bit_offset)&0x1;
                out[z++] = pal[color][0];
@@ -5450,6 +9041,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
          }
       } else {
          for (j=0; j < (int) s->img_y; ++j) {
+            z = (flip_vertically ? (int) s->img_y-1-j : j) * s->img_x * target;
             for (i=0; i < (int) s->img_x; i += 2) {
                int v=stbi__get8(s),v2=0;
                if (info.bpp == 4) {
@@ -5474,6 +9066,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       int rshift=0,gshift=0,bshift=0,ashift=0,rcount=0,gcount=0,bcount=0,acount=0;
       int z = 0;
       int easy=0;
+      stbi_uc *row = NULL;
       stbi__skip(s, info.offset - info.extra_read - info.hsz);
       if (info.bpp == 24) width = 3 * s->img_x;
       else if (info.bpp == 16) width = 2*s->img_x;
@@ -5486,26 +9079,29 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(s->alloc, out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
          bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
          ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
-         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { stbi__free(s->alloc, out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+      } else {
+         // plain BGR or BGRA: read whole rows and reorder them in bulk
+         row = (stbi_uc *) stbi__malloc_mad2(s->alloc, s->img_x, info.bpp >> 3, pad);
+         if (!row) { stbi__free(s->alloc, out); return stbi__errpuc("outofmem", "Out of memory"); }
       }
       for (j=0; j < (int) s->img_y; ++j) {
+         z = (flip_vertically ? (int) s->img_y-1-j : j) * s->img_x * target;
          if (easy) {
-            for (i=0; i < (int) s->img_x; ++i) {
-               unsigned char a;
-               out[z+2] = stbi__get8(s);
-               out[z+1] = stbi__get8(s);
-               out[z+0] = stbi__get8(s);
-               z += 3;
-               a = (easy == 2 ? stbi__get8(s) : 255);
-               all_a |= a;
-               if (target == 4) out[z++] = a;
-            }
+            int in_n = info.bpp >> 3;
+            stbi__get_block(s, row, s->img_x * in_n + pad);
+            stbi__bgr_to_rgb_row(out + z, row, in_n, target, s->img_x);
+            if (in_n == 3)
+               all_a = 255;
+            else if (target == 4) // only needed to spot an all-0 alpha channel
+               for (i=0; i < (int) s->img_x && !all_a; ++i)
+                  all_a |= row[i*4+3];
          } else {
             int bpp = info.bpp;
             for (i=0; i < (int) s->img_x; ++i) {
@@ -5518,9 +9114,10 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
                all_a |= a;
                if (target == 4) out[z++] = STBI__BYTECAST(a);
             }
+            stbi__skip(s, pad);
          }
-         stbi__skip(s, pad);
       }
+      stbi__free(s->alloc, row);
    }
 
    // if alpha channel is all 0s, replace with all 255s
@@ -5528,25 +9125,15 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       for (i=4*s->img_x*s->img_y-1; i >= 0; i -= 4)
          out[i] = 255;
 
-   if (flip_vertically) {
-      stbi_uc t;
-      for (j=0; j < (int) s->img_y>>1; ++j) {
-         stbi_uc *p1 = out +      j     *s->img_x*target;
-         stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-         for (i=0; i < (int) s->img_x*target; ++i) {
-            t = p1[i]; p1[i] = p2[i]; p2[i] = t;
-         }
-      }
-   }
-
    if (req_comp && req_comp != target) {
-      out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
+      out = stbi__convert_format(s->alloc, out, target, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
    }
 
    *x = s->img_x;
    *y = s->img_y;
    if (comp) *comp = s->img_n;
+   ri->flipped = s->flip;
    return out;
 }
 #endif
@@ -5707,13 +9294,12 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    // int tga_alpha_bits = tga_inverted & 15; // the 4 lowest bits - unused (useless?)
    //   image data
    unsigned char *tga_data;
-   unsigned char *tga_palette = NULL;
-   int i, j;
+   unsigned char *tga_palette = NULL, *tga_dest = NULL;
+   int i, j, col;
    unsigned char raw_data[4] = {0};
    int RLE_count = 0;
    int RLE_repeating = 0;
    int read_next_pixel = 1;
-   STBI_NOTUSED(ri);
    STBI_NOTUSED(tga_x_origin); // @TODO
    STBI_NOTUSED(tga_y_origin); // @TODO
 
@@ -5727,6 +9313,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       tga_is_RLE = 1;
    }
    tga_inverted = 1 - ((tga_inverted >> 5) & 1);
+   if (s->flip) tga_inverted = !tga_inverted;
 
    //   If I'm paletted, then I'll use the number of bits from the palette
    if ( tga_indexed ) tga_comp = stbi__tga_get_comp(tga_palette_bits, 0, &tga_rgb16);
@@ -5743,33 +9330,37 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!stbi__mad3sizes_valid(tga_width, tga_height, tga_comp, 0))
       return stbi__errpuc("too large", "Corrupt TGA");
 
-   tga_data = (unsigned char*)stbi__malloc_mad3(tga_width, tga_height, tga_comp, 0);
+   tga_data = (unsigned char*)stbi__malloc_mad3(s->alloc, tga_width, tga_height, tga_comp, 0);
    if (!tga_data) return stbi__errpuc("outofmem", "Out of memory");
 
    // skip to the data's starting position (offset usually = 0)
    stbi__skip(s, tga_offset );
 
+   // BGR(A) is turned into RGB(A) as it is read: a row, a palette or an RLE
+   // pixel at a time. RGB16 data is converted to RGB order directly.
    if ( !tga_indexed && !tga_is_RLE && !tga_rgb16 ) {
       for (i=0; i < tga_height; ++i) {
          int row = tga_inverted ? tga_height -i - 1 : i;
          stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
-         stbi__getn(s, tga_row, tga_width * tga_comp);
+         stbi__get_block(s, tga_row, tga_width * tga_comp);
+         if (tga_comp >= 3)
+            stbi__bgr_to_rgb_row(tga_row, tga_row, tga_comp, tga_comp, tga_width);
       }
    } else  {
       //   do I need to load a palette?
       if ( tga_indexed)
       {
          if (tga_palette_len == 0) {  /* you have to have at least one entry! */
-            STBI_FREE(tga_data);
+            stbi__free(s->alloc, tga_data);
             return stbi__errpuc("bad palette", "Corrupt TGA");
          }
 
          //   any data to skip? (offset usually = 0)
          stbi__skip(s, tga_palette_start );
          //   load the palette
-         tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
+         tga_palette = (unsigned char*)stbi__malloc_mad2(s->alloc, tga_palette_len, tga_comp, 0);
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            stbi__free(s->alloc, tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5780,13 +9371,14 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               stbi__free(s->alloc, tga_data);
+               stbi__free(s->alloc, tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
-         }
+         } else if (tga_comp >= 3)
+            stbi__bgr_to_rgb_row(tga_palette, tga_palette, tga_comp, tga_comp, tga_palette_len);
       }
-      //   load the data
-      for (i=0; i < tga_width * tga_height; ++i)
+      //   load the data, starting each row where it goes in the output
+      for (i=0, col=0; i < tga_width * tga_height; ++i)
       {
          //   if I'm in RLE mode, do I need to get a RLE stbi__pngchunk?
          if ( tga_is_RLE )
@@ -5830,58 +9422,38 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                for (j = 0; j < tga_comp; ++j) {
                   raw_data[j] = stbi__get8(s);
                }
+               if (tga_comp >= 3) {
+                  unsigned char temp = raw_data[0];
+                  raw_data[0] = raw_data[2];
+                  raw_data[2] = temp;
+               }
             }
             //   clear the reading flag for the next pixel
             read_next_pixel = 0;
          } // end of reading a pixel
 
          // copy data
+         if (col == 0) {
+            int row = tga_inverted ? tga_height - 1 - i/tga_width : i/tga_width;
+            tga_dest = tga_data + row*tga_width*tga_comp;
+         }
          for (j = 0; j < tga_comp; ++j)
-           tga_data[i*tga_comp+j] = raw_data[j];
+           *tga_dest++ = raw_data[j];
+         if (++col == tga_width) col = 0;
 
          //   in case we're in RLE mode, keep counting down
          --RLE_count;
       }
-      //   do I need to invert the image?
-      if ( tga_inverted )
-      {
-         for (j = 0; j*2 < tga_height; ++j)
-         {
-            int index1 = j * tga_width * tga_comp;
-            int index2 = (tga_height - 1 - j) * tga_width * tga_comp;
-            for (i = tga_width * tga_comp; i > 0; --i)
-            {
-               unsigned char temp = tga_data[index1];
-               tga_data[index1] = tga_data[index2];
-               tga_data[index2] = temp;
-               ++index1;
-               ++index2;
-            }
-         }
-      }
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
-      }
-   }
-
-   // swap RGB - if the source data was RGB16, it already is in the right order
-   if (tga_comp >= 3 && !tga_rgb16)
-   {
-      unsigned char* tga_pixel = tga_data;
-      for (i=0; i < tga_width * tga_height; ++i)
-      {
-         unsigned char temp = tga_pixel[0];
-         tga_pixel[0] = tga_pixel[2];
-         tga_pixel[2] = temp;
-         tga_pixel += tga_comp;
+         stbi__free(s->alloc, tga_palette );
       }
    }
 
    // convert to target component count
    if (req_comp && req_comp != tga_comp)
-      tga_data = stbi__convert_format(tga_data, tga_comp, req_comp, tga_width, tga_height);
+      tga_data = stbi__convert_format(s->alloc, tga_data, tga_comp, req_comp, tga_width, tga_height);
 
    //   the things I do to get rid of an error message, and yet keep
    //   Microsoft's C compilers happy... [8^(
@@ -5889,6 +9461,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
          tga_x_origin = tga_y_origin = 0;
    STBI_NOTUSED(tga_palette_start);
    //   OK, done
+   ri->flipped = s->flip;
    return tga_data;
 }
 #endif
@@ -5942,6 +9515,49 @@ static int stbi__psd_decode_rle(stbi__context *s, stbi_uc *p, int pixelCount)
    return 1;
 }
 
+// interleave the first n (1..4) planes of count 8-bit samples each, stored
+// one after the other at src, into RGBA; missing channels are 0, alpha 255
+static void stbi__psd_interleave(stbi_uc *out, stbi_uc const *src, int n, int count)
+{
+   stbi_uc const *plane[4];
+   int i = 0, k;
+   for (k=0; k < n; ++k)
+      plane[k] = src + (size_t) k * count;
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      __m128i c[4];
+      c[0] = c[1] = c[2] = _mm_setzero_si128();
+      c[3] = _mm_set1_epi8((char) 255);
+      for (; i+15 < count; i += 16) {
+         __m128i rg_lo, rg_hi, ba_lo, ba_hi;
+         for (k=0; k < n; ++k)
+            c[k] = _mm_loadu_si128((__m128i const *) (plane[k] + i));
+         rg_lo = _mm_unpacklo_epi8(c[0], c[1]); rg_hi = _mm_unpackhi_epi8(c[0], c[1]);
+         ba_lo = _mm_unpacklo_epi8(c[2], c[3]); ba_hi = _mm_unpackhi_epi8(c[2], c[3]);
+         _mm_storeu_si128((__m128i *) (out + i*4     ), _mm_unpacklo_epi16(rg_lo, ba_lo));
+         _mm_storeu_si128((__m128i *) (out + i*4 + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+         _mm_storeu_si128((__m128i *) (out + i*4 + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+         _mm_storeu_si128((__m128i *) (out + i*4 + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+      }
+   }
+#endif
+#ifdef STBI__NEON_EXTRA
+   {
+      uint8x16x4_t o;
+      o.val[0] = o.val[1] = o.val[2] = vdupq_n_u8(0);
+      o.val[3] = vdupq_n_u8(255);
+      for (; i+15 < count; i += 16) {
+         for (k=0; k < n; ++k)
+            o.val[k] = vld1q_u8(plane[k] + i);
+         vst4q_u8(out + i*4, o);
+      }
+   }
+#endif
+   for (out += i*4; i < count; ++i, out += 4)
+      for (k=0; k < 4; ++k)
+         out[k] = k < n ? plane[k][i] : k == 3 ? 255 : 0;
+}
+
 static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    int pixelCount;
@@ -6017,10 +9633,10 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
    // Create the destination image.
 
    if (!compression && bitdepth == 16 && bpc == 16) {
-      out = (stbi_uc *) stbi__malloc_mad3(8, w, h, 0);
+      out = (stbi_uc *) stbi__malloc_mad3(s->alloc, 8, w, h, 0);
       ri->bits_per_channel = 16;
    } else
-      out = (stbi_uc *) stbi__malloc(4 * w*h);
+      out = (stbi_uc *) stbi__malloc(s->alloc, 4 * w*h);
 
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    pixelCount = w*h;
@@ -6054,7 +9670,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(s->alloc, out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -6063,35 +9679,42 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
    } else {
       // We're at the raw image data.  It's each channel in order (Red, Green, Blue, Alpha, ...)
       // where each channel consists of an 8-bit (or 16-bit) value for each pixel in the image.
+      int planes = channelCount < 4 ? channelCount : 4;
 
-      // Read the data by channel.
-      for (channel = 0; channel < 4; channel++) {
-         if (channel >= channelCount) {
-            // Fill this channel with default data.
-            if (bitdepth == 16 && bpc == 16) {
-               stbi__uint16 *q = ((stbi__uint16 *) out) + channel;
-               stbi__uint16 val = channel == 3 ? 65535 : 0;
-               for (i = 0; i < pixelCount; i++, q += 4)
-                  *q = val;
-            } else {
-               stbi_uc *p = out+channel;
-               stbi_uc val = channel == 3 ? 255 : 0;
-               for (i = 0; i < pixelCount; i++, p += 4)
-                  *p = val;
-            }
-         } else {
-            if (ri->bits_per_channel == 16) {    // output bpc
-               stbi__uint16 *q = ((stbi__uint16 *) out) + channel;
-               for (i = 0; i < pixelCount; i++, q += 4)
-                  *q = (stbi__uint16) stbi__get16be(s);
-            } else {
-               stbi_uc *p = out+channel;
-               if (bitdepth == 16) {  // input bpc
-                  for (i = 0; i < pixelCount; i++, p += 4)
-                     *p = (stbi_uc) (stbi__get16be(s) >> 8);
+      if (bitdepth == 8 && (size_t) (s->img_buffer_end - s->img_buffer) >= (size_t) pixelCount * planes) {
+         // the 8-bit channels we use are all in memory, so interleave them in one pass
+         stbi__psd_interleave(out, s->img_buffer, planes, pixelCount);
+         s->img_buffer += (size_t) pixelCount * planes;
+      } else {
+         // Read the data by channel.
+         for (channel = 0; channel < 4; channel++) {
+            if (channel >= channelCount) {
+               // Fill this channel with default data.
+               if (bitdepth == 16 && bpc == 16) {
+                  stbi__uint16 *q = ((stbi__uint16 *) out) + channel;
+                  stbi__uint16 val = channel == 3 ? 65535 : 0;
+                  for (i = 0; i < pixelCount; i++, q += 4)
+                     *q = val;
                } else {
+                  stbi_uc *p = out+channel;
+                  stbi_uc val = channel == 3 ? 255 : 0;
                   for (i = 0; i < pixelCount; i++, p += 4)
-                     *p = stbi__get8(s);
+                     *p = val;
+               }
+            } else {
+               if (ri->bits_per_channel == 16) {    // output bpc
+                  stbi__uint16 *q = ((stbi__uint16 *) out) + channel;
+                  for (i = 0; i < pixelCount; i++, q += 4)
+                     *q = (stbi__uint16) stbi__get16be(s);
+               } else {
+                  stbi_uc *p = out+channel;
+                  if (bitdepth == 16) {  // input bpc
+                     for (i = 0; i < pixelCount; i++, p += 4)
+                        *p = (stbi_uc) (stbi__get16be(s) >> 8);
+                  } else {
+                     for (i = 0; i < pixelCount; i++, p += 4)
+                        *p = stbi__get8(s);
+                  }
                }
             }
          }
@@ -6130,9 +9753,9 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
    // convert to desired output format
    if (req_comp && req_comp != 4) {
       if (ri->bits_per_channel == 16)
-         out = (stbi_uc *) stbi__convert_format16((stbi__uint16 *) out, 4, req_comp, w, h);
+         out = (stbi_uc *) stbi__convert_format16(s->alloc, (stbi__uint16 *) out, 4, req_comp, w, h);
       else
-         out = stbi__convert_format(out, 4, req_comp, w, h);
+         out = stbi__convert_format(s->alloc, out, 4, req_comp, w, h);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
    }
 
@@ -6341,17 +9964,17 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    stbi__get16be(s); //skip `pad'
 
    // intermediate buffer is RGBA
-   result = (stbi_uc *) stbi__malloc_mad3(x, y, 4, 0);
+   result = (stbi_uc *) stbi__malloc_mad3(s->alloc, x, y, 4, 0);
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(s->alloc, result);
       result=0;
    }
    *px = x;
    *py = y;
    if (req_comp == 0) req_comp = *comp;
-   result=stbi__convert_format(result,4,req_comp,x,y);
+   result=stbi__convert_format(s->alloc, result,4,req_comp,x,y);
 
    return result;
 }
@@ -6368,11 +9991,12 @@ static int stbi__pic_test(stbi__context *s)
 // GIF loader -- public domain by Jean-Marc Lienher -- simplified/shrunk by stb
 
 #ifndef STBI_NO_GIF
+// a code's string is always a copy of output already written, so a code is
+// just where that is and how long
 typedef struct
 {
-   stbi__int16 prefix;
-   stbi_uc first;
-   stbi_uc suffix;
+   stbi__int32 pos;
+   stbi__uint16 len;
 } stbi__gif_lzw;
 
 typedef struct
@@ -6384,7 +10008,6 @@ typedef struct
    int flags, bgindex, ratio, transparent, eflags;
    stbi_uc  pal[256][4];
    stbi_uc lpal[256][4];
-   stbi__gif_lzw codes[8192];
    stbi_uc *color_table;
    int parse, step;
    int lflags;
@@ -6456,62 +10079,70 @@ static int stbi__gif_header(stbi__context *s, stbi__gif *g, int *comp, int is_in
 
 static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
 {
-   stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
+   stbi__gif* g = (stbi__gif*) stbi__malloc(s->alloc, sizeof(stbi__gif));
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(s->alloc, g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(s->alloc, g);
    return 1;
 }
 
-static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
-{
-   stbi_uc *p, *c;
-   int idx;
-
-   // recurse to decode the prefixes, since the linked-list is backwards,
-   // and working backwards through an interleaved image would be nasty
-   if (g->codes[code].prefix >= 0)
-      stbi__out_gif_code(g, g->codes[code].prefix);
-
-   if (g->cur_y >= g->max_y) return;
-
-   idx = g->cur_x + g->cur_y;
-   p = &g->out[idx];
-   g->history[idx / 4] = 1;
-
-   c = &g->color_table[g->codes[code].suffix * 4];
-   if (c[3] > 128) { // don't render transparent pixels;
-      p[0] = c[2];
-      p[1] = c[1];
-      p[2] = c[0];
-      p[3] = c[3];
-   }
-   g->cur_x += 4;
-
-   if (g->cur_x >= g->max_x) {
-      g->cur_x = g->start_x;
-      g->cur_y += g->step;
-
-      while (g->cur_y >= g->max_y && g->parse > 0) {
-         g->step = (1 << g->parse) * g->line_size;
-         g->cur_y = g->start_y + (g->step >> 1);
-         --g->parse;
+// draw the first n pixels of a frame's decoded palette indices, in
+// raster (or interlace) order
+static void stbi__out_gif_pixels(stbi__gif *g, stbi_uc const *ind, int n)
+{
+   stbi_uc rgba[256][4];
+   int i, k;
+   for (i = 0; i < 256; ++i) {
+      stbi_uc *c = &g->color_table[i * 4];
+      rgba[i][0] = c[2];
+      rgba[i][1] = c[1];
+      rgba[i][2] = c[0];
+      rgba[i][3] = c[3];
+   }
+   while (n > 0 && g->cur_y < g->max_y) {
+      int idx = g->cur_x + g->cur_y;
+      int run = (g->max_x - g->cur_x) >> 2;
+      stbi_uc *p = &g->out[idx];
+      if (run > n) run = n;
+      memset(&g->history[idx / 4], 1, run);
+      for (k = 0; k < run; ++k, p += 4) {
+         stbi_uc const *c = rgba[ind[k]];
+         if (c[3] > 128) // don't render transparent pixels;
+            memcpy(p, c, 4);
+      }
+      ind += run;
+      n -= run;
+      g->cur_x += run * 4;
+
+      if (g->cur_x >= g->max_x) {
+         g->cur_x = g->start_x;
+         g->cur_y += g->step;
+
+         while (g->cur_y >= g->max_y && g->parse > 0) {
+            g->step = (1 << g->parse) * g->line_size;
+            g->cur_y = g->start_y + (g->step >> 1);
+            --g->parse;
+         }
       }
    }
 }
 
+// LZW-decode the frame's palette indices into a buffer first (each code is
+// then a copy of earlier output, no chain walking), then draw them
 static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
 {
    stbi_uc lzw_cs;
-   stbi__int32 len, init_code;
+   stbi__int32 len, size, dst, prev, prevlen;
    stbi__uint32 first;
    stbi__int32 codesize, codemask, avail, oldcode, bits, valid_bits, clear;
-   stbi__gif_lzw *p;
+   stbi__gif_lzw *codes, *p;
+   stbi_uc *ind, *out;
+   stbi_uc block[256], *bp, *bend;
 
    lzw_cs = stbi__get8(s);
    if (lzw_cs > 12) return NULL;
@@ -6521,32 +10152,39 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
    codemask = (1 << codesize) - 1;
    bits = 0;
    valid_bits = 0;
-   for (init_code = 0; init_code < clear; init_code++) {
-      g->codes[init_code].prefix = -1;
-      g->codes[init_code].first = (stbi_uc) init_code;
-      g->codes[init_code].suffix = (stbi_uc) init_code;
-   }
+
+   // pixels in the frame rectangle; anything decoded past that is dropped
+   size = g->cur_y < g->max_y ? ((g->max_x - g->start_x) >> 2) * ((g->max_y - g->start_y) / g->line_size) : 0;
+   codes = (stbi__gif_lzw *) stbi__malloc(s->alloc, 8192 * sizeof(*codes) + size);
+   if (!codes) return stbi__errpuc("outofmem", "Out of memory");
+   ind = (stbi_uc *) (codes + 8192);
+   dst = prev = prevlen = 0;
+   out = NULL;
 
    // support no starting clear code
    avail = clear+2;
    oldcode = -1;
 
    len = 0;
+   bp = bend = block;
    for(;;) {
       if (valid_bits < codesize) {
-         if (len == 0) {
+         if (bp == bend) {
             len = stbi__get8(s); // start new block
-            if (len == 0)
-               return g->out;
+            if (len == 0) {
+               out = g->out;
+               break;
+            }
+            stbi__get_block(s, block, len);
+            bp = block;
+            bend = block + len;
          }
-         --len;
-         bits |= (stbi__int32) stbi__get8(s) << valid_bits;
+         bits |= (stbi__int32) *bp++ << valid_bits;
          valid_bits += 8;
       } else {
          stbi__int32 code = bits & codemask;
          bits >>= codesize;
          valid_bits -= codesize;
-         // @OPTIMIZE: is there some way we can accelerate the non-clear path?
          if (code == clear) {  // clear code
             codesize = lzw_cs + 1;
             codemask = (1 << codesize) - 1;
@@ -6554,28 +10192,53 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
             oldcode = -1;
             first = 0;
          } else if (code == clear + 1) { // end of stream code
-            stbi__skip(s, len);
             while ((len = stbi__get8(s)) > 0)
                stbi__skip(s,len);
-            return g->out;
+            out = g->out;
+            break;
          } else if (code <= avail) {
+            stbi__int32 n;
             if (first) {
-               return stbi__errpuc("no clear code", "Corrupt GIF");
+               out = stbi__errpuc("no clear code", "Corrupt GIF");
+               break;
             }
 
             if (oldcode >= 0) {
-               p = &g->codes[avail++];
+               // the previous code's string plus the first byte of this one,
+               // which is where that was written
+               p = &codes[avail++];
                if (avail > 8192) {
-                  return stbi__errpuc("too many codes", "Corrupt GIF");
+                  out = stbi__errpuc("too many codes", "Corrupt GIF");
+                  break;
                }
+               p->pos = prev;
+               p->len = (stbi__uint16) (prevlen + 1);
+            } else if (code == avail) {
+               out = stbi__errpuc("illegal code in raster", "Corrupt GIF");
+               break;
+            }
 
-               p->prefix = (stbi__int16) oldcode;
-               p->first = g->codes[oldcode].first;
-               p->suffix = (code == avail) ? p->first : g->codes[code].first;
-            } else if (code == avail)
-               return stbi__errpuc("illegal code in raster", "Corrupt GIF");
-
-            stbi__out_gif_code(g, (stbi__uint16) code);
+            if (code < clear) {
+               n = 1;
+               if (dst < size) ind[dst] = (stbi_uc) code;
+            } else {
+               stbi_uc const *src = ind + codes[code].pos;
+               n = codes[code].len;
+               if (dst + n <= size) {
+                  // for a code defined just above from itself (KwKwK), the
+                  // last byte is the one the copy has just written
+                  memcpy(ind + dst, src, n - 1);
+                  ind[dst + n - 1] = src[n - 1];
+               } else if (dst < size) {
+                  stbi__int32 k;
+                  for (k = 0; k < size - dst; ++k)
+                     ind[dst + k] = src[k];
+               }
+            }
+            prev = dst;
+            prevlen = n;
+            dst += n;
+            if (dst > size) dst = size; // nothing more is written
 
             if ((avail & codemask) == 0 && avail <= 0x0FFF) {
                codesize++;
@@ -6584,15 +10247,19 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
 
             oldcode = code;
          } else {
-            return stbi__errpuc("illegal code in raster", "Corrupt GIF");
+            out = stbi__errpuc("illegal code in raster", "Corrupt GIF");
+            break;
          }
       }
    }
+
+   if (out) stbi__out_gif_pixels(g, ind, dst);
+   stbi__free(s->alloc, codes);
+   return out;
 }
 
 // this function is designed to support animated gifs, although stb_image doesn't support it
-// two back is the image from two frames ago, used for a very specific disposal format
-static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, int req_comp, stbi_uc *two_back)
+static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, int req_comp)
 {
    int dispose;
    int first_frame;
@@ -6607,9 +10274,9 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
       if (!stbi__mad3sizes_valid(4, g->w, g->h, 0))
          return stbi__errpuc("too large", "GIF image is too large");
       pcount = g->w * g->h;
-      g->out = (stbi_uc *) stbi__malloc(4 * pcount);
-      g->background = (stbi_uc *) stbi__malloc(4 * pcount);
-      g->history = (stbi_uc *) stbi__malloc(pcount);
+      g->out = (stbi_uc *) stbi__malloc(s->alloc, 4 * pcount);
+      g->background = (stbi_uc *) stbi__malloc(s->alloc, 4 * pcount);
+      g->history = (stbi_uc *) stbi__malloc(s->alloc, pcount);
       if (!g->out || !g->background || !g->history)
          return stbi__errpuc("outofmem", "Out of memory");
 
@@ -6625,17 +10292,10 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
       dispose = (g->eflags & 0x1C) >> 2;
       pcount = g->w * g->h;
 
-      if ((dispose == 3) && (two_back == 0)) {
-         dispose = 2; // if I don't have an image to revert back to, default to the old background
-      }
-
-      if (dispose == 3) { // use previous graphic
-         for (pi = 0; pi < pcount; ++pi) {
-            if (g->history[pi]) {
-               memcpy( &g->out[pi * 4], &two_back[pi * 4], 4 );
-            }
-         }
-      } else if (dispose == 2) {
+      // 3 (restore to previous) means the canvas as it was before the last
+      // frame was drawn, which is just what background holds, so it's the
+      // same as 2 here
+      if (dispose == 2 || dispose == 3) {
          // restore what was changed last frame to background before that frame;
          for (pi = 0; pi < pcount; ++pi) {
             if (g->history[pi]) {
@@ -6772,7 +10432,6 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       int layers = 0;
       stbi_uc *u = 0;
       stbi_uc *out = 0;
-      stbi_uc *two_back = 0;
       stbi__gif g;
       int stride;
       int out_size = 0;
@@ -6783,7 +10442,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       }
 
       do {
-         u = stbi__gif_load_next(s, &g, comp, req_comp, two_back);
+         u = stbi__gif_load_next(s, &g, comp, req_comp);
          if (u == (stbi_uc *) s) u = 0;  // end of animated gif marker
 
          if (u) {
@@ -6793,11 +10452,11 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4;
 
             if (out) {
-               void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
+               void *tmp = (stbi_uc*) stbi__realloc_sized(s->alloc, out, out_size, layers * stride );
                if (NULL == tmp) {
-                  STBI_FREE(g.out);
-                  STBI_FREE(g.history);
-                  STBI_FREE(g.background);
+                  stbi__free(s->alloc, g.out);
+                  stbi__free(s->alloc, g.history);
+                  stbi__free(s->alloc, g.background);
                   return stbi__errpuc("outofmem", "Out of memory");
                }
                else {
@@ -6806,21 +10465,18 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                }
 
                if (delays) {
-                  *delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
+                  *delays = (int*) stbi__realloc_sized(s->alloc, *delays, delays_size, sizeof(int) * layers );
                   delays_size = layers * sizeof(int);
                }
             } else {
-               out = (stbi_uc*)stbi__malloc( layers * stride );
+               out = (stbi_uc*)stbi__malloc(s->alloc, layers * stride );
                out_size = layers * stride;
                if (delays) {
-                  *delays = (int*) stbi__malloc( layers * sizeof(int) );
+                  *delays = (int*) stbi__malloc(s->alloc, layers * sizeof(int) );
                   delays_size = layers * sizeof(int);
                }
             }
             memcpy( out + ((layers - 1) * stride), u, stride );
-            if (layers >= 2) {
-               two_back = out - 2 * stride;
-            }
 
             if (delays) {
                (*delays)[layers - 1U] = g.delay;
@@ -6829,13 +10485,13 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__free(s->alloc, g.out);
+      stbi__free(s->alloc, g.history);
+      stbi__free(s->alloc, g.background);
 
       // do the final conversion after loading everything;
       if (req_comp && req_comp != 4)
-         out = stbi__convert_format(out, 4, req_comp, layers * g.w, g.h);
+         out = stbi__convert_format(s->alloc, out, 4, req_comp, layers * g.w, g.h);
 
       *z = layers;
       return out;
@@ -6851,7 +10507,7 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
    memset(&g, 0, sizeof(g));
    STBI_NOTUSED(ri);
 
-   u = stbi__gif_load_next(s, &g, comp, req_comp, 0);
+   u = stbi__gif_load_next(s, &g, comp, req_comp);
    if (u == (stbi_uc *) s) u = 0;  // end of animated gif marker
    if (u) {
       *x = g.w;
@@ -6860,15 +10516,15 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
       // moved conversion to after successful load so that the same
       // can be done for multiple frames.
       if (req_comp && req_comp != 4)
-         u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
+         u = stbi__convert_format(s->alloc, u, 4, req_comp, g.w, g.h);
    } else if (g.out) {
       // if there was an error and we allocated an image buffer, free it!
-      STBI_FREE(g.out);
+      stbi__free(s->alloc, g.out);
    }
 
    // free buffers needed for multiple frame loading;
-   STBI_FREE(g.history);
-   STBI_FREE(g.background);
+   stbi__free(s->alloc, g.history);
+   stbi__free(s->alloc, g.background);
 
    return u;
 }
@@ -6877,6 +10533,144 @@ static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
    return stbi__gif_info_raw(s,x,y,comp);
 }
+
+enum
+{
+   STBI__GIF_FRAMES_first, // the first frame was decoded by open and not returned yet
+   STBI__GIF_FRAMES_more,
+   STBI__GIF_FRAMES_done
+};
+
+// Only the state stbi__gif_load_next carries between frames is kept (the
+// canvas, the background it's disposed to and the per-pixel history), plus
+// one converted or flipped frame if desired_channels isn't 4 or flip is set.
+struct stbi__gif_frames
+{
+   stbi__context s;
+   stbi__gif g;
+   int req_comp, state, flip;
+   stbi_uc *frame;
+   #ifndef STBI_NO_STDIO
+   FILE *f;
+   #endif
+};
+
+STBIDEF void stbi_gif_close(stbi_gif_frames *gf)
+{
+   if (!gf) return;
+   stbi__free(NULL, gf->g.out);
+   stbi__free(NULL, gf->g.background);
+   stbi__free(NULL, gf->g.history);
+   stbi__free(NULL, gf->frame);
+   #ifndef STBI_NO_STDIO
+   if (gf->f) fclose(gf->f);
+   #endif
+   stbi__free(NULL, gf);
+}
+
+// gf->s has been set up by the caller; frees gf on failure
+static stbi_gif_frames *stbi__gif_open(stbi_gif_frames *gf, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_uc *u;
+   int n;
+   if (req_comp < 0 || req_comp > 4) {
+      stbi_gif_close(gf);
+      return stbi__errp(stbi_gif_frames, "bad req_comp", "Internal error");
+   }
+   if (!stbi__gif_test(&gf->s)) {
+      stbi_gif_close(gf);
+      return stbi__errp(stbi_gif_frames, "not GIF", "Image was not as a gif type.");
+   }
+   gf->req_comp = req_comp;
+   u = stbi__gif_load_next(&gf->s, &gf->g, &n, req_comp);
+   if (!u) {
+      stbi_gif_close(gf);
+      return NULL;
+   }
+   gf->state = u == (stbi_uc *) &gf->s ? STBI__GIF_FRAMES_done : STBI__GIF_FRAMES_first;
+   gf->flip = stbi__vertically_flip_on_load;
+   if ((req_comp && req_comp != 4) || gf->flip) {
+      gf->frame = (stbi_uc *) stbi__malloc_mad3(NULL, gf->g.w, gf->g.h, req_comp ? req_comp : 4, 0);
+      if (!gf->frame) {
+         stbi_gif_close(gf);
+         return stbi__errp(stbi_gif_frames, "outofmem", "Out of memory");
+      }
+   }
+   *x = gf->g.w;
+   *y = gf->g.h;
+   if (comp) *comp = 4;
+   return gf;
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_open_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_frames *gf = (stbi_gif_frames *) stbi__malloc(NULL, sizeof(*gf));
+   if (!gf) return stbi__errp(stbi_gif_frames, "outofmem", "Out of memory");
+   memset(gf, 0, sizeof(*gf));
+   stbi__start_mem(&gf->s,buffer,len);
+   return stbi__gif_open(gf,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_open_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_frames *gf = (stbi_gif_frames *) stbi__malloc(NULL, sizeof(*gf));
+   if (!gf) return stbi__errp(stbi_gif_frames, "outofmem", "Out of memory");
+   memset(gf, 0, sizeof(*gf));
+   stbi__start_callbacks(&gf->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__gif_open(gf,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_open(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_frames *gf;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errp(stbi_gif_frames, "can't fopen", "Unable to open file");
+   gf = (stbi_gif_frames *) stbi__malloc(NULL, sizeof(*gf));
+   if (!gf) {
+      fclose(f);
+      return stbi__errp(stbi_gif_frames, "outofmem", "Out of memory");
+   }
+   memset(gf, 0, sizeof(*gf));
+   gf->f = f; // stays open until stbi_gif_close
+   stbi__start_file(&gf->s,f);
+   return stbi__gif_open(gf,x,y,comp,req_comp);
+}
+#endif
+
+STBIDEF int stbi_gif_next_frame(stbi_gif_frames *gf, stbi_uc const **frame, int *delay_ms)
+{
+   stbi_uc *u = gf->g.out;
+   int n;
+   if (gf->state == STBI__GIF_FRAMES_done) return 0;
+   if (gf->state == STBI__GIF_FRAMES_first)
+      gf->state = STBI__GIF_FRAMES_more;
+   else {
+      u = stbi__gif_load_next(&gf->s, &gf->g, &n, gf->req_comp);
+      if (u == (stbi_uc *) &gf->s || !u) {
+         gf->state = STBI__GIF_FRAMES_done;
+         return u ? 0 : -1;
+      }
+   }
+   if (gf->frame) {
+      // the canvas itself is kept as is for composing the next frame
+      int out_n = gf->req_comp ? gf->req_comp : 4, w = gf->g.w, h = gf->g.h, row;
+      if (!gf->flip)
+         stbi__convert_format_row(gf->frame, u, 4, out_n, w * h);
+      else
+         for (row=0; row < h; ++row) {
+            stbi_uc *dest = gf->frame + (size_t) (h-1-row) * w * out_n;
+            if (out_n == 4)
+               memcpy(dest, u + (size_t) row * w * 4, (size_t) w * 4);
+            else
+               stbi__convert_format_row(dest, u + (size_t) row * w * 4, 4, out_n, w);
+         }
+      u = gf->frame;
+   }
+   *frame = u;
+   if (delay_ms) *delay_ms = gf->g.delay;
+   return 1;
+}
 #endif
 
 // *************************************************************************************************
@@ -6927,12 +10721,22 @@ static char *stbi__hdr_gettoken(stbi__context *z, char *buffer)
    return buffer;
 }
 
+// 2^(e-136), the scale for an RGBE exponent byte e > 0, built from the float's
+// bits instead of calling ldexp; exponents below 10 give a denormal
+static float stbi__hdr_scale(int e)
+{
+   stbi__uint32 bits = e >= 10 ? (stbi__uint32) (e - 9) << 23 : (stbi__uint32) 1 << (e + 13);
+   float f;
+   memcpy(&f, &bits, 4);
+   return f;
+}
+
 static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
 {
    if ( input[3] != 0 ) {
       float f1;
       // Exponent
-      f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
+      f1 = stbi__hdr_scale(input[3]);
       if (req_comp <= 2)
          output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
       else {
@@ -6954,6 +10758,87 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
+#ifdef STBI_SSE2
+// stbi__hdr_convert on 8 pixels at a time of a planar scanline (see below);
+// returns how many pixels it converted
+static int stbi__hdr_convert_planar_sse2(float *output, stbi_uc const *scanline, int width, int req_comp)
+{
+   int i = 0, k;
+   __m128i zero = _mm_setzero_si128();
+   __m128 one = _mm_set1_ps(1.0f), three = _mm_set1_ps(3.0f);
+   __m128 tiny = _mm_castsi128_ps(_mm_set1_epi32(63 << 23)); // 2^-64
+   for (; i+7 < width; i += 8) {
+      __m128i r16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (scanline + i)), zero);
+      __m128i g16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (scanline + width + i)), zero);
+      __m128i b16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (scanline + width*2 + i)), zero);
+      __m128i e16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (scanline + width*3 + i)), zero);
+      for (k = 0; k < 2; ++k) {
+         __m128i r = k ? _mm_unpackhi_epi16(r16, zero) : _mm_unpacklo_epi16(r16, zero);
+         __m128i g = k ? _mm_unpackhi_epi16(g16, zero) : _mm_unpacklo_epi16(g16, zero);
+         __m128i b = k ? _mm_unpackhi_epi16(b16, zero) : _mm_unpacklo_epi16(b16, zero);
+         __m128i e = k ? _mm_unpackhi_epi16(e16, zero) : _mm_unpacklo_epi16(e16, zero);
+         // 2^(e-136) as in stbi__hdr_scale; exponents below 10 use 2^(e-72)
+         // and a second multiply by 2^-64, which still rounds only once
+         __m128i small = _mm_cmplt_epi32(e, _mm_set1_epi32(10));
+         __m128i bits = _mm_or_si128(_mm_and_si128(small, _mm_slli_epi32(_mm_add_epi32(e, _mm_set1_epi32(55)), 23)),
+                                     _mm_andnot_si128(small, _mm_slli_epi32(_mm_sub_epi32(e, _mm_set1_epi32(9)), 23)));
+         __m128 scale = _mm_castsi128_ps(bits);
+         __m128 post = _mm_or_ps(_mm_and_ps(_mm_castsi128_ps(small), tiny), _mm_andnot_ps(_mm_castsi128_ps(small), one));
+         __m128 nonzero = _mm_castsi128_ps(_mm_cmpgt_epi32(e, zero));
+         float *o = output + (i + k*4) * req_comp;
+         if (req_comp <= 2) {
+            __m128 l = _mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(r, g), b));
+            l = _mm_and_ps(_mm_div_ps(_mm_mul_ps(_mm_mul_ps(l, scale), post), three), nonzero);
+            if (req_comp == 1) {
+               _mm_storeu_ps(o, l);
+            } else {
+               _mm_storeu_ps(o    , _mm_unpacklo_ps(l, one));
+               _mm_storeu_ps(o + 4, _mm_unpackhi_ps(l, one));
+            }
+         } else {
+            __m128 rf = _mm_and_ps(_mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(r), scale), post), nonzero);
+            __m128 gf = _mm_and_ps(_mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(g), scale), post), nonzero);
+            __m128 bf = _mm_and_ps(_mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(b), scale), post), nonzero);
+            __m128 rg_lo = _mm_unpacklo_ps(rf, gf), rg_hi = _mm_unpackhi_ps(rf, gf);
+            if (req_comp == 4) {
+               __m128 ba_lo = _mm_unpacklo_ps(bf, one), ba_hi = _mm_unpackhi_ps(bf, one);
+               _mm_storeu_ps(o     , _mm_movelh_ps(rg_lo, ba_lo));
+               _mm_storeu_ps(o +  4, _mm_movehl_ps(ba_lo, rg_lo));
+               _mm_storeu_ps(o +  8, _mm_movelh_ps(rg_hi, ba_hi));
+               _mm_storeu_ps(o + 12, _mm_movehl_ps(ba_hi, rg_hi));
+            } else {
+               __m128 br_lo = _mm_unpacklo_ps(bf, rf), br_hi = _mm_unpackhi_ps(bf, rf);
+               __m128 gb_lo = _mm_unpacklo_ps(gf, bf), gb_hi = _mm_unpackhi_ps(gf, bf);
+               _mm_storeu_ps(o    , _mm_shuffle_ps(rg_lo, br_lo, _MM_SHUFFLE(3,0,1,0)));
+               _mm_storeu_ps(o + 4, _mm_shuffle_ps(gb_lo, rg_hi, _MM_SHUFFLE(1,0,3,2)));
+               _mm_storeu_ps(o + 8, _mm_shuffle_ps(br_hi, gb_hi, _MM_SHUFFLE(3,2,3,0)));
+            }
+         }
+      }
+   }
+   return i;
+}
+#endif
+
+// convert an RLE-decoded scanline, stored as four planes of width bytes
+// (all R, then G, B and E), to req_comp floats per pixel
+static void stbi__hdr_convert_planar(float *output, stbi_uc const *scanline, int width, int req_comp)
+{
+   stbi_uc rgbe[4];
+   int i = 0;
+   #ifdef STBI_SSE2
+   if (stbi__sse2_available())
+      i = stbi__hdr_convert_planar_sse2(output, scanline, width, req_comp);
+   #endif
+   for (; i < width; ++i) {
+      rgbe[0] = scanline[i];
+      rgbe[1] = scanline[width   + i];
+      rgbe[2] = scanline[width*2 + i];
+      rgbe[3] = scanline[width*3 + i];
+      stbi__hdr_convert(output + i*req_comp, rgbe, req_comp);
+   }
+}
+
 static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    char buffer[STBI__HDR_BUFLEN];
@@ -6964,9 +10849,8 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
    float *hdr_data;
    int len;
    unsigned char count, value;
-   int i, j, k, c1,c2, z;
+   int i, j, k, c1,c2;
    const char *headerToken;
-   STBI_NOTUSED(ri);
 
    // Check identifier
    headerToken = stbi__hdr_gettoken(s,buffer);
@@ -7006,20 +10890,21 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
       return stbi__errpf("too large", "HDR image is too large");
 
    // Read data
-   hdr_data = (float *) stbi__malloc_mad4(width, height, req_comp, sizeof(float), 0);
+   hdr_data = (float *) stbi__malloc_mad4(s->alloc, width, height, req_comp, sizeof(float), 0);
    if (!hdr_data)
       return stbi__errpf("outofmem", "Out of memory");
 
-   // Load image data
+   // Load image data, bottom-up if s->flip is set
    // image data is stored as some number of sca
+   ri->flipped = s->flip;
    if ( width < 8 || width >= 32768) {
       // Read flat data
       for (j=0; j < height; ++j) {
          for (i=0; i < width; ++i) {
             stbi_uc rgbe[4];
            main_decode_loop:
-            stbi__getn(s, rgbe, 4);
-            stbi__hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
+            stbi__get_block(s, rgbe, 4);
+            stbi__hdr_convert(hdr_data + ((s->flip ? height-1-j : j) * width + i) * req_comp, rgbe, req_comp);
          }
       }
    } else {
@@ -7038,24 +10923,27 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             rgbe[1] = (stbi_uc) c2;
             rgbe[2] = (stbi_uc) len;
             rgbe[3] = (stbi_uc) stbi__get8(s);
-            stbi__hdr_convert(hdr_data, rgbe, req_comp);
+            stbi__hdr_convert(hdr_data + (s->flip ? (height-1) * width * req_comp : 0), rgbe, req_comp);
             i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            stbi__free(s->alloc, scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(s->alloc, hdr_data); stbi__free(s->alloc, scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) {
-            scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
+            scanline = (stbi_uc *) stbi__malloc_mad2(s->alloc, width, 4, 0);
             if (!scanline) {
-               STBI_FREE(hdr_data);
+               stbi__free(s->alloc, hdr_data);
                return stbi__errpf("outofmem", "Out of memory");
             }
          }
 
+         // decode each component into its own plane of the scanline, so runs
+         // are a memset and dumps a straight copy
          for (k = 0; k < 4; ++k) {
+            stbi_uc *plane = scanline + k*width;
             int nleft;
             i = 0;
             while ((nleft = width - i) > 0) {
@@ -7064,22 +10952,20 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   // Run
                   value = stbi__get8(s);
                   count -= 128;
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = value;
+                  if (count > nleft) { stbi__free(s->alloc, hdr_data); stbi__free(s->alloc, scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  memset(plane + i, value, count);
                } else {
-                  // Dump
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = stbi__get8(s);
+                  // Dump (an empty one would never finish the scanline at EOF)
+                  if (count == 0 || count > nleft) { stbi__free(s->alloc, hdr_data); stbi__free(s->alloc, scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  stbi__get_block(s, plane + i, count);
                }
+               i += count;
             }
          }
-         for (i=0; i < width; ++i)
-            stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         stbi__hdr_convert_planar(hdr_data + (s->flip ? height-1-j : j)*width*req_comp, scanline, width, req_comp);
       }
       if (scanline)
-         STBI_FREE(scanline);
+         stbi__free(s->alloc, scanline);
    }
 
    return hdr_data;
@@ -7320,12 +11206,12 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!stbi__mad3sizes_valid(s->img_n, s->img_x, s->img_y, 0))
       return stbi__errpuc("too large", "PNM too large");
 
-   out = (stbi_uc *) stbi__malloc_mad3(s->img_n, s->img_x, s->img_y, 0);
+   out = (stbi_uc *) stbi__malloc_mad3(s->alloc, s->img_n, s->img_x, s->img_y, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    stbi__getn(s, out, s->img_n * s->img_x * s->img_y);
 
    if (req_comp && req_comp != s->img_n) {
-      out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
+      out = stbi__convert_format(s->alloc, out, s->img_n, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
    }
    return out;
@@ -7406,38 +11292,345 @@ static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
 }
 #endif
 
+// row-at-a-time decoding
+
+enum
+{
+   STBI__STREAM_image, // decoded whole up front, rows are copied out of it
+   STBI__STREAM_jpeg,
+   STBI__STREAM_png
+};
+
+struct stbi__stream
+{
+   stbi__context s;
+   int x, y, out_n, row, type;
+   int region[4];     // x,y,w,h requested before opening; w == 0: none
+   int win_x0, win_w; // columns the decoder's rows hold
+   stbi_uc *image;
+   #ifndef STBI_NO_STDIO
+   FILE *f;
+   #endif
+   #ifndef STBI_NO_JPEG
+   stbi__jpeg_stream jpeg;
+   #endif
+   #ifndef STBI_NO_PNG
+   stbi__png_stream png;
+   #endif
+};
+
+static void stbi__stream_free(stbi_stream *st)
+{
+   #ifndef STBI_NO_JPEG
+   if (st->type == STBI__STREAM_jpeg) stbi__jpeg_stream_end(&st->jpeg);
+   #endif
+   #ifndef STBI_NO_PNG
+   if (st->type == STBI__STREAM_png) stbi__png_stream_end(&st->png);
+   #endif
+   #ifndef STBI_NO_STDIO
+   if (st->f) fclose(st->f);
+   #endif
+   stbi__free(st->s.alloc, st->image);
+   stbi__free(st->s.alloc, st);
+}
+
+// st->s has been set up by the caller; frees st on failure
+static stbi_stream *stbi__stream_open(stbi_stream *st, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context *s = &st->s;
+   int n;
+   st->row = 0;
+   st->type = STBI__STREAM_image;
+   st->image = NULL;
+   if (req_comp < 0 || req_comp > 4) {
+      stbi__stream_free(st);
+      return stbi__errp(stbi_stream, "bad req_comp", "Internal error");
+   }
+
+   #ifndef STBI_NO_JPEG
+   if (stbi__jpeg_test(s)) {
+      st->type = STBI__STREAM_jpeg;
+      if (!stbi__jpeg_stream_begin(&st->jpeg, s, req_comp, st->region)) goto fail;
+      n = s->img_n >= 3 ? 3 : 1; // as stbi__jpeg_load reports it, e.g. CMYK comes out as RGB
+   } else
+   #endif
+   #ifndef STBI_NO_PNG
+   if (stbi__png_test(s)) {
+      st->type = STBI__STREAM_png;
+      if (!stbi__png_stream_begin(&st->png, s, req_comp, &n, &st->image)) goto fail;
+      if (st->image) {
+         // interlaced, so it was decoded whole
+         stbi__png_stream_end(&st->png);
+         st->type = STBI__STREAM_image;
+      }
+   } else
+   #endif
+   {
+      stbi__result_info ri;
+      st->image = (stbi_uc *) stbi__load_main(s, &st->x, &st->y, &n, req_comp, &ri, 8);
+      if (!st->image) goto fail;
+      if (ri.bits_per_channel != 8) {
+         st->image = stbi__convert_16_to_8(s->alloc, (stbi__uint16 *) st->image, st->x, st->y, req_comp ? req_comp : n);
+         if (!st->image) goto fail;
+      }
+      s->img_x = st->x;
+      s->img_y = st->y;
+   }
+
+   st->x = s->img_x;
+   st->y = s->img_y;
+   st->out_n = req_comp ? req_comp : n;
+   st->win_x0 = 0;
+   st->win_w = st->x;
+   #ifndef STBI_NO_JPEG
+   if (st->type == STBI__STREAM_jpeg) {
+      st->win_x0 = st->jpeg.o.x0;
+      st->win_w = st->jpeg.o.w;
+   }
+   #endif
+   *x = st->x;
+   *y = st->y;
+   if (comp) *comp = n;
+   return st;
+
+fail:
+   stbi__stream_free(st);
+   return NULL;
+}
+
+STBIDEF stbi_stream *stbi_stream_open_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_stream *st = (stbi_stream *) stbi__malloc(NULL, sizeof(*st));
+   if (!st) return stbi__errp(stbi_stream, "outofmem", "Out of memory");
+   memset(st, 0, sizeof(*st));
+   stbi__start_mem(&st->s,buffer,len);
+   return stbi__stream_open(st,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_stream *stbi_stream_open_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_stream *st = (stbi_stream *) stbi__malloc(NULL, sizeof(*st));
+   if (!st) return stbi__errp(stbi_stream, "outofmem", "Out of memory");
+   memset(st, 0, sizeof(*st));
+   stbi__start_callbacks(&st->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__stream_open(st,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_stream *stbi_stream_open(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_stream *st;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errp(stbi_stream, "can't fopen", "Unable to open file");
+   st = (stbi_stream *) stbi__malloc(NULL, sizeof(*st));
+   if (!st) {
+      fclose(f);
+      return stbi__errp(stbi_stream, "outofmem", "Out of memory");
+   }
+   memset(st, 0, sizeof(*st));
+   st->f = f; // stays open until stbi_stream_close
+   stbi__start_file(&st->s,f);
+   return stbi__stream_open(st,x,y,comp,req_comp);
+}
+#endif
+
+// the next row into dest, win_w pixels wide; or skip it if dest is NULL
+static int stbi__stream_row(stbi_stream *st, stbi_uc *dest)
+{
+   int ok = 1, row_bytes = st->x * st->out_n;
+   switch (st->type) {
+      #ifndef STBI_NO_JPEG
+      case STBI__STREAM_jpeg: ok = stbi__jpeg_stream_row(&st->jpeg, dest); break;
+      #endif
+      #ifndef STBI_NO_PNG
+      case STBI__STREAM_png: ok = stbi__png_stream_row(&st->png, dest); break;
+      #endif
+      default: if (dest) memcpy(dest, st->image + (size_t) row_bytes * st->row, row_bytes); break;
+   }
+   if (!ok) {
+      st->row = st->y; // no more rows after an error
+      return 0;
+   }
+   ++st->row;
+   return 1;
+}
+
+STBIDEF int stbi_stream_read_rows(stbi_stream *st, stbi_uc *out, int out_stride, int max_rows)
+{
+   int i;
+   if (out_stride == 0) out_stride = st->x * st->out_n;
+   for (i=0; i < max_rows && st->row < st->y; ++i)
+      if (!stbi__stream_row(st, out + (size_t) out_stride * i))
+         return -1;
+   return i;
+}
+
+STBIDEF void stbi_stream_close(stbi_stream *st)
+{
+   if (st) stbi__stream_free(st);
+}
+
+// decode straight into the caller's buffer, a row at a time
+static int stbi__load_into(stbi_stream *st, stbi_uc *out, int out_stride, size_t out_size)
+{
+   int i, x, y, row_bytes, flip = stbi__vertically_flip_on_load;
+   if (!st) return 0;
+   x = st->x;
+   y = st->y;
+   row_bytes = x * st->out_n;
+   if (out_stride == 0) out_stride = row_bytes;
+   if (out_stride < row_bytes || (size_t) out_stride * (y-1) + row_bytes > out_size) {
+      stbi_stream_close(st);
+      return stbi__err("buffer too small", "Output buffer too small for image");
+   }
+   for (i=0; i < y; ++i) {
+      if (stbi_stream_read_rows(st, out + (size_t) out_stride * (flip ? y-1-i : i), 0, 1) != 1) {
+         stbi_stream_close(st);
+         return 0;
+      }
+   }
+   stbi_stream_close(st);
+   return 1;
+}
+
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_stride, size_t out_size)
+{
+   return stbi__load_into(stbi_stream_open_from_memory(buffer,len,x,y,comp,req_comp), out, out_stride, out_size);
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_stride, size_t out_size)
+{
+   return stbi__load_into(stbi_stream_open_from_callbacks(clbk,user,x,y,comp,req_comp), out, out_stride, out_size);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_stride, size_t out_size)
+{
+   return stbi__load_into(stbi_stream_open(filename,x,y,comp,req_comp), out, out_stride, out_size);
+}
+#endif
+
+// decode the rows down to the bottom of the region, keeping only its columns;
+// st has been set up by the caller but not opened, and is freed
+static stbi_uc *stbi__load_region(stbi_stream *st, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_uc *out, *row;
+   int i, w, h, n, flip = stbi__vertically_flip_on_load;
+   if (!st) return NULL;
+   if (rx < 0) { rw += rx; rx = 0; }
+   if (ry < 0) { rh += ry; ry = 0; }
+   if (rw <= 0 || rh <= 0) {
+      stbi__stream_free(st);
+      return stbi__errpuc("bad region", "Region is empty");
+   }
+   st->region[0] = rx;
+   st->region[1] = ry;
+   st->region[2] = rw;
+   st->region[3] = rh;
+   if (!stbi__stream_open(st, &w, &h, comp, req_comp)) return NULL;
+   if (rx >= w || ry >= h) {
+      stbi_stream_close(st);
+      return stbi__errpuc("bad region", "Region is outside the image");
+   }
+   if (rw > w - rx) rw = w - rx;
+   if (rh > h - ry) rh = h - ry;
+   n = st->out_n;
+   out = (stbi_uc *) stbi__malloc_mad3(NULL, rw, rh, n, 0);
+   row = (stbi_uc *) stbi__malloc_mad3(NULL, st->win_w, n, 1, 0);
+   if (!out || !row) {
+      stbi__free(NULL, out);
+      stbi__free(NULL, row);
+      stbi_stream_close(st);
+      return stbi__errpuc("outofmem", "Out of memory");
+   }
+   for (i=0; i < ry + rh; ++i) {
+      if (!stbi__stream_row(st, i < ry ? NULL : row)) {
+         stbi__free(NULL, out);
+         out = NULL;
+         break;
+      }
+      if (i >= ry)
+         memcpy(out + (size_t) rw * n * (flip ? ry+rh-1-i : i-ry), row + (size_t) (rx - st->win_x0) * n, (size_t) rw * n);
+   }
+   stbi__free(NULL, row);
+   stbi_stream_close(st); // the rest of the image is never decoded
+   if (out) {
+      *x = rw;
+      *y = rh;
+   }
+   return out;
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_memory(stbi_uc const *buffer, int len, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_stream *st = (stbi_stream *) stbi__malloc(NULL, sizeof(*st));
+   if (!st) return stbi__errpuc("outofmem", "Out of memory");
+   memset(st, 0, sizeof(*st));
+   stbi__start_mem(&st->s,buffer,len);
+   return stbi__load_region(st,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk, void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_stream *st = (stbi_stream *) stbi__malloc(NULL, sizeof(*st));
+   if (!st) return stbi__errpuc("outofmem", "Out of memory");
+   memset(st, 0, sizeof(*st));
+   stbi__start_callbacks(&st->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_region(st,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_stream *st;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   st = (stbi_stream *) stbi__malloc(NULL, sizeof(*st));
+   if (!st) {
+      fclose(f);
+      return stbi__errpuc("outofmem", "Out of memory");
+   }
+   memset(st, 0, sizeof(*st));
+   st->f = f;
+   stbi__start_file(&st->s,f);
+   return stbi__load_region(st,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+#endif
+
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 {
+   int fmt = stbi__sniff(s);
+
    #ifndef STBI_NO_JPEG
-   if (stbi__jpeg_info(s, x, y, comp)) return 1;
+   if ((fmt & STBI__FMT_JPEG) && stbi__jpeg_info(s, x, y, comp)) return 1;
    #endif
 
    #ifndef STBI_NO_PNG
-   if (stbi__png_info(s, x, y, comp))  return 1;
+   if ((fmt & STBI__FMT_PNG) && stbi__png_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_GIF
-   if (stbi__gif_info(s, x, y, comp))  return 1;
+   if ((fmt & STBI__FMT_GIF) && stbi__gif_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_BMP
-   if (stbi__bmp_info(s, x, y, comp))  return 1;
+   if ((fmt & STBI__FMT_BMP) && stbi__bmp_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_PSD
-   if (stbi__psd_info(s, x, y, comp))  return 1;
+   if ((fmt & STBI__FMT_PSD) && stbi__psd_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_PIC
-   if (stbi__pic_info(s, x, y, comp))  return 1;
+   if ((fmt & STBI__FMT_PIC) && stbi__pic_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_PNM
-   if (stbi__pnm_info(s, x, y, comp))  return 1;
+   if ((fmt & STBI__FMT_PNM) && stbi__pnm_info(s, x, y, comp))  return 1;
    #endif
 
    #ifndef STBI_NO_HDR
-   if (stbi__hdr_info(s, x, y, comp))  return 1;
+   if ((fmt & STBI__FMT_HDR) && stbi__hdr_info(s, x, y, comp))  return 1;
    #endif
 
    // test tga last because it's a crappy test!
@@ -7445,25 +11638,31 @@ static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
    if (stbi__tga_info(s, x, y, comp))
        return 1;
    #endif
+   STBI_NOTUSED(fmt);
    return stbi__err("unknown image type", "Image not of any known type, or corrupt");
 }
 
 static int stbi__is_16_main(stbi__context *s)
 {
+   int fmt = stbi__sniff(s);
+
    #ifndef STBI_NO_PNG
-   if (stbi__png_is16(s))  return 1;
+   if ((fmt & STBI__FMT_PNG) && stbi__png_is16(s))  return 1;
    #endif
 
    #ifndef STBI_NO_PSD
-   if (stbi__psd_is16(s))  return 1;
+   if ((fmt & STBI__FMT_PSD) && stbi__psd_is16(s))  return 1;
    #endif
 
+   STBI_NOTUSED(fmt);
    return 0;
 }
 
 #ifndef STBI_NO_STDIO
 STBIDEF int stbi_info(char const *filename, int *x, int *y, int *comp)
 {
+    // not mapped: setting up and tearing down a mapping costs more than the
+    // one buffered read that usually covers the header
     FILE *f = stbi__fopen(filename, "rb");
     int result;
     if (!f) return stbi__err("can't fopen", "Unable to open file");
@@ -7503,6 +11702,43 @@ STBIDEF int stbi_is_16_bit_from_file(FILE *f)
    fseek(f,pos,SEEK_SET);
    return r;
 }
+
+typedef struct
+{
+   char const * const *filenames;
+   stbi_info_result *results;
+} stbi__info_many;
+
+static void stbi__info_many_task(void *data, int i)
+{
+   stbi__info_many *m = (stbi__info_many *) data;
+   stbi_info_result *r = &m->results[i];
+   // the failure reason is per-thread when STBI_THREAD_LOCAL is available,
+   // so read it back on the thread that set it
+   if (stbi_info(m->filenames[i], &r->x, &r->y, &r->comp))
+      r->failure_reason = NULL;
+   else {
+      r->x = r->y = r->comp = 0;
+      r->failure_reason = stbi_failure_reason();
+      if (!r->failure_reason) r->failure_reason = "unknown";
+   }
+}
+
+STBIDEF int stbi_info_many(char const * const *filenames, int count, stbi_info_result *results, stbi_parallel_for *parallel_for, void *user)
+{
+   stbi__info_many m;
+   int i, ok = 0;
+   m.filenames = filenames;
+   m.results = results;
+   if (parallel_for && count > 1)
+      parallel_for(user, stbi__info_many_task, &m, count);
+   else
+      for (i = 0; i < count; ++i)
+         stbi__info_many_task(&m, i);
+   for (i = 0; i < count; ++i)
+      ok += results[i].failure_reason == NULL;
+   return ok;
+}
 #endif // !STBI_NO_STDIO
 
 STBIDEF int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
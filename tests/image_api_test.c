@@ -0,0 +1,1791 @@
+// Differential tests for the stb_image entry points beyond stbi_load.
+//
+//    image_api_test [file...]
+//
+// Every image, from a small corpus generated here plus any files named on
+// the command line (e.g. pngsuite/*/*.png), is decoded through each API and
+// through stbi_load_from_memory, with each desired_channels value and with
+// vertical flipping off and on, and the pixels must match. Where
+// stbi_load_from_memory fails, the other API may fail or not; it only has to
+// get through the file safely. Exits nonzero if anything didn't match.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+// the filename loaders map files where they can, to test that against stdio
+#define STBI_MMAP
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define HAVE_FIFO
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// corpus
+
+typedef struct
+{
+   char name[256];
+   unsigned char *data;
+   int len, cap;
+} image;
+
+static image *corpus;
+static int corpus_n, corpus_cap;
+
+static image *add_image(const char *name)
+{
+   image *im;
+   if (corpus_n == corpus_cap) {
+      corpus_cap = corpus_cap ? corpus_cap*2 : 64;
+      corpus = (image *) realloc(corpus, corpus_cap * sizeof(*corpus));
+   }
+   im = &corpus[corpus_n++];
+   memset(im, 0, sizeof(*im));
+   strncpy(im->name, name, sizeof(im->name)-1);
+   return im;
+}
+
+static void append(image *im, const void *data, int len)
+{
+   if (im->len + len > im->cap) {
+      while (im->len + len > im->cap)
+         im->cap = im->cap ? im->cap*2 : 4096;
+      im->data = (unsigned char *) realloc(im->data, im->cap);
+   }
+   memcpy(im->data + im->len, data, len);
+   im->len += len;
+}
+
+static void write_func(void *context, void *data, int len)
+{
+   append((image *) context, data, len);
+}
+
+static unsigned int rng_state;
+static unsigned int rng(void)
+{
+   rng_state ^= rng_state << 13;
+   rng_state ^= rng_state >> 17;
+   rng_state ^= rng_state << 5;
+   return rng_state;
+}
+
+// gradients with some noise; odd sizes so partial MCUs and rows get covered
+static unsigned char *make_pixels(int w, int h, int comp, unsigned int seed)
+{
+   unsigned char *p = (unsigned char *) malloc((size_t) w*h*comp);
+   int x,y,c;
+   rng_state = seed;
+   for (y=0; y < h; ++y) {
+      for (x=0; x < w; ++x) {
+         for (c=0; c < comp; ++c) {
+            int t = (x*(c+5) + y*(7-c)) & 511;
+            int v = (t < 256 ? t : 511-t) + (int) (rng() % 33) - 16;
+            p[((size_t) y*w + x)*comp + c] = (unsigned char) (v < 0 ? 0 : v > 255 ? 255 : v);
+         }
+      }
+   }
+   return p;
+}
+
+// stb_image_write only writes baseline JPEGs without restart markers, so
+// progressive ones and ones with restart intervals come from this:
+// fixed-length 4-bit DC and 8-bit AC codes, one quantization table, and
+// whatever spectral selection and successive approximation the scan list
+// asks for, refinement scans included; a single 0..63 scan is baseline.
+// Four components are CMYK, or YCCK if 'adobe' is 2; 'adobe' >= 0 writes an
+// Adobe marker with that transform
+typedef struct
+{
+   int ncomp, comp[4];
+   int ss, se, ah, al;
+} pjpeg_scan;
+
+typedef struct
+{
+   image *im;
+   unsigned int bits;
+   int nbits;
+   int ncomp, hs[4], vs[4], hmax, vmax;
+   int mcus_x, mcus_y, blocks_w[4], blocks_h[4], comp_w[4], comp_h[4];
+   int restart;             // MCUs between RSTn markers, 0 for none
+   short *coef[4];          // per component, blocks_w*blocks_h blocks in zigzag order
+   unsigned char ac_code[256];
+} pjpeg;
+
+static void put_byte(image *im, int b)
+{
+   unsigned char c = (unsigned char) b;
+   append(im, &c, 1);
+}
+
+static void put_word(image *im, int w)
+{
+   put_byte(im, w >> 8);
+   put_byte(im, w & 255);
+}
+
+static void put_bits(pjpeg *e, unsigned int v, int n)
+{
+   e->bits = (e->bits << n) | (v & ((1u << n) - 1));
+   e->nbits += n;
+   while (e->nbits >= 8) {
+      int c = (e->bits >> (e->nbits - 8)) & 255;
+      put_byte(e->im, c);
+      if (c == 255) put_byte(e->im, 0);
+      e->nbits -= 8;
+   }
+}
+
+static int magnitude_bits(int v)
+{
+   int s = 0;
+   if (v < 0) v = -v;
+   while (v) { ++s; v >>= 1; }
+   return s;
+}
+
+static void put_value(pjpeg *e, int v, int s)
+{
+   put_bits(e, v < 0 ? v + (1 << s) - 1 : v, s);
+}
+
+static void put_ac(pjpeg *e, int sym)
+{
+   put_bits(e, e->ac_code[sym], 8);
+}
+
+static short *pjpeg_block(pjpeg *e, int c, int bx, int by)
+{
+   return e->coef[c] + 64 * (by * e->blocks_w[c] + bx);
+}
+
+// one block's part of a scan: its DC, then its AC coefficients
+static void pjpeg_scan_block(pjpeg *e, pjpeg_scan const *sc, int c, short const *b, int *pred)
+{
+   int i, k, ss = sc->ss;
+
+   if (ss == 0) {
+      int dc = b[0];
+      if (sc->ah) {
+         put_bits(e, (dc >> sc->al) & 1, 1);
+      } else {
+         int diff = (dc >> sc->al) - pred[c], s = magnitude_bits(diff);
+         pred[c] = dc >> sc->al;
+         put_bits(e, s, 4);
+         put_value(e, diff, s);
+      }
+      if (sc->se == 0) return;
+      ss = 1;
+   }
+
+   {
+      int run = 0;
+      if (!sc->ah) {
+         for (k=ss; k <= sc->se; ++k) {
+            int v = b[k] < 0 ? -(-b[k] >> sc->al) : b[k] >> sc->al;
+            if (v == 0) { ++run; continue; }
+            for (; run > 15; run -= 16)
+               put_ac(e, 0xf0);
+            put_ac(e, (run << 4) | magnitude_bits(v));
+            put_value(e, v, magnitude_bits(v));
+            run = 0;
+         }
+         if (run) put_ac(e, 0x00);
+      } else {
+         // refinement: new coefficients are +-1 with a sign bit, older
+         // ones get one correction bit each, sent after the next symbol
+         int last = 0, nbuf = 0;
+         unsigned char buf[64];
+         for (k=ss; k <= sc->se; ++k)
+            if ((abs(b[k]) >> sc->al) == 1) last = k;
+         for (k=ss; k <= sc->se; ++k) {
+            int a = abs(b[k]) >> sc->al;
+            if (a == 0) { ++run; continue; }
+            while (run > 15 && k <= last) {
+               put_ac(e, 0xf0);
+               run -= 16;
+               for (i=0; i < nbuf; ++i) put_bits(e, buf[i], 1);
+               nbuf = 0;
+            }
+            if (a > 1) {
+               buf[nbuf++] = (unsigned char) (a & 1);
+               continue;
+            }
+            put_ac(e, (run << 4) | 1);
+            put_bits(e, b[k] > 0, 1);
+            for (i=0; i < nbuf; ++i) put_bits(e, buf[i], 1);
+            nbuf = 0;
+            run = 0;
+         }
+         if (run || nbuf) {
+            put_ac(e, 0x00);
+            for (i=0; i < nbuf; ++i) put_bits(e, buf[i], 1);
+         }
+      }
+   }
+}
+
+static void pjpeg_scan_data(pjpeg *e, pjpeg_scan const *sc)
+{
+   int pred[4] = { 0, 0, 0, 0 };
+   int i, m, bx, by, num_mcus, c = sc->comp[0];
+   int w = (e->comp_w[c] + 7) / 8, h = (e->comp_h[c] + 7) / 8;
+
+   // interleaved scans go in MCU order, a single component in its own
+   // block order, where every block counts as an MCU
+   num_mcus = sc->ncomp > 1 ? e->mcus_x * e->mcus_y : w * h;
+   for (m=0; m < num_mcus; ++m) {
+      if (e->restart && m && m % e->restart == 0) {
+         if (e->nbits) put_bits(e, 0x7f, 8 - e->nbits);  // pad with 1s
+         put_word(e->im, 0xffd0 + (m / e->restart - 1) % 8);
+         pred[0] = pred[1] = pred[2] = pred[3] = 0;
+      }
+      if (sc->ncomp == 1) {
+         pjpeg_scan_block(e, sc, c, pjpeg_block(e, c, m % w, m / w), pred);
+         continue;
+      }
+      for (i=0; i < sc->ncomp; ++i) {
+         c = sc->comp[i];
+         for (by=0; by < e->vs[c]; ++by)
+            for (bx=0; bx < e->hs[c]; ++bx)
+               pjpeg_scan_block(e, sc, c, pjpeg_block(e, c, (m % e->mcus_x)*e->hs[c] + bx, (m / e->mcus_x)*e->vs[c] + by), pred);
+      }
+   }
+}
+
+// q is the quantizer step for the DC, growing by 'slope' per diagonal.
+// RSTn markers go in every 'restart' MCUs, but DRI declares 'dri'
+static void make_jpeg(image *im, unsigned char const *pixels, int w, int h, int n, int adobe, int hs0, int vs0,
+                      int q, int slope, int restart, int dri, pjpeg_scan const *scans, int nscans)
+{
+   pjpeg e;
+   float *plane[4], cosine[8][8];
+   int zigzag[64], quant[64];
+   int i, c, k, x, y, u, v, bx, by, nsym;
+   unsigned char syms[162];
+
+   memset(&e, 0, sizeof(e));
+   e.im = im;
+   e.ncomp = n;
+   e.restart = restart;
+   for (c=0; c < n; ++c)
+      e.hs[c] = e.vs[c] = 1;
+   e.hs[0] = hs0;
+   e.vs[0] = vs0;
+   e.hmax = hs0;
+   e.vmax = vs0;
+   e.mcus_x = (w + 8*e.hmax - 1) / (8*e.hmax);
+   e.mcus_y = (h + 8*e.vmax - 1) / (8*e.vmax);
+
+   // zigzag order walks the antidiagonals, alternating direction
+   for (k=0, i=0; i < 15; ++i)
+      for (u=0; u <= i; ++u) {
+         int r = (i & 1) ? u : i-u, col = i-r;
+         if (r < 8 && col < 8) zigzag[k++] = r*8 + col;
+      }
+   for (k=0; k < 64; ++k)
+      quant[zigzag[k]] = q + slope * ((zigzag[k] >> 3) + (zigzag[k] & 7));
+   for (x=0; x < 8; ++x)
+      for (u=0; u < 8; ++u)
+         cosine[x][u] = (float) (cos((2*x + 1) * u * 3.14159265358979 / 16) * (u ? 0.5 : 0.5 / sqrt(2.0)));
+
+   // every code that's used, in code order: all 8 bits long
+   nsym = 0;
+   syms[nsym++] = 0x00;
+   syms[nsym++] = 0xf0;
+   for (i=0; i < 16; ++i)
+      for (k=1; k <= 10; ++k)
+         syms[nsym++] = (unsigned char) ((i << 4) | k);
+   for (i=0; i < nsym; ++i)
+      e.ac_code[syms[i]] = (unsigned char) i;
+
+   // YCbCr at full resolution
+   for (c=0; c < n; ++c)
+      plane[c] = (float *) malloc(sizeof(float) * w * h);
+   for (i=0; i < w*h; ++i) {
+      unsigned char const *p = pixels + i*n;
+      if (n == 1 || (n == 4 && adobe != 2)) {
+         for (c=0; c < n; ++c)
+            plane[c][i] = p[c];
+      } else {
+         plane[0][i] =  0.299f   *p[0] + 0.587f   *p[1] + 0.114f   *p[2];
+         plane[1][i] = -0.168736f*p[0] - 0.331264f*p[1] + 0.5f     *p[2] + 128;
+         plane[2][i] =  0.5f     *p[0] - 0.418688f*p[1] - 0.081312f*p[2] + 128;
+         if (n == 4) plane[3][i] = p[3];
+      }
+   }
+
+   // forward DCT of every block the MCUs cover, edges replicated
+   for (c=0; c < n; ++c) {
+      int fx = e.hmax / e.hs[c], fy = e.vmax / e.vs[c];
+      e.comp_w[c] = (w * e.hs[c] + e.hmax - 1) / e.hmax;
+      e.comp_h[c] = (h * e.vs[c] + e.vmax - 1) / e.vmax;
+      e.blocks_w[c] = e.mcus_x * e.hs[c];
+      e.blocks_h[c] = e.mcus_y * e.vs[c];
+      e.coef[c] = (short *) malloc(sizeof(short) * 64 * e.blocks_w[c] * e.blocks_h[c]);
+      for (by=0; by < e.blocks_h[c]; ++by)
+         for (bx=0; bx < e.blocks_w[c]; ++bx) {
+            float f[64];
+            short *b = pjpeg_block(&e, c, bx, by);
+            for (y=0; y < 8; ++y)
+               for (x=0; x < 8; ++x) {
+                  int cx = bx*8 + x, cy = by*8 + y, sx, sy;
+                  float sum = 0;
+                  if (cx >= e.comp_w[c]) cx = e.comp_w[c]-1;
+                  if (cy >= e.comp_h[c]) cy = e.comp_h[c]-1;
+                  for (sy=0; sy < fy; ++sy)
+                     for (sx=0; sx < fx; ++sx) {
+                        int px = cx*fx + sx, py = cy*fy + sy;
+                        if (px >= w) px = w-1;
+                        if (py >= h) py = h-1;
+                        sum += plane[c][py*w + px];
+                     }
+                  f[y*8 + x] = sum / (fx*fy) - 128;
+               }
+            for (k=0; k < 64; ++k) {
+               int nat = zigzag[k], lim = k ? 1023 : 2047;
+               float sum = 0, r;
+               u = nat & 7;
+               v = nat >> 3;
+               for (y=0; y < 8; ++y)
+                  for (x=0; x < 8; ++x)
+                     sum += f[y*8 + x] * cosine[x][u] * cosine[y][v];
+               r = (float) floor(sum / quant[nat] + 0.5f);
+               b[k] = (short) (r < -lim ? -lim : r > lim ? lim : r);
+            }
+         }
+   }
+
+   put_word(im, 0xffd8);
+   if (adobe >= 0) {
+      append(im, "\xff\xee\x00\x0e" "Adobe" "\x00\x64\x00\x00\x00\x00", 15);
+      put_byte(im, adobe);
+   }
+   put_word(im, 0xffdb);
+   put_word(im, 67);
+   put_byte(im, 0);
+   for (k=0; k < 64; ++k)
+      put_byte(im, quant[zigzag[k]]);
+   put_word(im, nscans == 1 && scans[0].ss == 0 && scans[0].se == 63 ? 0xffc0 : 0xffc2);
+   put_word(im, 8 + 3*n);
+   put_byte(im, 8);
+   put_word(im, h);
+   put_word(im, w);
+   put_byte(im, n);
+   for (c=0; c < n; ++c) {
+      put_byte(im, c+1);
+      put_byte(im, (e.hs[c] << 4) | e.vs[c]);
+      put_byte(im, 0);
+   }
+   put_word(im, 0xffc4);
+   put_word(im, 2 + 17 + 12 + 17 + nsym);
+   put_byte(im, 0x00);
+   for (i=1; i <= 16; ++i)
+      put_byte(im, i == 4 ? 12 : 0);
+   for (i=0; i < 12; ++i)
+      put_byte(im, i);
+   put_byte(im, 0x10);
+   for (i=1; i <= 16; ++i)
+      put_byte(im, i == 8 ? nsym : 0);
+   append(im, syms, nsym);
+   if (dri) {
+      put_word(im, 0xffdd);
+      put_word(im, 4);
+      put_word(im, dri);
+   }
+   for (i=0; i < nscans; ++i) {
+      pjpeg_scan const *sc = &scans[i];
+      put_word(im, 0xffda);
+      put_word(im, 6 + 2*sc->ncomp);
+      put_byte(im, sc->ncomp);
+      for (c=0; c < sc->ncomp; ++c) {
+         put_byte(im, sc->comp[c] + 1);
+         put_byte(im, 0x00);
+      }
+      put_byte(im, sc->ss);
+      put_byte(im, sc->se);
+      put_byte(im, (sc->ah << 4) | sc->al);
+      e.bits = 0;
+      e.nbits = 0;
+      pjpeg_scan_data(&e, sc);
+      if (e.nbits) put_bits(&e, 0x7f, 8 - e.nbits);  // pad with 1s
+   }
+   put_word(im, 0xffd9);
+
+   for (c=0; c < n; ++c) {
+      free(plane[c]);
+      free(e.coef[c]);
+   }
+}
+
+static void make_progressive_jpeg(image *im, unsigned char const *pixels, int w, int h, int n, int adobe,
+                                  int hs0, int vs0, int q, int slope, pjpeg_scan const *scans, int nscans)
+{
+   make_jpeg(im, pixels, w, h, n, adobe, hs0, vs0, q, slope, 0, 0, scans, nscans);
+}
+
+// stb_image_write has no GIF writer either: this writes an animation on a
+// 3-3-2 palette, each frame a rectangle of the canvas with its own delay,
+// disposal and transparent index, LZW-coded with the table cleared whenever
+// it fills up
+typedef struct
+{
+   int x, y, w, h;
+   int delay, dispose, transparent, interlaced;
+} gif_frame;
+
+static void gif_bits(image *im, unsigned char *block, int *nblock, unsigned int *bits, int *nbits, int code, int width)
+{
+   *bits |= (unsigned int) code << *nbits;
+   *nbits += width;
+   while (*nbits >= 8) {
+      block[1 + (*nblock)++] = (unsigned char) *bits;
+      *bits >>= 8;
+      *nbits -= 8;
+      if (*nblock == 255) {
+         block[0] = 255;
+         append(im, block, 256);
+         *nblock = 0;
+      }
+   }
+}
+
+static void gif_lzw(image *im, unsigned char const *index, int n)
+{
+   static short next[4096][256];
+   unsigned char block[256];
+   unsigned int bits = 0;
+   int nbits = 0, nblock = 0;
+   int i, code = 258, width = 9, prefix;
+
+   append(im, "\x08", 1);
+   memset(next, 0, sizeof(next));
+   gif_bits(im, block, &nblock, &bits, &nbits, 256, width);
+   prefix = index[0];
+   for (i=1; i < n; ++i) {
+      int c = index[i];
+      if (next[prefix][c]) {
+         prefix = next[prefix][c];
+         continue;
+      }
+      gif_bits(im, block, &nblock, &bits, &nbits, prefix, width);
+      if (code < 4096) {
+         next[prefix][c] = (short) code++;
+         if (code > (1 << width) && width < 12) ++width;
+      } else {
+         gif_bits(im, block, &nblock, &bits, &nbits, 256, width);
+         memset(next, 0, sizeof(next));
+         code = 258;
+         width = 9;
+      }
+      prefix = c;
+   }
+   gif_bits(im, block, &nblock, &bits, &nbits, prefix, width);
+   gif_bits(im, block, &nblock, &bits, &nbits, 257, width);
+   if (nbits) gif_bits(im, block, &nblock, &bits, &nbits, 0, 8 - nbits);
+   if (nblock) {
+      block[0] = (unsigned char) nblock;
+      append(im, block, nblock + 1);
+   }
+   append(im, "\x00", 1);
+}
+
+static void put_le16(unsigned char *p, int v)
+{
+   p[0] = (unsigned char) v;
+   p[1] = (unsigned char) (v >> 8);
+}
+
+static void make_gif(image *im, int w, int h, gif_frame const *frames, int nframes, unsigned int seed)
+{
+   unsigned char header[13+768], gce[8], desc[10];
+   int i, f;
+
+   memcpy(header, "GIF89a", 6);
+   put_le16(header+6, w);
+   put_le16(header+8, h);
+   header[10] = 0xf7; header[11] = 0; header[12] = 0;
+   for (i=0; i < 256; ++i) {
+      header[13+i*3+0] = (unsigned char) ((i >> 5)     * 255 / 7);
+      header[13+i*3+1] = (unsigned char) ((i >> 2 & 7) * 255 / 7);
+      header[13+i*3+2] = (unsigned char) ((i & 3)      * 255 / 3);
+   }
+   append(im, header, sizeof(header));
+   append(im, "\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00", 19);
+
+   for (f=0; f < nframes; ++f) {
+      gif_frame const *fr = &frames[f];
+      unsigned char *rgb = make_pixels(fr->w, fr->h, 3, seed + f);
+      unsigned char *index = (unsigned char *) malloc((size_t) fr->w*fr->h);
+      int y, row = 0, pass;
+
+      gce[0] = 0x21; gce[1] = 0xf9; gce[2] = 4;
+      gce[3] = (unsigned char) ((fr->dispose << 2) | (fr->transparent >= 0));
+      put_le16(gce+4, fr->delay);
+      gce[6] = (unsigned char) (fr->transparent >= 0 ? fr->transparent : 0);
+      gce[7] = 0;
+      append(im, gce, 8);
+      desc[0] = 0x2c;
+      put_le16(desc+1, fr->x);
+      put_le16(desc+3, fr->y);
+      put_le16(desc+5, fr->w);
+      put_le16(desc+7, fr->h);
+      desc[9] = (unsigned char) (fr->interlaced ? 0x40 : 0);
+      append(im, desc, 10);
+
+      // quantize to palette indices, punching a diagonal pattern of holes
+      // where there's a transparent index, and lay out the rows in the
+      // order they're stored
+      for (pass=0; pass < (fr->interlaced ? 4 : 1); ++pass) {
+         static const int start[4] = { 0, 4, 2, 1 }, step[4] = { 8, 8, 4, 2 };
+         for (y = fr->interlaced ? start[pass] : 0; y < fr->h; y += fr->interlaced ? step[pass] : 1, ++row) {
+            int x;
+            for (x=0; x < fr->w; ++x) {
+               unsigned char const *p = rgb + ((size_t) y*fr->w + x)*3;
+               int c = (p[0] & 0xe0) | (p[1] >> 5 << 2) | (p[2] >> 6);
+               if (fr->transparent >= 0 && (x + y) % 5 == 0) c = fr->transparent;
+               index[(size_t) row*fr->w + x] = (unsigned char) c;
+            }
+         }
+      }
+      gif_lzw(im, index, fr->w*fr->h);
+      free(index);
+      free(rgb);
+   }
+   append(im, "\x3b", 1);
+}
+
+// a copy of src with restart interval k (from 1) scrambled (bytes that can't
+// make a marker XORed in), cut down to its first two bytes, or with junk
+// after it, for 'how' 0, 1 or 2
+static void corrupt_interval(image *im, image const *src, int k, int how)
+{
+   int i, start = -1, end = -1;
+   for (i=0; i+1 < src->len; ++i)
+      if (src->data[i] == 0xff && src->data[i+1] >= 0xd0 + k - 1 && src->data[i+1] <= 0xd0 + k) {
+         if (src->data[i+1] == 0xd0 + k) { end = i; break; }
+         start = i+2;
+      }
+   if (start < 0 || end < start) { append(im, src->data, src->len); return; }
+   append(im, src->data, start);
+   if (how == 1) {
+      append(im, src->data + start, end - start < 2 ? end - start : 2);
+   } else if (how == 2) {
+      append(im, src->data + start, end - start);
+      append(im, "\x12\x34\x56\x78\x9a\xbc\xde\xf0\x12\x34\x56\x78", 12);
+   } else {
+      for (i=start; i < end; ++i) {
+         unsigned char c = src->data[i];
+         if (c != 0xff && c != 0x00 && (c ^ 0x5a) != 0xff) c ^= 0x5a;
+         put_byte(im, c);
+      }
+   }
+   append(im, src->data + end, src->len - end);
+}
+
+static void make_corpus(void)
+{
+   // luma and the second chroma plane are refined, the first chroma plane isn't
+   static const pjpeg_scan colour_scans[] =
+   {
+      { 3, {0,1,2}, 0, 0, 0,1 },
+      { 1, {0},     1, 5, 0,1 },
+      { 1, {1},     1,63, 0,0 },
+      { 1, {2},     1,63, 0,1 },
+      { 1, {0},     6,63, 0,1 },
+      { 3, {0,1,2}, 0, 0, 1,0 },
+      { 1, {0},     1,63, 1,0 },
+      { 1, {2},     1,63, 1,0 },
+   };
+   static const pjpeg_scan grey_scans[] =
+   {
+      { 1, {0}, 0, 0, 0,0 },
+      { 1, {0}, 1, 9, 0,0 },
+      { 1, {0},10,63, 0,2 },
+      { 1, {0},10,63, 2,1 },
+      { 1, {0},10,63, 1,0 },
+   };
+   static const pjpeg_scan baseline_scan[] = { { 3, {0,1,2}, 0,63, 0,0 } };
+   static const pjpeg_scan grey_baseline_scan[] = { { 1, {0}, 0,63, 0,0 } };
+   static const pjpeg_scan four_scans[] =
+   {
+      { 4, {0,1,2,3}, 0, 0, 0,0 },
+      { 1, {0},       1,63, 0,0 },
+      { 1, {1},       1,63, 0,0 },
+      { 1, {2},       1,63, 0,0 },
+      { 1, {3},       1,63, 0,0 },
+   };
+   // every disposal method, frames partly covering the canvas, some with holes
+   static const gif_frame gif_frames[] =
+   {
+      {  0,  0, 45, 31,  10, 1, -1, 0 },
+      {  5,  3, 22, 15,  20, 2,  0, 0 },
+      { 15,  7, 25, 20,   0, 3, 36, 0 },
+      {  2, 10, 30, 21,   5, 1, 36, 1 },
+      {  0,  0, 45, 31,   7, 0, -1, 1 },
+   };
+   unsigned char *p;
+   image *im;
+   int i, base;
+
+   make_gif(add_image("generated 45x31 gif, 5 frames"), 45, 31, gif_frames, (int) (sizeof(gif_frames)/sizeof(gif_frames[0])), 5);
+   make_gif(add_image("generated 45x31 gif, 1 frame"), 45, 31, gif_frames, 1, 5);
+
+   p = make_pixels(67, 45, 3, 1);
+   stbi_write_jpg_to_func(write_func, add_image("generated 67x45 rgb q95 (4:4:4)"), 67, 45, 3, p, 95);
+   stbi_write_jpg_to_func(write_func, add_image("generated 67x45 rgb q50 (4:2:0)"), 67, 45, 3, p, 50);
+   stbi_write_png_to_func(write_func, add_image("generated 67x45 rgb png"), 67, 45, 3, p, 67*3);
+   {
+      float *f = (float *) malloc(sizeof(float) * 67*45*3);
+      for (i=0; i < 67*45*3; ++i)
+         f[i] = p[i] / 255.0f;
+      stbi_write_hdr_to_func(write_func, add_image("generated 67x45 rgb hdr"), 67, 45, 3, f);
+      free(f);
+   }
+   make_progressive_jpeg(add_image("generated 67x45 rgb progressive (4:2:0)"), p, 67, 45, 3, -1, 2, 2, 6, 3, colour_scans, (int) (sizeof(colour_scans)/sizeof(colour_scans[0])));
+   // a fine quantizer gives AC values too big for a byte
+   make_progressive_jpeg(add_image("generated 67x45 rgb progressive (4:4:4, q2)"), p, 67, 45, 3, -1, 1, 1, 2, 0, colour_scans, (int) (sizeof(colour_scans)/sizeof(colour_scans[0])));
+   // restart intervals for the parallel decoder: 8 of them, the last one short
+   base = corpus_n;
+   make_jpeg(add_image("generated 67x45 rgb baseline (4:2:0, restart 2)"), p, 67, 45, 3, -1, 2, 2, 6, 3, 2, 2, baseline_scan, 1);
+   // the third interval scrambled, cut short, then followed by junk
+   im = add_image("generated 67x45 rgb baseline (4:2:0, restart 2, corrupt interval)");
+   corrupt_interval(im, &corpus[base], 2, 0);
+   im = add_image("generated 67x45 rgb baseline (4:2:0, restart 2, truncated interval)");
+   corrupt_interval(im, &corpus[base], 2, 1);
+   im = add_image("generated 67x45 rgb baseline (4:2:0, restart 2, padded interval)");
+   corrupt_interval(im, &corpus[base], 2, 2);
+   // restart markers that don't match the interval send the parallel
+   // decoder back to the serial one: too few of them, and one too many
+   make_jpeg(add_image("generated 67x45 rgb baseline (4:4:4, RST every 4, DRI 2)"), p, 67, 45, 3, -1, 1, 1, 6, 3, 4, 2, baseline_scan, 1);
+   base = corpus_n;
+   make_jpeg(add_image("generated 67x45 rgb baseline (4:4:4, restart 2)"), p, 67, 45, 3, -1, 1, 1, 6, 3, 2, 2, baseline_scan, 1);
+   im = add_image("generated 67x45 rgb baseline (4:4:4, restart 2, extra RST)");
+   append(im, corpus[base].data, corpus[base].len - 2);
+   put_word(im, 0xffd2);
+   put_word(im, 0xffd9);
+   free(p);
+
+   p = make_pixels(301, 37, 1, 2);
+   stbi_write_jpg_to_func(write_func, add_image("generated 301x37 grey q90"), 301, 37, 1, p, 90);
+   im = add_image("generated 301x37 grey pnm");
+   append(im, "P5\n301 37\n255\n", 14);
+   append(im, p, 301*37);
+   make_progressive_jpeg(add_image("generated 301x37 grey progressive"), p, 301, 37, 1, -1, 1, 1, 4, 1, grey_scans, (int) (sizeof(grey_scans)/sizeof(grey_scans[0])));
+   // more intervals than the decoder runs jobs
+   make_jpeg(add_image("generated 301x37 grey baseline (restart 1)"), p, 301, 37, 1, -1, 1, 1, 4, 1, 1, 1, grey_baseline_scan, 1);
+   free(p);
+
+   p = make_pixels(40, 70, 4, 3);
+   stbi_write_png_to_func(write_func, add_image("generated 40x70 rgba png"), 40, 70, 4, p, 40*4);
+   stbi_write_bmp_to_func(write_func, add_image("generated 40x70 rgb bmp"), 40, 70, 4, p);
+   // TGA has no signature; this one even starts like a JPEG's fill bytes
+   stbi_write_tga_with_rle = 0;
+   stbi_write_tga_to_func(write_func, add_image("generated 40x70 rgba tga"), 40, 70, 4, p);
+   stbi_write_tga_with_rle = 1;
+   base = corpus_n;
+   stbi_write_tga_to_func(write_func, add_image("generated 40x70 rgba tga (rle)"), 40, 70, 4, p);
+   im = add_image("generated 40x70 rgba tga (rle, 255-byte id)");
+   put_byte(im, 255);
+   append(im, corpus[base].data + 1, 17);
+   for (i=0; i < 255; ++i)
+      put_byte(im, 0xff);
+   append(im, corpus[base].data + 18, corpus[base].len - 18);
+   make_progressive_jpeg(add_image("generated 40x70 cmyk progressive"), p, 40, 70, 4, 0, 1, 1, 4, 1, four_scans, (int) (sizeof(four_scans)/sizeof(four_scans[0])));
+   make_progressive_jpeg(add_image("generated 40x70 ycck progressive (4:2:0)"), p, 40, 70, 4, 2, 2, 2, 4, 1, four_scans, (int) (sizeof(four_scans)/sizeof(four_scans[0])));
+   free(p);
+
+   // more than 256KB of filtered rows, so the parallel PNG path takes several steps
+   p = make_pixels(403, 231, 3, 4);
+   stbi_write_png_to_func(write_func, add_image("generated 403x231 rgb png"), 403, 231, 3, p, 403*3);
+   free(p);
+}
+
+static void add_file(const char *filename)
+{
+   image *im;
+   FILE *fp;
+   long len;
+
+   fp = fopen(filename, "rb");
+   if (!fp) { fprintf(stderr, "can't open %s\n", filename); return; }
+   fseek(fp, 0, SEEK_END);
+   len = ftell(fp);
+   fseek(fp, 0, SEEK_SET);
+   im = add_image(filename);
+   im->cap = (int) len + 1;
+   im->data = (unsigned char *) malloc(im->cap);
+   im->len = (int) fread(im->data, 1, len, fp);
+   fclose(fp);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// helpers
+
+static const char *cur_test;
+static image *cur_image;
+static int cur_flip, cur_req_comp;
+static int checks, failures;
+
+static void check(int ok, const char *what)
+{
+   ++checks;
+   if (!ok) {
+      ++failures;
+      printf("FAIL %s: %s (%s, req_comp %d, flip %d)\n", cur_test, what, cur_image->name, cur_req_comp, cur_flip);
+   }
+}
+
+// what the API under test has to match
+static stbi_uc *reference(image *im, int flip, int *x, int *y, int *n, int req_comp)
+{
+   stbi_uc *ref;
+   stbi_set_flip_vertically_on_load(flip);
+   ref = stbi_load_from_memory(im->data, im->len, x, y, n, req_comp);
+   stbi_set_flip_vertically_on_load(cur_flip);
+   return ref;
+}
+
+static int same_rows(stbi_uc const *a, int a_stride, stbi_uc const *b, int b_stride, int row_bytes, int rows)
+{
+   int i;
+   for (i=0; i < rows; ++i)
+      if (memcmp(a + (size_t) a_stride*i, b + (size_t) b_stride*i, row_bytes))
+         return 0;
+   return 1;
+}
+
+// io callbacks reading an image in memory, to cover the _from_callbacks paths
+typedef struct
+{
+   image *im;
+   int pos;
+} reader;
+
+static int read_cb(void *user, char *data, int size)
+{
+   reader *r = (reader *) user;
+   if (size > r->im->len - r->pos) size = r->im->len - r->pos;
+   memcpy(data, r->im->data + r->pos, size);
+   r->pos += size;
+   return size;
+}
+
+static void skip_cb(void *user, int n)
+{
+   reader *r = (reader *) user;
+   r->pos += n;
+   if (r->pos > r->im->len) r->pos = r->im->len;
+   if (r->pos < 0) r->pos = 0;
+}
+
+static int eof_cb(void *user)
+{
+   reader *r = (reader *) user;
+   return r->pos >= r->im->len;
+}
+
+static stbi_io_callbacks callbacks = { read_cb, skip_cb, eof_cb };
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// the tests; each runs for one image, req_comp and flip setting
+
+// stbi_stream: rows read a few at a time, top to bottom whatever the flip
+static void test_stream(image *im, int req_comp)
+{
+   int x,y,n, sx,sy,sn, k, got, rows, w;
+   stbi_uc *ref, *buf;
+   stbi_stream *st;
+   reader r;
+
+   ref = reference(im, 0, &x, &y, &n, req_comp);
+   for (k=0; k < 2; ++k) {
+      r.im = im;
+      r.pos = 0;
+      st = k ? stbi_stream_open_from_callbacks(&callbacks, &r, &sx, &sy, &sn, req_comp)
+             : stbi_stream_open_from_memory(im->data, im->len, &sx, &sy, &sn, req_comp);
+      if (!ref) {
+         if (st) {
+            stbi_uc *row = (stbi_uc *) malloc((size_t) sx * 4);
+            while (stbi_stream_read_rows(st, row, 0, 1) > 0)
+               ;
+            free(row);
+         }
+         stbi_stream_close(st);
+         continue;
+      }
+      check(st != NULL, "open failed");
+      if (!st) continue;
+      check(sx == x && sy == y && sn == n, "size");
+      w = x * (req_comp ? req_comp : n);
+      buf = (stbi_uc *) malloc((size_t) w*y);
+      rows = 0;
+      while ((got = stbi_stream_read_rows(st, buf + (size_t) w*rows, 0, rows+7 < y ? 7 : y-rows)) > 0)
+         rows += got;
+      check(got == 0 && rows == y, "row count");
+      if (rows == y) check(!memcmp(buf, ref, (size_t) w*y), "pixels");
+      free(buf);
+      stbi_stream_close(st);
+   }
+   stbi_image_free(ref);
+}
+
+// stbi_load_into: into a padded buffer, which must be big enough and whose
+// padding must be left alone
+static void test_load_into(image *im, int req_comp)
+{
+   int x,y,n, ix,iy,in, k, ok, w, stride, i;
+   size_t size;
+   stbi_uc *ref, *buf;
+   reader r;
+
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   if (!ref) {
+      // nothing to compare; a 1x1 buffer is too small for anything real
+      stbi_uc one[4];
+      stbi_load_into_from_memory(im->data, im->len, &ix, &iy, &in, req_comp, one, 0, sizeof(one));
+      return;
+   }
+   w = x * (req_comp ? req_comp : n);
+   stride = w + 13;
+   size = (size_t) stride * (y-1) + w;
+   buf = (stbi_uc *) malloc(size);
+   for (k=0; k < 2; ++k) {
+      r.im = im;
+      r.pos = 0;
+      memset(buf, 0xa5, size);
+      ok = k ? stbi_load_into_from_callbacks(&callbacks, &r, &ix, &iy, &in, req_comp, buf, stride, size)
+             : stbi_load_into_from_memory(im->data, im->len, &ix, &iy, &in, req_comp, buf, stride, size);
+      check(ok, "decode failed");
+      if (!ok) continue;
+      check(ix == x && iy == y && in == n, "size");
+      check(same_rows(buf, stride, ref, w, w, y), "pixels");
+      for (i=0; i+1 < y; ++i)
+         if (buf[(size_t) stride*i + w] != 0xa5 || buf[(size_t) stride*i + stride-1] != 0xa5)
+            break;
+      check(i+1 >= y, "wrote past the row");
+   }
+   check(!stbi_load_into_from_memory(im->data, im->len, &ix, &iy, &in, req_comp, buf, stride, size-1), "accepted a short buffer");
+   free(buf);
+   stbi_image_free(ref);
+}
+
+// a stbi_allocator that counts what's live; in arena mode it has no resize
+// or release and frees everything when the decode is over
+typedef struct
+{
+   int live;
+   void **arena;
+   int arena_n, arena_cap;
+} counter;
+
+static void *counter_alloc(void *user, size_t size)
+{
+   counter *c = (counter *) user;
+   void *p = malloc(size ? size : 1);
+   if (!p) return NULL;
+   ++c->live;
+   if (c->arena) {
+      if (c->arena_n == c->arena_cap) {
+         c->arena_cap *= 2;
+         c->arena = (void **) realloc(c->arena, c->arena_cap * sizeof(void *));
+      }
+      c->arena[c->arena_n++] = p;
+   }
+   return p;
+}
+
+static void *counter_resize(void *user, void *p, size_t oldsize, size_t newsize)
+{
+   counter *c = (counter *) user;
+   void *q = realloc(p, newsize ? newsize : 1);
+   (void) oldsize;
+   if (q && !p) ++c->live; // resizing NULL allocates
+   return q;
+}
+
+static void counter_release(void *user, void *p)
+{
+   counter *c = (counter *) user;
+   if (!p) return;
+   --c->live;
+   free(p);
+}
+
+static void counter_reset(counter *c)
+{
+   while (c->arena_n)
+      free(c->arena[--c->arena_n]);
+   c->live = 0;
+}
+
+// stbi_load_*_with_allocator: every allocation, the result included, goes
+// through the allocator, and everything but the result is given back
+static void test_allocator(image *im, int req_comp)
+{
+   int x,y,n, ax,ay,an, k;
+   stbi_uc *ref, *out;
+   stbi_us *ref16, *out16;
+   counter c;
+   stbi_allocator a;
+   reader r;
+
+   memset(&c, 0, sizeof(c));
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   for (k=0; k < 3; ++k) {
+      // 0: from memory, 1: through callbacks, 2: an arena from memory
+      a.alloc = counter_alloc;
+      a.resize = k < 2 ? counter_resize : NULL;
+      a.release = k < 2 ? counter_release : NULL;
+      a.user = &c;
+      if (k == 2) {
+         c.arena_cap = 16;
+         c.arena = (void **) malloc(c.arena_cap * sizeof(void *));
+      }
+      r.im = im;
+      r.pos = 0;
+      out = k == 1 ? stbi_load_from_callbacks_with_allocator(&callbacks, &r, &ax, &ay, &an, req_comp, &a)
+                   : stbi_load_from_memory_with_allocator(im->data, im->len, &ax, &ay, &an, req_comp, &a);
+      if (ref) {
+         check(out != NULL, "decode failed");
+         if (out) {
+            check(ax == x && ay == y && an == n, "size");
+            check(!memcmp(out, ref, (size_t) x*y*(req_comp ? req_comp : n)), "pixels");
+         }
+      } else
+         check(out == NULL, "decoded what stbi_load rejects");
+      if (k < 2) {
+         check(c.live == (out != NULL), "leaked through the allocator");
+         counter_release(&c, out);
+      }
+      counter_reset(&c);
+      free(c.arena);
+      c.arena = NULL;
+   }
+   stbi_image_free(ref);
+
+   // and the 16-bit path
+   stbi_set_flip_vertically_on_load(cur_flip);
+   ref16 = stbi_load_16_from_memory(im->data, im->len, &x, &y, &n, req_comp);
+   a.resize = counter_resize;
+   a.release = counter_release;
+   out16 = stbi_load_16_from_memory_with_allocator(im->data, im->len, &ax, &ay, &an, req_comp, &a);
+   check(!ref16 == !out16, "16-bit decode disagrees");
+   if (ref16 && out16)
+      check(ax == x && ay == y && an == n && !memcmp(out16, ref16, (size_t) x*y*(req_comp ? req_comp : n)*2), "16-bit pixels");
+   check(c.live == (out16 != NULL), "leaked through the allocator (16-bit)");
+   counter_release(&c, out16);
+   stbi_image_free(ref16);
+}
+
+// stbi_parallel_for stand-ins: the tasks of a step may run in any order.
+// A non-NULL user counts the calls
+static void forward_for(void *user, void (*task)(void *task_data, int index), void *task_data, int count)
+{
+   int i;
+   if (user) ++*(int *) user;
+   for (i=0; i < count; ++i)
+      task(task_data, i);
+}
+
+static void reverse_for(void *user, void (*task)(void *task_data, int index), void *task_data, int count)
+{
+   int i;
+   if (user) ++*(int *) user;
+   for (i=count-1; i >= 0; --i)
+      task(task_data, i);
+}
+
+// stbi_load_png_parallel_*: the same image as stbi_load whichever order the
+// inflate and unfilter tasks run in; anything that isn't a PNG falls through
+static void test_png_parallel(image *im, int req_comp)
+{
+   int x,y,n, px,py,pn, k;
+   stbi_uc *ref, *out;
+   reader r;
+
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   for (k=0; k < 4; ++k) {
+      stbi_parallel_for *pf = (k & 1) ? reverse_for : forward_for;
+      r.im = im;
+      r.pos = 0;
+      out = (k & 2) ? stbi_load_png_parallel_from_callbacks(&callbacks, &r, &px, &py, &pn, req_comp, pf, NULL)
+                    : stbi_load_png_parallel_from_memory(im->data, im->len, &px, &py, &pn, req_comp, pf, NULL);
+      if (ref) {
+         check(out != NULL, "decode failed");
+         if (out) {
+            check(px == x && py == y && pn == n, "size");
+            check(!memcmp(out, ref, (size_t) x*y*(req_comp ? req_comp : n)), "pixels");
+         }
+      } else
+         check(out == NULL, "decoded what stbi_load rejects");
+      stbi_image_free(out);
+   }
+   stbi_image_free(ref);
+}
+
+// stbi_load_jpeg_parallel_from_memory: the same image as stbi_load whichever
+// order the restart intervals are decoded in, including when one of them is
+// corrupt. The generated files with matching restart markers must actually
+// go through the dispatcher; ones whose markers don't match DRI must not
+static void test_jpeg_parallel(image *im, int req_comp)
+{
+   int x,y,n, px,py,pn, k, calls;
+   stbi_uc *ref, *out;
+
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   for (k=0; k < 2; ++k) {
+      calls = 0;
+      out = stbi_load_jpeg_parallel_from_memory(im->data, im->len, &px, &py, &pn, req_comp, k ? reverse_for : forward_for, &calls);
+      if (ref) {
+         check(out != NULL, "decode failed");
+         if (out) {
+            check(px == x && py == y && pn == n, "size");
+            check(!memcmp(out, ref, (size_t) x*y*(req_comp ? req_comp : n)), "pixels");
+         }
+      } else
+         check(out == NULL, "decoded what stbi_load rejects");
+      if (strstr(im->name, " RST"))
+         check(calls == 0, "mismatched restart markers decoded in parallel");
+      else if (strstr(im->name, "restart "))
+         check(calls == 1, "restart intervals not decoded in parallel");
+      stbi_image_free(out);
+   }
+   stbi_image_free(ref);
+}
+
+// one decoder for the whole run, so every image reuses blocks from the ones
+// before it
+static stbi_decoder *decoder;
+
+// stbi_decoder_load_*: the same image as stbi_load from recycled memory,
+// with an earlier result still held while the next decode runs
+static void test_decoder(image *im, int req_comp)
+{
+   int x,y,n, dx,dy,dn, k;
+   size_t size;
+   stbi_uc *ref, *out[2];
+   stbi_us *ref16, *out16;
+   reader r;
+
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   size = ref ? (size_t) x*y*(req_comp ? req_comp : n) : 0;
+   for (k=0; k < 2; ++k) {
+      r.im = im;
+      r.pos = 0;
+      out[k] = k ? stbi_decoder_load_from_callbacks(decoder, &callbacks, &r, &dx, &dy, &dn, req_comp)
+                 : stbi_decoder_load_from_memory(decoder, im->data, im->len, &dx, &dy, &dn, req_comp);
+      if (ref) {
+         check(out[k] != NULL, "decode failed");
+         if (out[k]) {
+            check(dx == x && dy == y && dn == n, "size");
+            check(!memcmp(out[k], ref, size), "pixels");
+         }
+      } else
+         check(out[k] == NULL, "decoded what stbi_load rejects");
+   }
+   if (out[0] && out[1])
+      check(out[0] != out[1], "handed out a block that is still in use");
+   // scribble over what goes back, so a decode that relies on fresh memory shows up
+   for (k=0; k < 2; ++k) {
+      if (out[k]) memset(out[k], 0xa5, size);
+      stbi_decoder_image_free(decoder, out[k]);
+   }
+   stbi_image_free(ref);
+
+   // other entry points can share the decoder's blocks through its allocator
+   stbi_set_flip_vertically_on_load(cur_flip);
+   ref16 = stbi_load_16_from_memory(im->data, im->len, &x, &y, &n, req_comp);
+   out16 = stbi_load_16_from_memory_with_allocator(im->data, im->len, &dx, &dy, &dn, req_comp, stbi_decoder_allocator(decoder));
+   check(!ref16 == !out16, "16-bit decode disagrees");
+   if (ref16 && out16) {
+      size = (size_t) x*y*(req_comp ? req_comp : n)*2;
+      check(dx == x && dy == y && dn == n && !memcmp(out16, ref16, size), "16-bit pixels");
+      memset(out16, 0xa5, size);
+   }
+   stbi_decoder_image_free(decoder, out16);
+   stbi_image_free(ref16);
+}
+
+// offset of a JPEG's frame header, or -1
+static int is_jpeg(image *im)
+{
+   return im->len >= 2 && im->data[0] == 0xff && im->data[1] == 0xd8;
+}
+
+static int jpeg_sof(image *im)
+{
+   int pos = 2;
+   if (im->len < 4 || !is_jpeg(im)) return -1;
+   while (pos + 10 <= im->len && im->data[pos] == 0xff) {
+      int m = im->data[pos+1];
+      if (m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc) return pos;
+      if (m == 0xda) return -1;
+      pos += 2 + (im->data[pos+2] << 8) + im->data[pos+3];
+   }
+   return -1;
+}
+
+static int is_progressive_jpeg(image *im)
+{
+   int pos = jpeg_sof(im);
+   return pos >= 0 && im->data[pos+1] == 0xc2;
+}
+
+typedef struct
+{
+   int calls, w, h, n;
+   stbi_uc *pixels;
+} preview;
+
+static void preview_cb(void *user, stbi_uc const *pixels, int w, int h, int n)
+{
+   preview *pv = (preview *) user;
+   if (pv->calls++) return;
+   pv->w = w;
+   pv->h = h;
+   pv->n = n;
+   pv->pixels = (stbi_uc *) malloc((size_t) w*h*n);
+   memcpy(pv->pixels, pixels, (size_t) w*h*n);
+}
+
+// the preview against the mean of each 8x8 block of the unflipped image
+static void check_preview(preview *pv, image *im, int req_comp)
+{
+   int x,y,n, pw,ph, i,j,c, comp;
+   double err = 0;
+   stbi_uc *full = reference(im, 0, &x, &y, &n, req_comp);
+   if (!full) return;
+   comp = req_comp ? req_comp : n;
+   pw = (x+7) >> 3;
+   ph = (y+7) >> 3;
+   check(pv->w == pw && pv->h == ph && pv->n == comp, "preview size");
+   if (pv->w == pw && pv->h == ph && pv->n == comp) {
+      for (j=0; j < ph; ++j)
+         for (i=0; i < pw; ++i)
+            for (c=0; c < comp; ++c) {
+               int sx, sy, sum = 0, cnt = 0;
+               for (sy=j*8; sy < j*8+8 && sy < y; ++sy)
+                  for (sx=i*8; sx < i*8+8 && sx < x; ++sx, ++cnt)
+                     sum += full[(sy*x + sx)*comp + c];
+               err += fabs((double) sum / cnt - pv->pixels[((cur_flip ? ph-1-j : j)*pw + i)*comp + c]);
+            }
+      // only DC goes into it, so heavily subsampled chroma (4:1:0, YCCK) costs some detail
+      check(err / (pw*ph*comp) < 16, "preview doesn't look like the image");
+   }
+   stbi_image_free(full);
+}
+
+// stbi_load_jpeg_progressive_*: the same image as stbi_load, and for a
+// progressive JPEG exactly one preview, at 1/8 scale
+static void test_progressive(image *im, int req_comp)
+{
+   int x,y,n, px,py,pn, k;
+   stbi_uc *ref, *out;
+   preview pv;
+   reader r;
+
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   for (k=0; k < 2; ++k) {
+      memset(&pv, 0, sizeof(pv));
+      r.im = im;
+      r.pos = 0;
+      out = k ? stbi_load_jpeg_progressive_from_callbacks(&callbacks, &r, &px, &py, &pn, req_comp, preview_cb, &pv)
+              : stbi_load_jpeg_progressive_from_memory(im->data, im->len, &px, &py, &pn, req_comp, preview_cb, &pv);
+      if (ref) {
+         check(out != NULL, "decode failed");
+         if (out) {
+            check(px == x && py == y && pn == n, "size");
+            check(!memcmp(out, ref, (size_t) x*y*(req_comp ? req_comp : n)), "pixels");
+            if (is_progressive_jpeg(im)) {
+               check(pv.calls == 1, "not one preview");
+               if (pv.calls) check_preview(&pv, im, req_comp);
+            } else
+               check(pv.calls == 0, "previewed a file that isn't progressive");
+         }
+      } else
+         check(out == NULL, "decoded what stbi_load rejects");
+      stbi_image_free(out);
+      free(pv.pixels);
+   }
+   stbi_image_free(ref);
+}
+
+// stbi_load_jpeg_scaled_*: scale_denom 1 is stbi_load's image, 2, 4 and 8
+// give the rounded-up size and about the mean of each d x d box of it, other
+// values fail, and anything that isn't a JPEG comes back at full size
+static void test_scaled(image *im, int req_comp)
+{
+   static const int bad[] = { 0, 3, 16, -2 };
+   int x,y,n, fx,fy,fn, sx,sy,sn, d, k, i,j,c, comp;
+   stbi_uc *ref, *full, *out;
+   reader r;
+
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   full = reference(im, 0, &fx, &fy, &fn, req_comp);
+   comp = req_comp ? req_comp : n;
+   for (k=0; k < 8; ++k) {
+      r.im = im;
+      r.pos = 0;
+      out = (k & 1) ? stbi_load_jpeg_scaled_from_callbacks(&callbacks, &r, &sx, &sy, &sn, req_comp, bad[k >> 1])
+                    : stbi_load_jpeg_scaled_from_memory(im->data, im->len, &sx, &sy, &sn, req_comp, bad[k >> 1]);
+      check(out == NULL && stbi_failure_reason() != NULL, "bad scale_denom accepted");
+      stbi_image_free(out);
+   }
+   for (k=0; k < 8; ++k) {
+      d = 1 << (k >> 1);
+      r.im = im;
+      r.pos = 0;
+      out = (k & 1) ? stbi_load_jpeg_scaled_from_callbacks(&callbacks, &r, &sx, &sy, &sn, req_comp, d)
+                    : stbi_load_jpeg_scaled_from_memory(im->data, im->len, &sx, &sy, &sn, req_comp, d);
+      if (!ref) {
+         // only has to survive
+      } else if (d == 1 || !is_jpeg(im)) {
+         check(out != NULL, "decode failed");
+         if (out) {
+            check(sx == x && sy == y && sn == n, "size");
+            check(!memcmp(out, ref, (size_t) x*y*comp), "pixels");
+         }
+      } else {
+         check(out != NULL, "decode failed");
+         if (out) {
+            check(sx == (x+d-1)/d && sy == (y+d-1)/d && sn == n, "scaled size");
+            if (sx == (x+d-1)/d && sy == (y+d-1)/d && full) {
+               double err = 0;
+               for (j=0; j < sy; ++j)
+                  for (i=0; i < sx; ++i)
+                     for (c=0; c < comp; ++c) {
+                        int bx, by, sum = 0, cnt = 0;
+                        for (by=j*d; by < j*d+d && by < y; ++by)
+                           for (bx=i*d; bx < i*d+d && bx < x; ++bx, ++cnt)
+                              sum += full[(by*x + bx)*comp + c];
+                        err += fabs((double) sum / cnt - out[((cur_flip ? sy-1-j : j)*sx + i)*comp + c]);
+                     }
+               // subsampled planes have fewer samples per scaled pixel the
+               // smaller it gets, which costs detail (RGB with 2x2 R, 4:1:0)
+               check(err / (sx*sy*comp) < 4 + 2*d, "scaled image doesn't look like the image");
+            }
+         }
+      }
+      stbi_image_free(out);
+   }
+   stbi_image_free(full);
+   stbi_image_free(ref);
+}
+
+// stbi_load_region_*: the same pixels as cropping stbi_load's image, for
+// rectangles on and off block boundaries, clipped at every edge; with flip
+// on, the rows of the rectangle come out bottom to top
+static void test_region(image *im, int req_comp)
+{
+   int x,y,n, rx,ry,rw,rh, ox,oy,on, comp, i, k;
+   stbi_uc *ref, *out;
+   reader r;
+
+   ref = reference(im, 0, &x, &y, &n, req_comp);
+   if (!ref) {
+      out = stbi_load_region_from_memory(im->data, im->len, 0, 0, 8, 8, &ox, &oy, &on, req_comp);
+      stbi_image_free(out);
+      return;
+   }
+   comp = req_comp ? req_comp : n;
+   for (i=0; i < 7; ++i) {
+      int regions[7][4] =
+      {
+         { 0, 0, x, y },
+         { 0, 0, 1, 1 },
+         { x/3, y/3, x/3+1, y/3+2 },
+         { 8, 16, 16, 8 },
+         { x-5, y-3, 20, 20 },
+         { -3, -2, 10, 9 },
+         { x-1, 0, 1, y },
+      };
+      int cx0, cy0, cx1, cy1;
+      rx = regions[i][0]; ry = regions[i][1]; rw = regions[i][2]; rh = regions[i][3];
+      cx0 = rx < 0 ? 0 : rx;
+      cy0 = ry < 0 ? 0 : ry;
+      cx1 = rx+rw < x ? rx+rw : x;
+      cy1 = ry+rh < y ? ry+rh : y;
+      for (k=0; k < 2; ++k) {
+         r.im = im;
+         r.pos = 0;
+         out = k ? stbi_load_region_from_callbacks(&callbacks, &r, rx, ry, rw, rh, &ox, &oy, &on, req_comp)
+                 : stbi_load_region_from_memory(im->data, im->len, rx, ry, rw, rh, &ox, &oy, &on, req_comp);
+         if (cx0 >= cx1 || cy0 >= cy1) {
+            check(out == NULL, "decoded an empty region");
+         } else {
+            check(out != NULL, "decode failed");
+            if (out) {
+               int j, same = 1;
+               check(ox == cx1-cx0 && oy == cy1-cy0 && on == n, "size");
+               if (ox == cx1-cx0 && oy == cy1-cy0)
+                  for (j=0; j < oy; ++j)
+                     same &= !memcmp(out + (size_t) (cur_flip ? oy-1-j : j)*ox*comp,
+                                     ref + ((size_t) (cy0+j)*x + cx0)*comp, (size_t) ox*comp);
+               check(same, "pixels");
+            }
+         }
+         stbi_image_free(out);
+      }
+   }
+   check(!stbi_load_region_from_memory(im->data, im->len, x, 0, 4, 4, &ox, &oy, &on, req_comp), "decoded a region right of the image");
+   check(!stbi_load_region_from_memory(im->data, im->len, 0, 0, 0, 4, &ox, &oy, &on, req_comp), "decoded a zero-width region");
+   stbi_image_free(ref);
+}
+
+// stbi_gif_open_* and stbi_gif_next_frame: the frames and delays of
+// stbi_load_gif_from_memory one at a time, flipped the same way, and the
+// first one is stbi_load's image
+static void test_gif(image *im, int req_comp)
+{
+   int x,y,n, gx,gy,gz,gn, ox,oy,on, comp, delay, i, k, ret;
+   int *delays = NULL;
+   size_t size;
+   stbi_uc *ref, *all;
+   stbi_uc const *frame;
+   stbi_gif_frames *gf;
+   reader r;
+
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   stbi_set_flip_vertically_on_load(0); // flipped here, see below
+   all = stbi_load_gif_from_memory(im->data, im->len, &delays, &gx, &gy, &gz, &gn, req_comp);
+   stbi_set_flip_vertically_on_load(cur_flip);
+   comp = req_comp ? req_comp : 4;
+   size = all ? (size_t) gx*gy*comp : 0;
+
+   for (k=0; k < 2; ++k) {
+      r.im = im;
+      r.pos = 0;
+      gf = k ? stbi_gif_open_from_callbacks(&callbacks, &r, &ox, &oy, &on, req_comp)
+             : stbi_gif_open_from_memory(im->data, im->len, &ox, &oy, &on, req_comp);
+      if (!all) {
+         // stbi_load_gif failed: opening may have worked, reading must end
+         if (gf) {
+            for (i=0; i < 100000 && stbi_gif_next_frame(gf, &frame, &delay) > 0; ++i)
+               ;
+            check(i < 100000, "frames without end");
+         }
+         stbi_gif_close(gf);
+         continue;
+      }
+      check(gf != NULL, "open failed");
+      if (!gf) continue;
+      check(ox == gx && oy == gy && on == 4, "size");
+      for (i=0; (ret = stbi_gif_next_frame(gf, &frame, &delay)) > 0; ++i) {
+         if (i < gz) {
+            // load_gif can't flip a converted frame, so flip its unflipped ones
+            int j, same = 1;
+            stbi_uc const *want = all + size*i;
+            for (j=0; j < gy; ++j)
+               same &= !memcmp(frame + (size_t) j*gx*comp, want + (size_t) (cur_flip ? gy-1-j : j)*gx*comp, (size_t) gx*comp);
+            check(same, "frame pixels");
+            check(delay == delays[i], "delay");
+            if (i == 0 && ref)
+               check(!memcmp(frame, ref, size), "first frame isn't stbi_load's image");
+         }
+      }
+      check(ret == 0, "error after the last frame");
+      check(i == gz, "frame count");
+      check(stbi_gif_next_frame(gf, &frame, &delay) == 0, "frames after the end");
+      stbi_gif_close(gf);
+   }
+   stbi_image_free(all);
+   stbi_image_free(delays);
+   stbi_image_free(ref);
+}
+
+// stbi_load_jpeg_yuv_*: one plane per component in the file (four for CMYK
+// and YCCK, where stbi_load gives 3 channels). For YCbCr files the luma plane
+// is stbi_load's greyscale image, and converting the planes gives its RGB
+// image; exactly when nothing is subsampled (through the decoder's own
+// kernel), roughly otherwise. It has no desired_channels, so it only runs
+// once per flip
+static void test_yuv(image *im, int req_comp)
+{
+   int x,y,n, yx,yy, k, sof, file_n;
+   stbi_uc *grey, *rgb, *out;
+   stbi_jpeg_yuv yuv;
+   reader r;
+
+   if (req_comp) return;
+   sof = jpeg_sof(im);
+   file_n = sof >= 0 ? im->data[sof+9] : 0;
+   grey = reference(im, 0, &x, &y, &n, 1);
+   rgb = reference(im, 0, &x, &y, &n, 3);
+   for (k=0; k < 2; ++k) {
+      r.im = im;
+      r.pos = 0;
+      memset(&yuv, 0, sizeof(yuv));
+      out = k ? stbi_load_jpeg_yuv_from_callbacks(&callbacks, &r, &yx, &yy, &yuv)
+              : stbi_load_jpeg_yuv_from_memory(im->data, im->len, &yx, &yy, &yuv);
+      if (!grey) {
+         stbi_image_free(out);
+         continue;
+      }
+      if (im->len < 2 || im->data[0] != 0xff || im->data[1] != 0xd8) {
+         check(out == NULL, "decoded a file that isn't a JPEG");
+         stbi_image_free(out);
+         continue;
+      }
+      check(out != NULL, "decode failed");
+      if (!out) continue;
+      check(yx == x && yy == y && yuv.n == file_n && yuv.w[0] == x && yuv.h[0] == y, "size");
+      if (yx == x && yy == y && yuv.w[0] == x && yuv.h[0] == y && (file_n == 1 || (file_n == 3 && yuv.ycbcr))) {
+         int j, same = 1;
+         for (j=0; j < y; ++j)
+            same &= !memcmp(yuv.plane[0] + (size_t) (cur_flip ? y-1-j : j)*x, grey + (size_t) j*x, x);
+         check(same, "luma");
+      }
+      if (yx == x && yy == y && file_n == 3 && yuv.ycbcr) {
+         stbi__jpeg j;
+         stbi_uc *row = (stbi_uc *) malloc((size_t) x*5), *cb = row + x*3, *cr = cb + x;
+         int i, yj, exact = yuv.w[1] == x && yuv.h[1] == y && yuv.w[2] == x && yuv.h[2] == y;
+         double err = 0;
+         stbi__setup_jpeg(&j);
+         for (yj=0; yj < y; ++yj) {
+            // nearest chroma samples; the planes come out flipped like everything else
+            int r1 = yj * yuv.h[1] / y, r2 = yj * yuv.h[2] / y, ry = cur_flip ? y-1-yj : yj;
+            if (cur_flip) { r1 = yuv.h[1]-1-r1; r2 = yuv.h[2]-1-r2; }
+            for (i=0; i < x; ++i) {
+               cb[i] = yuv.plane[1][(size_t) r1*yuv.w[1] + i * yuv.w[1] / x];
+               cr[i] = yuv.plane[2][(size_t) r2*yuv.w[2] + i * yuv.w[2] / x];
+            }
+            j.YCbCr_to_RGB_kernel(row, yuv.plane[0] + (size_t) ry*x, cb, cr, x, 3);
+            if (exact)
+               check(!memcmp(row, rgb + (size_t) yj*x*3, (size_t) x*3), "converted planes");
+            else
+               for (i=0; i < x*3; ++i)
+                  err += abs(row[i] - rgb[(size_t) yj*x*3 + i]);
+         }
+         if (!exact)
+            check(err / ((double) x*y*3) < 6, "converted planes don't look like the image");
+         free(row);
+      }
+      stbi_image_free(out);
+   }
+   stbi_image_free(grey);
+   stbi_image_free(rgb);
+}
+
+typedef struct
+{
+   int calls, last, in_order;
+   int *seen;
+   stbi_batch_result *results;
+} batch_log;
+
+static void batch_done(void *user, int index, stbi_batch_result *result)
+{
+   batch_log *log = (batch_log *) user;
+   ++log->calls;
+   check(result == &log->results[index], "done got the wrong result");
+   check(!result->data == !!result->failure_reason, "done before the item was finished");
+   if (log->in_order)
+      check(index == log->last + 1, "done out of order");
+   log->last = index;
+   ++log->seen[index];
+}
+
+// stbi_load_batch: the whole corpus, plus an item with nothing to load,
+// each with a different desired_channels, serially and through both
+// stand-in dispatchers; every result is stbi_load's, and done sees every
+// item once, in order when asked. It runs on the first image only
+static void test_batch(image *im, int req_comp)
+{
+   int count = corpus_n + 1, i, k, ok, want_ok;
+   stbi_batch_item *items;
+   stbi_batch_result *results;
+   batch_log log;
+
+   if (im != &corpus[0]) return;
+   items = (stbi_batch_item *) calloc(count, sizeof(*items));
+   results = (stbi_batch_result *) calloc(count, sizeof(*results));
+   log.seen = (int *) calloc(count, sizeof(int));
+   log.results = results;
+   for (i=0; i < corpus_n; ++i) {
+      items[i].buffer = corpus[i].data;
+      items[i].len = corpus[i].len;
+      items[i].desired_channels = (i + req_comp) % 5;
+   }
+   items[corpus_n].desired_channels = req_comp;
+
+   for (k=0; k < 4; ++k) {
+      // 0: serial, 1: forward in order, 2: reversed in order, 3: reversed as ready
+      stbi_parallel_for *pf = k == 0 ? NULL : k == 1 ? forward_for : reverse_for;
+      int order = k == 3 ? STBI_BATCH_AS_READY : STBI_BATCH_IN_ORDER;
+      log.calls = 0;
+      log.last = -1;
+      log.in_order = order == STBI_BATCH_IN_ORDER;
+      memset(log.seen, 0, count * sizeof(int));
+      ok = stbi_load_batch(items, count, results, 3, pf, NULL, batch_done, &log, order);
+
+      want_ok = 0;
+      for (i=0; i < count; ++i) {
+         int x,y,n;
+         stbi_uc *ref = NULL;
+         cur_image = &corpus[i < corpus_n ? i : 0];
+         if (i < corpus_n)
+            ref = reference(&corpus[i], cur_flip, &x, &y, &n, items[i].desired_channels);
+         want_ok += ref != NULL;
+         check(log.seen[i] == 1, "done not called once");
+         if (ref) {
+            check(results[i].data != NULL, "decode failed");
+            if (results[i].data) {
+               check(results[i].x == x && results[i].y == y && results[i].comp == n, "size");
+               check(!memcmp(results[i].data, ref, (size_t) x*y*(items[i].desired_channels ? items[i].desired_channels : n)), "pixels");
+            }
+         } else {
+            check(results[i].data == NULL, "decoded what stbi_load rejects");
+            check(results[i].failure_reason != NULL, "no failure reason");
+         }
+         stbi_image_free(ref);
+         stbi_batch_image_free(results[i].data);
+      }
+      cur_image = im;
+      check(ok == want_ok, "wrong count of successes");
+      check(log.calls == count, "done call count");
+      check(stbi_failure_reason() != NULL, "no failure reason for the batch");
+   }
+   free(items);
+   free(results);
+   free(log.seen);
+}
+
+#define TEMP_FILE "image_api_test.tmp"
+
+static void write_file(const char *filename, unsigned char const *data, int len)
+{
+   FILE *f = fopen(filename, "wb");
+   if (!f) return;
+   fwrite(data, 1, len, f);
+   fclose(f);
+}
+
+// stbi_load and friends by filename (mapped with STBI_MMAP) against the
+// same file read through stdio; both must be stbi_load_from_memory's image,
+// or fail alike
+static void test_file(image *im, int req_comp)
+{
+   int x,y,n, mx,my,mn, sx,sy,sn, comp;
+   stbi_uc *ref, *mapped, *read;
+   stbi_us *mapped16, *read16;
+   float *mappedf, *readf;
+   FILE *f;
+
+   remove(TEMP_FILE); // in case a killed run left its FIFO behind
+   write_file(TEMP_FILE, im->data, im->len);
+   f = fopen(TEMP_FILE, "rb");
+   if (!f) {
+      check(0, "can't write " TEMP_FILE);
+      return;
+   }
+   ref = reference(im, cur_flip, &x, &y, &n, req_comp);
+   comp = req_comp ? req_comp : n;
+   mapped = stbi_load(TEMP_FILE, &mx, &my, &mn, req_comp);
+   read = stbi_load_from_file(f, &sx, &sy, &sn, req_comp);
+   check(!ref == !mapped && !ref == !read, "file and memory loads disagree");
+   if (ref && mapped && read)
+      check(mx == x && my == y && mn == n && sx == x && sy == y && sn == n &&
+            !memcmp(mapped, ref, (size_t) x*y*comp) && !memcmp(read, ref, (size_t) x*y*comp), "pixels");
+   stbi_image_free(ref);
+   stbi_image_free(mapped);
+   stbi_image_free(read);
+
+   rewind(f);
+   mapped16 = stbi_load_16(TEMP_FILE, &mx, &my, &mn, req_comp);
+   read16 = stbi_load_from_file_16(f, &sx, &sy, &sn, req_comp);
+   check(!mapped16 == !read16, "16-bit file loads disagree");
+   if (mapped16 && read16)
+      check(mx == sx && my == sy && mn == sn && !memcmp(mapped16, read16, (size_t) sx*sy*(req_comp ? req_comp : sn)*2), "16-bit pixels");
+   stbi_image_free(mapped16);
+   stbi_image_free(read16);
+
+   rewind(f);
+   mappedf = stbi_loadf(TEMP_FILE, &mx, &my, &mn, req_comp);
+   readf = stbi_loadf_from_file(f, &sx, &sy, &sn, req_comp);
+   check(!mappedf == !readf, "float file loads disagree");
+   if (mappedf && readf)
+      check(mx == sx && my == sy && mn == sn && !memcmp(mappedf, readf, (size_t) sx*sy*(req_comp ? req_comp : sn)*sizeof(float)), "float pixels");
+   stbi_image_free(mappedf);
+   stbi_image_free(readf);
+   fclose(f);
+
+   // the files mmap turns down: empty ones, missing ones and pipes
+   if (im == &corpus[0] && req_comp == 0) {
+      write_file(TEMP_FILE, im->data, 0);
+      check(!stbi_load(TEMP_FILE, &mx, &my, &mn, 0) && stbi_failure_reason(), "loaded an empty file");
+      remove(TEMP_FILE);
+      check(!stbi_load(TEMP_FILE, &mx, &my, &mn, 0) && stbi_failure_reason(), "loaded a missing file");
+#ifdef HAVE_FIFO
+      if (mkfifo(TEMP_FILE, 0600) == 0) {
+         pid_t pid = fork();
+         if (pid == 0) {
+            write_file(TEMP_FILE, im->data, im->len);
+            _exit(0);
+         }
+         ref = reference(im, cur_flip, &x, &y, &n, 0);
+         mapped = pid > 0 ? stbi_load(TEMP_FILE, &mx, &my, &mn, 0) : NULL;
+         check(ref && mapped && mx == x && my == y && mn == n && !memcmp(mapped, ref, (size_t) x*y*n), "FIFO");
+         if (pid > 0) waitpid(pid, NULL, 0);
+         stbi_image_free(ref);
+         stbi_image_free(mapped);
+      }
+#endif
+   }
+   remove(TEMP_FILE);
+}
+
+// the formats whose test or info function accepts the first len bytes of im
+static int accepted_formats(image *im, int len)
+{
+   static int (* const test[9])(stbi__context *s) =
+   {
+      stbi__jpeg_test, stbi__png_test, stbi__bmp_test, stbi__gif_test, stbi__psd_test,
+      stbi__pic_test, stbi__pnm_test, stbi__hdr_test, stbi__tga_test,
+   };
+   static int (* const info[9])(stbi__context *s, int *x, int *y, int *comp) =
+   {
+      stbi__jpeg_info, stbi__png_info, stbi__bmp_info, stbi__gif_info, stbi__psd_info,
+      stbi__pic_info, stbi__pnm_info, stbi__hdr_info, stbi__tga_info,
+   };
+   stbi__context s;
+   int i, x, y, n, fmt = 0;
+   for (i=0; i < 9; ++i) {
+      stbi__start_mem(&s, im->data, len);
+      if (test[i](&s)) fmt |= 1 << i;
+      stbi__start_mem(&s, im->data, len);
+      if (info[i](&s, &x, &y, &n)) fmt |= 1 << i;
+   }
+   return fmt;
+}
+
+// stbi_info_*: sniffing the first bytes never rules out a format that would
+// have taken the file, whole or cut short, TGA included; and stbi_info_many
+// on the whole corpus as files, plus truncated and missing ones, must say
+// what stbi_info says about each
+static void test_info(image *im, int req_comp)
+{
+   int x,y,n, ix,iy,in, i, k, len, count, ok, expect;
+   stbi_uc *ref;
+   stbi__context s;
+   char (*names)[64];
+   char const **list;
+   stbi_info_result *results;
+
+   if (req_comp || cur_flip) return; // neither affects stbi_info
+   for (len=0; len <= im->len; len += len < 20 ? 1 : im->len/3 + 1) {
+      stbi__start_mem(&s, im->data, len);
+      check((accepted_formats(im, len) & ~stbi__sniff(&s)) == 0, "sniffing ruled out a format that accepts the file");
+   }
+   ref = reference(im, 0, &x, &y, &n, 0);
+   // not the channel count: the header scan doesn't get as far as a PNG's tRNS
+   if (ref)
+      check(stbi_info_from_memory(im->data, im->len, &ix, &iy, &in) && ix == x && iy == y, "info");
+   stbi_image_free(ref);
+
+   if (im != &corpus[0]) return;
+   count = 2*corpus_n + 1;
+   names = (char (*)[64]) malloc(count * sizeof(*names));
+   list = (char const **) malloc(count * sizeof(*list));
+   results = (stbi_info_result *) malloc(count * sizeof(*results));
+   for (i=0; i < corpus_n; ++i) {
+      sprintf(names[2*i], "image_api_test.%d.tmp", i);
+      sprintf(names[2*i+1], "image_api_test.%dt.tmp", i);
+      write_file(names[2*i], corpus[i].data, corpus[i].len);
+      write_file(names[2*i+1], corpus[i].data, corpus[i].len / 2);
+   }
+   strcpy(names[count-1], "image_api_test.missing.tmp");
+   remove(names[count-1]);
+   for (i=0; i < count; ++i)
+      list[i] = names[i];
+   for (k=0; k < 3; ++k) {
+      stbi_parallel_for *pf = k == 0 ? NULL : k == 1 ? forward_for : reverse_for;
+      memset(results, 0x55, count * sizeof(*results));
+      ok = stbi_info_many(list, count, results, pf, NULL);
+      expect = 0;
+      for (i=0; i < count; ++i) {
+         stbi_info_result *r = &results[i];
+         if (stbi_info(list[i], &ix, &iy, &in)) {
+            ++expect;
+            check(r->failure_reason == NULL && r->x == ix && r->y == iy && r->comp == in, "info_many disagrees with stbi_info");
+         } else {
+            const char *reason = stbi_failure_reason();
+            check(r->failure_reason != NULL && r->x == 0 && r->y == 0 && r->comp == 0, "info_many failure");
+            if (r->failure_reason && reason)
+               check(!strcmp(r->failure_reason, reason), "info_many failure reason");
+         }
+      }
+      check(ok == expect, "info_many count");
+      check(results[count-1].failure_reason != NULL, "info_many on a missing file");
+   }
+   for (i=0; i < count; ++i)
+      remove(names[i]);
+   free(results);
+   free(list);
+   free(names);
+}
+
+typedef struct
+{
+   const char *name;
+   void (*run)(image *im, int req_comp);
+} api_test;
+
+static api_test tests[] =
+{
+   { "stream", test_stream },
+   { "load_into", test_load_into },
+   { "allocator", test_allocator },
+   { "png_parallel", test_png_parallel },
+   { "jpeg_parallel", test_jpeg_parallel },
+   { "decoder", test_decoder },
+   { "progressive", test_progressive },
+   { "scaled", test_scaled },
+   { "region", test_region },
+   { "gif", test_gif },
+   { "yuv", test_yuv },
+   { "batch", test_batch },
+   { "file", test_file },
+   { "info", test_info },
+};
+
+int main(int argc, char **argv)
+{
+   int i, t;
+
+   make_corpus();
+   for (i=1; i < argc; ++i)
+      add_file(argv[i]);
+   decoder = stbi_decoder_create();
+
+   for (t=0; t < (int) (sizeof(tests)/sizeof(tests[0])); ++t) {
+      cur_test = tests[t].name;
+      for (cur_flip=0; cur_flip < 2; ++cur_flip) {
+         stbi_set_flip_vertically_on_load(cur_flip);
+         for (i=0; i < corpus_n; ++i) {
+            cur_image = &corpus[i];
+            for (cur_req_comp=0; cur_req_comp <= 4; ++cur_req_comp)
+               tests[t].run(cur_image, cur_req_comp);
+         }
+      }
+   }
+   stbi_set_flip_vertically_on_load(0);
+   stbi_decoder_free(decoder);
+
+   printf("%d images, %d checks, %d failed\n", corpus_n, checks, failures);
+   return failures != 0;
+}
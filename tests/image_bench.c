@@ -0,0 +1,408 @@
+// Decode throughput benchmark for stb_image.
+//
+//    image_bench [-n iterations] [-noprofile] [file...]
+//
+// Decodes a corpus generated here from fixed seeds (large JPEG, PNG, GIF and
+// HDR images, the same bytes on every run) plus any files named on the
+// command line, e.g. pngsuite/*/*.png. Each image is decoded -n times (5 by
+// default) and its fastest decode is kept; per format it reports images/s
+// and MB/s of decoded pixels. Then the corpus is decoded once more with the
+// STBI_PROFILE hooks switched on, and the time is broken down by stage.
+// The hooks cost a couple of clock reads per JPEG MCU row, so that pass is
+// slower than the timed ones and only the percentages are meaningful.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void bench_profile(int stage, int begin);
+#define STBI_PROFILE(stage,begin)  bench_profile(stage, begin)
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#ifdef _WIN32
+#include <windows.h>
+static double now(void)
+{
+   static LARGE_INTEGER freq;
+   LARGE_INTEGER t;
+   if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+   QueryPerformanceCounter(&t);
+   return (double) t.QuadPart / (double) freq.QuadPart;
+}
+#else
+#include <time.h>
+static double now(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec * 1e-9;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// profiling hooks: charge elapsed time to the innermost open stage
+
+static int    prof_on;
+static double prof_time[STBI_PROFILE_STAGES];
+static int    prof_stack[16], prof_depth;
+static double prof_mark;
+
+static void bench_profile(int stage, int begin)
+{
+   double t;
+   if (!prof_on) return;
+   t = now();
+   if (prof_depth)
+      prof_time[prof_stack[prof_depth-1]] += t - prof_mark;
+   if (begin) {
+      if (prof_depth < 16) prof_stack[prof_depth] = stage;
+      ++prof_depth;
+   } else
+      --prof_depth;
+   prof_mark = t;
+}
+
+static const char *stage_name[STBI_PROFILE_STAGES] = {
+   "entropy", "idct", "upsample", "color", "inflate", "unfilter"
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// corpus
+
+typedef struct
+{
+   char name[256];
+   char format[8];
+   unsigned char *data;
+   int len, cap;
+} image;
+
+static image *corpus;
+static int corpus_n, corpus_cap;
+
+static image *add_image(const char *name, const char *format)
+{
+   image *im;
+   if (corpus_n == corpus_cap) {
+      corpus_cap = corpus_cap ? corpus_cap*2 : 64;
+      corpus = (image *) realloc(corpus, corpus_cap * sizeof(*corpus));
+   }
+   im = &corpus[corpus_n++];
+   memset(im, 0, sizeof(*im));
+   strncpy(im->name, name, sizeof(im->name)-1);
+   strncpy(im->format, format, sizeof(im->format)-1);
+   return im;
+}
+
+static void append(image *im, const void *data, int len)
+{
+   if (im->len + len > im->cap) {
+      while (im->len + len > im->cap)
+         im->cap = im->cap ? im->cap*2 : 65536;
+      im->data = (unsigned char *) realloc(im->data, im->cap);
+   }
+   memcpy(im->data + im->len, data, len);
+   im->len += len;
+}
+
+static void write_func(void *context, void *data, int len)
+{
+   append((image *) context, data, len);
+}
+
+static unsigned int rng_state;
+static unsigned int rng(void)
+{
+   rng_state ^= rng_state << 13;
+   rng_state ^= rng_state >> 17;
+   rng_state ^= rng_state << 5;
+   return rng_state;
+}
+
+// smooth gradients with some noise, so the encoders produce typical output;
+// integer-only so every platform generates the same bytes
+static unsigned char *make_pixels(int w, int h, int comp, unsigned int seed)
+{
+   unsigned char *p = (unsigned char *) malloc((size_t) w*h*comp);
+   int x,y,c;
+   rng_state = seed;
+   for (y=0; y < h; ++y) {
+      for (x=0; x < w; ++x) {
+         for (c=0; c < comp; ++c) {
+            int t = (x*(c+2) + y*(3-c) + ((x*y) >> 9)) & 511;
+            int v = (t < 256 ? t : 511-t) + (int) (rng() % 17) - 8;
+            p[((size_t) y*w + x)*comp + c] = (unsigned char) (v < 0 ? 0 : v > 255 ? 255 : v);
+         }
+      }
+   }
+   return p;
+}
+
+// stb_image_write has no GIF writer; this is a plain LZW encoder with an
+// 8-bit palette, clearing the code table whenever it fills up
+static void gif_bits(image *im, unsigned char *block, int *nblock, unsigned int *bits, int *nbits, int code, int width)
+{
+   *bits |= (unsigned int) code << *nbits;
+   *nbits += width;
+   while (*nbits >= 8) {
+      block[1 + (*nblock)++] = (unsigned char) *bits;
+      *bits >>= 8;
+      *nbits -= 8;
+      if (*nblock == 255) {
+         block[0] = 255;
+         append(im, block, 256);
+         *nblock = 0;
+      }
+   }
+}
+
+static void make_gif(image *im, int w, int h, unsigned int seed)
+{
+   static short next[4096][256];
+   unsigned char *rgb = make_pixels(w, h, 3, seed);
+   unsigned char header[13+768+10], block[256];
+   unsigned int bits = 0;
+   int nbits = 0, nblock = 0;
+   int i, code = 258, width = 9, prefix;
+   size_t n = (size_t) w*h;
+
+   memcpy(header, "GIF89a", 6);
+   header[6] = (unsigned char) w; header[7] = (unsigned char) (w >> 8);
+   header[8] = (unsigned char) h; header[9] = (unsigned char) (h >> 8);
+   header[10] = 0xf7; header[11] = 0; header[12] = 0;
+   for (i=0; i < 256; ++i) { // 3-3-2 palette
+      header[13+i*3+0] = (unsigned char) ((i >> 5)     * 255 / 7);
+      header[13+i*3+1] = (unsigned char) ((i >> 2 & 7) * 255 / 7);
+      header[13+i*3+2] = (unsigned char) ((i & 3)      * 255 / 3);
+   }
+   header[781] = 0x2c;
+   memset(header+782, 0, 4);
+   header[786] = (unsigned char) w; header[787] = (unsigned char) (w >> 8);
+   header[788] = (unsigned char) h; header[789] = (unsigned char) (h >> 8);
+   header[790] = 0;
+   append(im, header, 791);
+   append(im, "\x08", 1);
+
+   for (i=0; i < (int) n; ++i) // quantize in place to palette indices
+      rgb[i] = (unsigned char) ((rgb[i*3] & 0xe0) | (rgb[i*3+1] >> 5 << 2) | (rgb[i*3+2] >> 6));
+
+   memset(next, 0, sizeof(next));
+   gif_bits(im, block, &nblock, &bits, &nbits, 256, width);
+   prefix = rgb[0];
+   for (i=1; i < (int) n; ++i) {
+      int c = rgb[i];
+      if (next[prefix][c]) {
+         prefix = next[prefix][c];
+         continue;
+      }
+      gif_bits(im, block, &nblock, &bits, &nbits, prefix, width);
+      if (code < 4096) {
+         next[prefix][c] = (short) code++;
+         if (code > (1 << width) && width < 12) ++width;
+      } else {
+         gif_bits(im, block, &nblock, &bits, &nbits, 256, width);
+         memset(next, 0, sizeof(next));
+         code = 258;
+         width = 9;
+      }
+      prefix = c;
+   }
+   gif_bits(im, block, &nblock, &bits, &nbits, prefix, width);
+   gif_bits(im, block, &nblock, &bits, &nbits, 257, width);
+   if (nbits) gif_bits(im, block, &nblock, &bits, &nbits, 0, 8 - nbits);
+   if (nblock) {
+      block[0] = (unsigned char) nblock;
+      append(im, block, nblock + 1);
+   }
+   append(im, "\x00\x3b", 2);
+   free(rgb);
+}
+
+static void make_corpus(void)
+{
+   unsigned char *p;
+   float *f;
+   size_t i;
+
+   p = make_pixels(2048, 1536, 3, 1);
+   stbi_write_jpg_to_func(write_func, add_image("generated 2048x1536 rgb q85 (4:2:0)", "jpeg"), 2048, 1536, 3, p, 85);
+   stbi_write_jpg_to_func(write_func, add_image("generated 2048x1536 rgb q95 (4:4:4)", "jpeg"), 2048, 1536, 3, p, 95);
+   stbi_write_png_to_func(write_func, add_image("generated 2048x1536 rgb", "png"), 2048, 1536, 3, p, 2048*3);
+   free(p);
+
+   p = make_pixels(2048, 1536, 1, 2);
+   stbi_write_jpg_to_func(write_func, add_image("generated 2048x1536 grey q90", "jpeg"), 2048, 1536, 1, p, 90);
+   free(p);
+
+   p = make_pixels(1024, 1024, 4, 3);
+   stbi_write_png_to_func(write_func, add_image("generated 1024x1024 rgba", "png"), 1024, 1024, 4, p, 1024*4);
+   free(p);
+
+   make_gif(add_image("generated 1024x768 256 colors", "gif"), 1024, 768, 4);
+
+   p = make_pixels(2048, 1024, 3, 5);
+   f = (float *) malloc(2048*1024*3 * sizeof(float));
+   for (i=0; i < 2048*1024*3; ++i)
+      f[i] = p[i] * p[i] / 4096.0f; // up to ~16, so the exponents vary
+   stbi_write_hdr_to_func(write_func, add_image("generated 2048x1024 rgb", "hdr"), 2048, 1024, 3, f);
+   free(f);
+   free(p);
+}
+
+static void add_file(const char *filename)
+{
+   const char *ext = strrchr(filename, '.');
+   char format[8];
+   image *im;
+   FILE *fp;
+   long len;
+   int i;
+
+   fp = fopen(filename, "rb");
+   if (!fp) { fprintf(stderr, "can't open %s\n", filename); return; }
+   fseek(fp, 0, SEEK_END);
+   len = ftell(fp);
+   fseek(fp, 0, SEEK_SET);
+
+   for (i=0; ext && ext[i+1] && i < 7; ++i)
+      format[i] = (char) (ext[i+1] | 0x20);
+   format[i] = 0;
+   if (!strcmp(format, "jpg")) strcpy(format, "jpeg");
+   im = add_image(filename, i ? format : "?");
+   im->cap = (int) len + 1;
+   im->data = (unsigned char *) malloc(im->cap);
+   im->len = (int) fread(im->data, 1, len, fp);
+   fclose(fp);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// timing
+
+// decode once; returns the decoded size in bytes, or 0 on failure
+static double decode(image *im)
+{
+   int x,y,n;
+   void *out;
+   double bytes;
+   if (!strcmp(im->format, "hdr")) {
+      out = stbi_loadf_from_memory(im->data, im->len, &x, &y, &n, 0);
+      bytes = (double) x*y*n*sizeof(float);
+   } else {
+      out = stbi_load_from_memory(im->data, im->len, &x, &y, &n, 0);
+      bytes = (double) x*y*n;
+   }
+   if (!out) return 0;
+   stbi_image_free(out);
+   return bytes;
+}
+
+typedef struct
+{
+   char format[8];
+   int images, failed;
+   double in_bytes, out_bytes, seconds;
+   double stage[STBI_PROFILE_STAGES], profiled;
+} format_stats;
+
+static format_stats stats[32];
+static int stats_n;
+
+static format_stats *stats_for(const char *format)
+{
+   int i;
+   for (i=0; i < stats_n; ++i)
+      if (!strcmp(stats[i].format, format))
+         return &stats[i];
+   if (stats_n == 32) return &stats[31];
+   strcpy(stats[stats_n].format, format);
+   return &stats[stats_n++];
+}
+
+int main(int argc, char **argv)
+{
+   int i, k, iterations = 5, profile = 1;
+   double total_in = 0, total_out = 0, total_s = 0;
+
+   for (i=1; i < argc; ++i) {
+      if (!strcmp(argv[i], "-n") && i+1 < argc)
+         iterations = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-noprofile"))
+         profile = 0;
+      else
+         add_file(argv[i]);
+   }
+   if (iterations < 1) iterations = 1;
+   make_corpus();
+
+   for (i=0; i < corpus_n; ++i) {
+      format_stats *fs = stats_for(corpus[i].format);
+      double best = 1e30, bytes = 0;
+      for (k=0; k < iterations; ++k) {
+         double t = now();
+         bytes = decode(&corpus[i]);
+         t = now() - t;
+         if (t < best) best = t;
+      }
+      if (bytes == 0) {
+         ++fs->failed;
+         continue;
+      }
+      ++fs->images;
+      fs->in_bytes += corpus[i].len;
+      fs->out_bytes += bytes;
+      fs->seconds += best;
+
+      if (profile) {
+         double t;
+         memset(prof_time, 0, sizeof(prof_time));
+         prof_depth = 0;
+         prof_on = 1;
+         t = now();
+         decode(&corpus[i]);
+         fs->profiled += now() - t;
+         prof_on = 0;
+         for (k=0; k < STBI_PROFILE_STAGES; ++k)
+            fs->stage[k] += prof_time[k];
+      }
+   }
+
+   printf("%-6s %7s %7s %9s %9s %10s %10s %9s\n", "format", "images", "failed", "in MB", "out MB", "ms", "images/s", "MB/s");
+   for (i=0; i < stats_n; ++i) {
+      format_stats *fs = &stats[i];
+      printf("%-6s %7d %7d %9.2f %9.2f %10.2f %10.1f %9.1f\n", fs->format, fs->images, fs->failed,
+             fs->in_bytes / 1e6, fs->out_bytes / 1e6, fs->seconds * 1e3,
+             fs->seconds > 0 ? fs->images / fs->seconds : 0, fs->seconds > 0 ? fs->out_bytes / 1e6 / fs->seconds : 0);
+      total_in += fs->in_bytes;
+      total_out += fs->out_bytes;
+      total_s += fs->seconds;
+   }
+   printf("%-6s %7s %7s %9.2f %9.2f %10.2f %10s %9.1f\n", "total", "", "", total_in / 1e6, total_out / 1e6, total_s * 1e3, "",
+          total_s > 0 ? total_out / 1e6 / total_s : 0);
+
+   if (profile) {
+      printf("\n%% of profiled decode time by stage\n%-6s", "format");
+      for (k=0; k < STBI_PROFILE_STAGES; ++k)
+         printf(" %9s", stage_name[k]);
+      printf(" %9s\n", "other");
+      for (i=0; i < stats_n; ++i) {
+         format_stats *fs = &stats[i];
+         double other = fs->profiled;
+         if (fs->profiled <= 0) continue;
+         printf("%-6s", fs->format);
+         for (k=0; k < STBI_PROFILE_STAGES; ++k) {
+            printf(" %9.1f", 100 * fs->stage[k] / fs->profiled);
+            other -= fs->stage[k];
+         }
+         printf(" %9.1f\n", 100 * other / fs->profiled);
+      }
+   }
+   return 0;
+}